@@ -55,13 +55,28 @@
 
 #include "katana_config.h"
 #include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
 #include "util/util.h"
 #include "util/logging.h"
 
+//parses the argument of option opt, which must be a whole
+//non-negative number of units (milliseconds, bytes)
+static int parseCountOption(char opt,char* arg,char* units)
+{
+  char* end;
+  long value=strtol(arg,&end,10);
+  if(end==arg || *end || value<0 || value>INT_MAX)
+  {
+    death("-%c takes a number of %s, not '%s'\n",opt,units,arg);
+  }
+  return value;
+}
+
 void configureFromCommandLine(int argc,char** argv)
 {
   int opt;
-  while((opt=getopt(argc,argv,"hcslrHgpo:"))>0)
+  while((opt=getopt(argc,argv,"hcslrHgpdwb:S:L:o:"))>0)
   {
     switch(opt)
     {
@@ -109,6 +124,29 @@ void configureFromCommandLine(int argc,char** argv)
     case 'H':
       setFlag(EKCF_EH_FRAME,true);
       break;
+    case 'd':
+      //call patched functions directly rather than through the trampoline
+      setFlag(EKCF_P_RETARGET_REFERENCES,true);
+      break;
+    case 'w':
+      //don't treat patches that only change code specially
+      setFlag(EKCF_P_ALWAYS_SAFE_POINT,true);
+      break;
+    case 'b':
+      //the most milliseconds the target may be stopped for while the
+      //patch goes in. Past that it is backed out
+      config.maxPauseMillis=parseCountOption('b',optarg,"milliseconds");
+      break;
+    case 'S':
+      //watch where the target's threads spend their time for this
+      //many milliseconds before picking safe point breakpoints
+      config.safetySampleMillis=parseCountOption('S',optarg,"milliseconds");
+      break;
+    case 'L':
+      //transform relocated variables of at least this many bytes
+      //when the target first uses them
+      config.lazyTransformMinBytes=parseCountOption('L',optarg,"bytes");
+      break;
     case 'r':
       //this is a debug option at the moment. It is not intended to be
       //used generally. It's functionality may change from time to
@@ -53,7 +53,31 @@
   Description: miscellaneous constants for Katana
 */
 
-#define WAIT_FOR_SAFE_PATCHING_USLEEP 10000
+//how long to let the target run waiting for a safe point breakpoint
+//before stopping it and checking its threads again. They may have
+//become safe without passing the breakpoint (longjmp, thread exit)
+#define RECHECK_SAFETY_MILLIS 2000
+//how often the target's stacks are sampled before choosing where to
+//put safe point breakpoints (see config.safetySampleMillis)
+#define SAFETY_SAMPLE_INTERVAL_MILLIS 5
+//an unsafe function seen on a thread's stack in at least this many
+//samples and never left in any of them is taken to be one the thread
+//is parked in
+#define PARKED_MIN_SAMPLES 3
+//how long to wait for the target to touch variables whose
+//transformation was put off until their first use before
+//transforming the rest anyway (see config.lazyTransformMinBytes)
+#define LAZY_TRANSFORM_MAX_MILLIS 30000
+//how long code katana runs in the target (see remotecall.h) may take
+//before it is given up on. A remote malloc can block forever on a
+//lock held by one of the threads we keep stopped
+#define REMOTE_CALL_TIMEOUT_MILLIS 5000
+//the most bytes of a function's entry a trampoline overwrites: an
+//indirect jmp through an absolute address stored after it
+#define MAX_TRAMPOLINE_LEN (2+4+sizeof(addr_t))
+//the most buckets or Bloom filter words a .gnu.hash in the target is
+//believed to have. Anything bigger is taken to be garbage
+#define MAX_GNU_HASH_ENTRIES (1<<20)
 #define DWARF_VERSION 4
 #define DWARF_CIE_VERSION 4
 #define DEBUG_CIE_ID 0xffffffff //the value of CIE_id as defined by the DWARFv4 spec
@@ -73,6 +73,22 @@ List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* p
 //keys are old addresses of data objects (variables). Values are the new addresses
 Map* dataMoved=NULL;
 
+//memory already allocated in the target for heap objects which will
+//be relocated. Keys are the old addresses of the objects, values the
+//new ones. Filled by preallocateHeapObjects so that makePatchData
+//doesn't have to call mallocTarget once per object
+static Map* heapPreallocated=NULL;
+
+//heap objects found by planHeapAllocations
+typedef struct
+{
+  Map* visited;//old addresses of objects already walked
+  addr_t* oldAddrs;
+  word_t* sizes;
+  int num;
+  int allocated;
+} HeapAllocPlan;
+
 //this is the stack of saved register states used by the
 //DW_CFA_remember_state and DW_CFA_restore_state instructions
 static Stack* stateStack;
@@ -457,7 +473,15 @@ List* makePatchData(PoRegRule* rule,SpecialRegsState* state,ElfInfo* patch,ElfIn
         //      lacking important information)
         
         //pointedObjectNewLocation=getFreeSpaceInTarget(patch->fdes[rule->index-1].memSize);
-        pointedObjectNewLocation=mallocTarget(patch->callFrameInfo.fdes[rule->index-1].memSize);
+        addr_t* preallocated=heapPreallocated?mapGet(heapPreallocated,&tmpState.currAddrOld):NULL;
+        if(preallocated)
+        {
+          pointedObjectNewLocation=*preallocated;
+        }
+        else
+        {
+          pointedObjectNewLocation=mallocTarget(patch->callFrameInfo.fdes[rule->index-1].memSize);
+        }
         logprintf(ELL_INFO_V2,ELS_DWARF_FRAME,"No symbol associated with object at address 0x%zx we have to relocate that we have a pointer to. Mallocced new memory at 0x%zx\n",tmpState.currAddrOld,pointedObjectNewLocation);
       }
 
@@ -538,6 +562,106 @@ List* generatePatchesFromFDEAndState(FDE* fde,SpecialRegsState* state,ElfInfo* p
   return liStart;
 }
 
+//walks the same graph of objects generatePatchesFromFDEAndState will,
+//but only to find the heap objects (those pointed to but not part
+//of any variable) which will need new memory, and how much
+static void planHeapAllocations(FDE* fde,SpecialRegsState* state,ElfInfo* patch,HeapAllocPlan* plan)
+{
+  Dictionary* rulesDict=dictCreate(100);//todo: get rid of arbitrary constant 100
+  evaluateInstructionsToRules(fde->cie,fde->instructions,fde->numInstructions,rulesDict,fde->lowpc,fde->highpc,NULL);
+  PoRegRule** rules=(PoRegRule**)dictValues(rulesDict);
+  for(int i=0;rules[i];i++)
+  {
+    PoRegRule* rule=rules[i];
+    if(ERRT_RECURSE_FIXUP!=rule->type && ERRT_RECURSE_FIXUP_POINTER!=rule->type)
+    {
+      continue;
+    }
+    SpecialRegsState tmpState=*state;
+    byte* rhAddrBytes=NULL;
+    //for a pointer we want the value of the pointer, otherwise the address
+    int flags=ERRT_RECURSE_FIXUP_POINTER==rule->type?ERRF_DEREFERENCE:ERRF_NONE;
+    int size=resolveRegisterValue(&rule->regRH,state,&rhAddrBytes,flags);
+    assert(size==sizeof(addr_t));
+    memcpy(&tmpState.currAddrOld,rhAddrBytes,sizeof(addr_t));
+    free(rhAddrBytes);
+    //fde indices seem to be 1-based and we store them zero-based
+    FDE* pointedFDE=&patch->callFrameInfo.fdes[rule->index-1];
+    if(ERRT_RECURSE_FIXUP_POINTER==rule->type)
+    {
+      if(!tmpState.currAddrOld ||
+         mapExists(dataMoved,&tmpState.currAddrOld) ||
+         mapExists(plan->visited,&tmpState.currAddrOld))
+      {
+        continue;
+      }
+      size_t* key=zmalloc(sizeof(size_t));
+      memcpy(key,&tmpState.currAddrOld,sizeof(size_t));
+      mapInsert(plan->visited,key,key);
+      if(STN_UNDEF==findSymbolContainingAddress(state->oldBinaryElf,tmpState.currAddrOld,STT_OBJECT,SHN_UNDEF))
+      {
+        if(plan->num==plan->allocated)
+        {
+          plan->allocated=plan->allocated?2*plan->allocated:64;
+          plan->oldAddrs=realloc(plan->oldAddrs,plan->allocated*sizeof(addr_t));
+          MALLOC_CHECK(plan->oldAddrs);
+          plan->sizes=realloc(plan->sizes,plan->allocated*sizeof(word_t));
+          MALLOC_CHECK(plan->sizes);
+        }
+        plan->oldAddrs[plan->num]=tmpState.currAddrOld;
+        plan->sizes[plan->num]=pointedFDE->memSize;
+        plan->num++;
+      }
+    }
+    planHeapAllocations(pointedFDE,&tmpState,patch,plan);
+  }
+  free(rules);
+  dictDelete(rulesDict,free);
+}
+
+//allocates memory in the target up front, all at once, for every heap
+//object that patching the variable described by fde and state will
+//relocate. Moving a linked list then costs a few round trips to the
+//target rather than one per node
+static void preallocateHeapObjects(FDE* fde,SpecialRegsState* state,ElfInfo* patch)
+{
+  if(!dataMoved)
+  {
+    dataMoved=size_tMapCreate(100);//todo: get rid of arbitrary constant 100
+  }
+  if(!heapPreallocated)
+  {
+    heapPreallocated=size_tMapCreate(1000);
+  }
+  HeapAllocPlan plan;
+  memset(&plan,0,sizeof(plan));
+  plan.visited=size_tMapCreate(1000);
+  SpecialRegsState planState=*state;
+  planHeapAllocations(fde,&planState,patch,&plan);
+  mapDelete(plan.visited,NULL,free);
+  if(plan.num)
+  {
+    logprintf(ELL_INFO_V1,ELS_DWARF_FRAME,"allocating memory for %i heap objects to be relocated\n",plan.num);
+    addr_t* newAddrs=zmalloc(plan.num*sizeof(addr_t));
+    mallocTargetMany(plan.sizes,newAddrs,plan.num);
+    for(int i=0;i<plan.num;i++)
+    {
+      if(mapExists(heapPreallocated,&plan.oldAddrs[i]))
+      {
+        continue;
+      }
+      size_t* key=zmalloc(sizeof(size_t));
+      memcpy(key,&plan.oldAddrs[i],sizeof(size_t));
+      addr_t* value=zmalloc(sizeof(addr_t));
+      *value=newAddrs[i];
+      mapInsert(heapPreallocated,key,value);
+    }
+    free(newAddrs);
+  }
+  free(plan.oldAddrs);
+  free(plan.sizes);
+}
+
 //patchBin is the elf object we're mirroring all the changes
 //we made to memory in so that it's possible to do successive patching
 void patchDataWithFDE(VarInfo* var,FDE* fde,ElfInfo* oldBinaryElf,ElfInfo* patch,ElfInfo* patchedBin)
@@ -549,6 +673,7 @@ void patchDataWithFDE(VarInfo* var,FDE* fde,ElfInfo* oldBinaryElf,ElfInfo* patch
   state.currAddrNew=var->newLocation;
   state.oldBinaryElf=oldBinaryElf;
 
+  preallocateHeapObjects(fde,&state,patch);
   List* patchesList=generatePatchesFromFDEAndState(fde,&state,patch,patchedBin);
   //now that we've made all the patch data, apply it
   List* li=patchesList;
@@ -620,5 +745,11 @@ void cleanupDwarfVM()
   if(dataMoved)
   {
     mapDelete(dataMoved,free,free);
+    dataMoved=NULL;
+  }
+  if(heapPreallocated)
+  {
+    mapDelete(heapPreallocated,free,free);
+    heapPreallocated=NULL;
   }
 }
@@ -133,6 +133,7 @@ void endELF(ElfInfo* e)
     free(e->callFrameInfo.fdes[i].instructions);
   }
   free(e->callFrameInfo.fdes);
+  freeSymbolIndexes(e);
   elf_end(e->e);
   //I think elf_end must call close on the file descriptor
   //close(e->fd);
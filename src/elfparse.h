@@ -64,6 +64,15 @@
 
 #include "callFrameInfo.h"
 
+//see symbol.c
+struct SymbolNamePool;
+struct SymbolMatcher;
+struct SymbolAddressIndex;
+//one each for .symtab and .dynsym, with and without section versions stripped
+#define NUM_SYMBOL_MATCHERS 4
+//one per symbol type
+#define NUM_SYMBOL_ADDRESS_INDEXES (STT_HIPROC+1)
+
 typedef struct ElfInfo
 {
   int symTabCount;
@@ -81,6 +90,13 @@ typedef struct ElfInfo
   CallFrameInfo callFrameInfo;
   bool dataAllocatedByKatana;//used for memory management
   bool isPO;//is this elf object a patch object?
+  //interned symbol names, also used by getSymtabIdx to look symbols
+  //up by name. Built the first time they're needed
+  struct SymbolNamePool* symbolNamePool;
+  //candidate tables for findSymbol, also built on demand
+  struct SymbolMatcher* symbolMatchers[NUM_SYMBOL_MATCHERS];
+  //symbols sorted by address for findSymbolContainingAddress
+  struct SymbolAddressIndex* symbolAddressIndexes[NUM_SYMBOL_ADDRESS_INDEXES];
   #ifdef KATANA_X86_64_ARCH
   //set true if text sections use a small code
   //model, requiring any relocations of text, data, rodata, etc
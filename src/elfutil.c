@@ -56,7 +56,6 @@
 #include "elfutil.h"
 #include "util/logging.h"
 #include "symbol.h"
-#include "util/cxxutil.h"
 #include "elfwriter.h"
 
 
@@ -265,7 +264,7 @@ bool hasERS(ElfInfo* e,E_RECOGNIZED_SECTION ers)
   return 0!=e->sectionIndices[ers];
 }
 
-//the returned string should be freed
+//the returned string must not be freed
 char* getFunctionNameAtPC(ElfInfo* elf,addr_t pc)
 {
   idx_t symIdx=findSymbolContainingAddress(elf,pc,STT_FUNC,SHN_UNDEF);
@@ -273,20 +272,7 @@ char* getFunctionNameAtPC(ElfInfo* elf,addr_t pc)
   {
     return "?";
   }
-  GElf_Sym sym;
-  getSymbol(elf,symIdx,&sym);
-  char* name=getString(elf,sym.st_name);
-  if(name[0]=='_' && name[1]=='Z')
-  {
-    //the name is a C++ mangled name, or at least it very likely is
-    //(there is of course nothing stopping someone from naming a
-    //function starting with _Z in C).
-    return demangleName(name);
-  }
-  else
-  {
-    return strdup(name);
-  }
+  return getDemangledSymbolName(elf,symIdx);
 }
 
 void updateShdrFromSectionHeaderData(ElfInfo* e,SectionHeaderData* shd,GElf_Shdr* shdr)
@@ -149,7 +149,7 @@ char* getScnHdrString(ElfInfo* e,int idx);
 char* getString(ElfInfo* e,int idx);//get a string from the normal string table
 char* getDynString(ElfInfo* e,int idx);//get a string from the dynamic string table
 bool hasERS(ElfInfo* e,E_RECOGNIZED_SECTION ers);
-//the returned string should be freed
+//the returned string must not be freed
 char* getFunctionNameAtPC(ElfInfo* elf,addr_t pc);
 void printSymTab(ElfInfo* e);
 
@@ -156,8 +156,12 @@ int main(int argc,char** argv)
     ElfInfo* patch=openELFFile(config.objectName);
     findELFSections(patch);
     patch->isPO=true;
-    readAndApplyPatch(config.pid,oldBinElfInfo,patch);
+    bool applied=readAndApplyPatch(config.pid,oldBinElfInfo,patch);
     endELF(patch);
+    if(!applied)
+    {
+      return 1;
+    }
   }
   else if(EKM_INFO==config.mode)
   {
@@ -62,13 +62,16 @@
 #include "katana_config.h"
 
 bool flags[EKCF_COUNT];
-const char* flagNames[]={"checkPtraceWrites","invalid"};
+const char* flagNames[]={"checkPtraceWrites","stopTarget","ehFrame","retargetReferences","alwaysSafePoint","invalid"};
 struct Config config;
 
 void setDefaultConfig()
 {
   setFlag(EKCF_CHECK_PTRACE_WRITES,true);
   config.maxWaitForPatching=100;
+  config.maxPauseMillis=0;
+  config.safetySampleMillis=0;
+  config.lazyTransformMinBytes=0;
 }
 
 bool isFlag(E_KATANA_CONFIG_FLAGS flag)
@@ -67,6 +67,14 @@ typedef enum
                       //the patch. This is only used for debugging
   EKCF_EH_FRAME,   //instead of listing call frame info from
                    //.debug_frame, list it from .eh_frame
+  EKCF_P_RETARGET_REFERENCES, //point GOT slots and (with --emit-relocs)
+                              //direct calls at patched functions'
+                              //new code instead of leaving them to
+                              //go through the trampoline. Changes
+                              //the value of the function's address as
+                              //seen through the GOT
+  EKCF_P_ALWAYS_SAFE_POINT, //wait for a safe point even for patches which
+                            //only replace code (see PatchPlan.codeOnly)
   EKCF_COUNT
 } E_KATANA_CONFIG_FLAGS;
 extern const char* flagNames[];
@@ -88,6 +96,20 @@ typedef struct Config
 {
   // The maximum number of seconds to wait for the target to enter a safe state.
   int maxWaitForPatching;
+  // The longest the target may be kept stopped, in milliseconds, once it is in
+  // a safe state and the patch is going in. If applying the patch takes longer
+  // it is backed out and the target left as it was. 0 for no limit.
+  int maxPauseMillis;
+  // How long, in milliseconds, to sample the target's stacks before choosing
+  // where to put safe point breakpoints if it isn't safe to patch right away.
+  // 0 to not sample.
+  int safetySampleMillis;
+  // Relocated variables at least this many bytes long are transformed when the
+  // target first touches them rather than while it is stopped. Their new
+  // locations are kept inaccessible until then. The data must not be handed
+  // to system calls before it is used, those fail instead of faulting.
+  // 0 to transform everything up front.
+  int lazyTransformMinBytes;
   E_KATANA_MODE mode;//the mode katana is operating in right now
   char* inputFile;//input filename when in SHELL mode
   char* outfileName;//the name of the file to write out to. Mostly
@@ -60,11 +60,68 @@
 #include "relocation.h"
 #include "symbol.h"
 #include <math.h>
+#include <sys/mman.h>
+#include "pmap.h"
+#include "versioning.h"
+#include "util/logging.h"
+#include "remotecall.h"
 
-addr_t addrFreeSpace;
-addr_t freeSpaceLeft;
+//Memory for patches in the target comes from three pools so that
+//each kind of section gets the protections it needs and code from
+//successive patches stays packed together. Each pool is a set of
+//regions mmapped in the target which are handed out front to back.
+//Space left at the end of a region is used by later allocations
+//(including ones made by later patches, see loadPatchPools)
+typedef struct
+{
+  addr_t start;
+  addr_t size;
+  addr_t used;//bytes from the start which have been handed out
+} PoolRegion;
+
+typedef struct
+{
+  PoolRegion* regions;
+  int numRegions;
+  //bytes handed out since loadPatchPools, i.e. to the current patch
+  addr_t usedByPatch;
+} PatchPool;
 
+static PatchPool pools[EPP_CNT];
+//process the pools belong to
+static int poolPid=0;
 
+//where new pool regions have to go, see setPatchPlacement
+static struct
+{
+  bool constrained;
+  addr_t nearLow;
+  addr_t nearHigh;
+  addr_t maxAddr;
+} placement;
+//a rel32 displacement reaches 2GB either way. Leave a little slack
+//for the instruction lengths
+#define REL32_REACH 0x7fff0000UL
+//how many times to look for a gap again if something else in the
+//target takes the one we picked before we get to map it
+#define PLACEMENT_ATTEMPTS 8
+//flag for mmap to fail rather than replace an existing mapping at the
+//address asked for (Linux 4.17). Older kernels ignore it and treat
+//the address as a hint, which we check anyway
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+static const int poolProtections[EPP_CNT]={PROT_READ|PROT_EXEC,PROT_READ,PROT_READ|PROT_WRITE};
+static const char* poolNames[EPP_CNT]={"code","rodata","data"};
+
+static addr_t alignUp(addr_t addr,addr_t alignment)
+{
+  if(alignment<=1)
+  {
+    return addr;
+  }
+  return (addr+alignment-1)/alignment*alignment;
+}
 
 int getIdxForField(TypeInfo* type,char* name)
 {
@@ -78,41 +135,329 @@ int getIdxForField(TypeInfo* type,char* name)
   return FIELD_DELETED;
 }
 
-//mmap some contiguous space in the target, but don't
-//assume it's being used right now. It will be claimed
-//by later calls to getFreeSpaceInTarget
-//if where is non-NULL, try to map in the space at the given address
-//returns the address of where the space was actually mapped in
-//note however that the user should NOT USE this address directly,
-//call getFreeSpaceInTarget instead
-addr_t reserveFreeSpaceInTarget(uint howMuch,addr_t where)
+E_PATCH_POOL poolForSectionFlags(word_t shFlags)
 {
-  if(howMuch<=freeSpaceLeft && (0==where || addrFreeSpace==where))
+  if(shFlags & SHF_EXECINSTR)
+  {
+    return EPP_CODE;
+  }
+  if(shFlags & SHF_WRITE)
   {
-    return addrFreeSpace;
+    return EPP_DATA;
   }
-  uint numPages=(uint)ceil((double)howMuch/(double)sysconf(_SC_PAGE_SIZE));
-  //todo: separate out different function/structure for executable code
-  addrFreeSpace=mmapTarget(numPages*sysconf(_SC_PAGE_SIZE),PROT_READ|PROT_WRITE|PROT_EXEC,where);
-  freeSpaceLeft=numPages*sysconf(_SC_PAGE_SIZE);
-  //todo: if there's a little bit of free space left,
-  //we just discard it. This is wasteful
-  return addrFreeSpace;
+  return EPP_RODATA;
 }
 
+//the region in pool an allocation of howMuch bytes with the given
+//alignment can be made from, or NULL if none have room
+static PoolRegion* findRegionWithSpace(PatchPool* pool,addr_t howMuch,addr_t alignment)
+{
+  for(int i=0;i<pool->numRegions;i++)
+  {
+    PoolRegion* region=&pool->regions[i];
+    addr_t start=alignUp(region->start+region->used,alignment);
+    if(start+howMuch<=region->start+region->size)
+    {
+      return region;
+    }
+  }
+  return NULL;
+}
+
+void setPatchPlacement(addr_t nearLow,addr_t nearHigh,addr_t maxAddr)
+{
+  placement.constrained=true;
+  placement.nearLow=nearLow;
+  placement.nearHigh=nearHigh;
+  placement.maxAddr=maxAddr;
+}
+
+bool isPoolWithinRel32Reach(E_PATCH_POOL whichPool)
+{
+  if(!placement.constrained)
+  {
+    return false;
+  }
+  PatchPool* pool=&pools[whichPool];
+  for(int i=0;i<pool->numRegions;i++)
+  {
+    PoolRegion* region=&pool->regions[i];
+    if(region->start+region->size>placement.nearLow+REL32_REACH ||
+       (placement.nearHigh>REL32_REACH && region->start<placement.nearHigh-REL32_REACH))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//map size bytes with the given protections in the closest free gap
+//within rel32 range of the area given to setPatchPlacement
+static addr_t mmapTargetPlaced(addr_t size,int prot)
+{
+  for(int attempt=0;attempt<PLACEMENT_ATTEMPTS;attempt++)
+  {
+    MappedRegion* regions=NULL;
+    int numRegions=getMemoryMap(poolPid,&regions);
+    if(numRegions<0)
+    {
+      death("cannot read the memory map of the target to place patch memory\n");
+    }
+    addr_t gap=findFreeGapNear(regions,numRegions,size,placement.nearLow,placement.nearHigh,REL32_REACH,placement.maxAddr);
+    free(regions);
+    if(!gap)
+    {
+      death("There is no free gap of %zu bytes within rel32 range of 0x%zx-0x%zx in the target\n",(size_t)size,placement.nearLow,placement.nearHigh);
+    }
+    RemoteCall call;
+    setRemoteMmap(&call,size,prot,MAP_FIXED_NOREPLACE,gap);
+    remoteCallBatch(&call,1);
+    if(call.result==gap)
+    {
+      recordTargetMapping(gap,size);
+      return gap;
+    }
+    //something else got there first (the target may have other
+    //threads mapping memory) or the kernel ignored our address
+    if(!isRemoteSyscallError(call.result))
+    {
+      setRemoteSyscall(&call,SYS_munmap,2,call.result,size);
+      remoteCallBatch(&call,1);
+    }
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"could not map patch memory at 0x%zx, looking for another gap\n",gap);
+  }
+  death("Unable to map %zu bytes of patch memory near the target's text after %i attempts\n",(size_t)size,PLACEMENT_ATTEMPTS);
+  return 0;
+}
+
+//maps a new region of at least howMuch bytes for the pool, at where
+//if possible (or after the pool's last region if where is 0)
+static addr_t mapPoolRegion(E_PATCH_POOL whichPool,uint howMuch,addr_t where)
+{
+  PatchPool* pool=&pools[whichPool];
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  addr_t size=alignUp(howMuch?howMuch:1,pageSize);
+  if(0==where && pool->numRegions)
+  {
+    //try to keep the pool contiguous
+    PoolRegion* last=&pool->regions[pool->numRegions-1];
+    where=last->start+last->size;
+  }
+  addr_t addr;
+  if(placement.constrained)
+  {
+    addr=mmapTargetPlaced(size,poolProtections[whichPool]);
+  }
+  else
+  {
+    addr=mmapTarget(size,poolProtections[whichPool],where);
+  }
+  pool->regions=realloc(pool->regions,sizeof(PoolRegion)*(pool->numRegions+1));
+  MALLOC_CHECK(pool->regions);
+  PoolRegion* region=&pool->regions[pool->numRegions++];
+  region->start=addr;
+  region->size=size;
+  region->used=0;
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"mapped %zu bytes at 0x%zx for the %s pool\n",(size_t)size,addr,poolNames[whichPool]);
+  return addr;
+}
+
+addr_t reserveFreeSpaceInTarget(E_PATCH_POOL whichPool,uint howMuch,addr_t where)
+{
+  PatchPool* pool=&pools[whichPool];
+  PoolRegion* region=findRegionWithSpace(pool,howMuch,1);
+  if(region && (0==where || region->start+region->used==where))
+  {
+    return region->start+region->used;
+  }
+  return mapPoolRegion(whichPool,howMuch,where);
+}
+
+addr_t getFreeSpaceInTargetPool(E_PATCH_POOL whichPool,uint howMuch,uint alignment)
+{
+  PatchPool* pool=&pools[whichPool];
+  PoolRegion* region=findRegionWithSpace(pool,howMuch,alignment);
+  if(!region)
+  {
+    //new regions are page aligned so alignment up to a page is free
+    mapPoolRegion(whichPool,howMuch,0);
+    region=findRegionWithSpace(pool,howMuch,alignment);
+    if(!region)
+    {
+      death("No room for %u bytes aligned to %u in the %s pool even after mapping more\n",howMuch,alignment,poolNames[whichPool]);
+    }
+  }
+  addr_t addr=alignUp(region->start+region->used,alignment);
+  pool->usedByPatch+=addr+howMuch-(region->start+region->used);
+  region->used=addr+howMuch-region->start;
+  return addr;
+}
 
 addr_t getFreeSpaceInTarget(uint howMuch)
 {
-  addr_t retval;
-  if(howMuch<=freeSpaceLeft)
+  return getFreeSpaceInTargetPool(EPP_DATA,howMuch,2*sizeof(word_t));
+}
+
+//file in which the pools for the process pid are kept between patches
+static void getPoolsFilename(int pid,char* buf,int bufLen)
+{
+  char* dir=getKatanaPidDir(pid);
+  snprintf(buf,bufLen,"%s/pools",dir);
+  free(dir);
+}
+
+typedef struct
+{
+  int whichPool;
+  PoolRegion region;
+} SavedPoolRegion;
+
+//whether the saved region at idx is still a pool region of ours in
+//the target. Neighbouring regions of a pool, having the same
+//protections, are merged by the kernel into one mapping, so the run
+//of the pool's saved regions around it is what has to match a single
+//anonymous mapping exactly, protections and all. Anything else ([heap]
+//in the same spot, say) is somebody else's memory
+static bool isSavedPoolRegionMapped(SavedPoolRegion* saved,int numSaved,int idx,
+                                    MappedRegion* mapped,int numMapped)
+{
+  int whichPool=saved[idx].whichPool;
+  addr_t runLow=saved[idx].region.start;
+  addr_t runHigh=runLow+saved[idx].region.size;
+  bool grew=true;
+  while(grew)
+  {
+    grew=false;
+    for(int i=0;i<numSaved;i++)
+    {
+      PoolRegion* region=&saved[i].region;
+      if(saved[i].whichPool!=whichPool)
+      {
+        continue;
+      }
+      if(region->start+region->size==runLow)
+      {
+        runLow=region->start;
+        grew=true;
+      }
+      else if(region->start==runHigh)
+      {
+        runHigh=region->start+region->size;
+        grew=true;
+      }
+    }
+  }
+  for(int i=0;i<numMapped;i++)
+  {
+    if(mapped[i].low==runLow && mapped[i].high==runHigh &&
+       !strcmp(mapped[i].name,ANONYMOUS_REGION_NAME) &&
+       mapped[i].prot==poolProtections[whichPool])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void loadPatchPools(int pid)
+{
+  poolPid=pid;
+  for(int i=0;i<EPP_CNT;i++)
+  {
+    free(pools[i].regions);
+    memset(&pools[i],0,sizeof(PatchPool));
+  }
+  char fname[256];
+  getPoolsFilename(pid,fname,256);
+  FILE* f=fopen(fname,"r");
+  if(!f)
+  {
+    return;
+  }
+  //the file is keyed by pid alone, so it may be left over from an
+  //earlier process with the same pid
+  unsigned long long startTime=0;
+  if(1!=fscanf(f,"started %llu\n",&startTime) || !startTime ||
+     startTime!=getProcessStartTime(pid))
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"%s was written for an earlier process with pid %i, ignoring it\n",fname,pid);
+    fclose(f);
+    return;
+  }
+  SavedPoolRegion* saved=NULL;
+  int numSaved=0;
+  SavedPoolRegion entry;
+  while(4==fscanf(f,"%i %zx %zx %zx\n",&entry.whichPool,&entry.region.start,&entry.region.size,&entry.region.used))
+  {
+    if(entry.whichPool<0 || entry.whichPool>=EPP_CNT || entry.region.used>entry.region.size)
+    {
+      continue;
+    }
+    saved=realloc(saved,sizeof(SavedPoolRegion)*(numSaved+1));
+    MALLOC_CHECK(saved);
+    saved[numSaved++]=entry;
+  }
+  fclose(f);
+
+  MappedRegion* mapped=NULL;
+  int numMapped=getMemoryMap(pid,&mapped);
+  for(int i=0;i<numSaved;i++)
+  {
+    PoolRegion* region=&saved[i].region;
+    if(!isSavedPoolRegionMapped(saved,numSaved,i,mapped,numMapped))
+    {
+      logprintf(ELL_WARN,ELS_HOTPATCH,"Region 0x%zx-0x%zx from earlier patches is no longer mapped as it was, forgetting it\n",region->start,region->start+region->size);
+      continue;
+    }
+    PatchPool* pool=&pools[saved[i].whichPool];
+    pool->regions=realloc(pool->regions,sizeof(PoolRegion)*(pool->numRegions+1));
+    MALLOC_CHECK(pool->regions);
+    pool->regions[pool->numRegions++]=*region;
+  }
+  free(mapped);
+  free(saved);
+}
+
+void savePatchPools(int pid)
+{
+  char fname[256];
+  getPoolsFilename(pid,fname,256);
+  unsigned long long startTime=getProcessStartTime(pid);
+  if(!startTime)
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"Could not find when process %i started, memory left over from this patch will not be reused\n",pid);
+    unlink(fname);
+    return;
+  }
+  FILE* f=fopen(fname,"w");
+  if(!f)
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"Could not write %s, memory left over from this patch will not be reused\n",fname);
+    return;
+  }
+  fprintf(f,"started %llu\n",startTime);
+  for(int i=0;i<EPP_CNT;i++)
+  {
+    for(int j=0;j<pools[i].numRegions;j++)
+    {
+      PoolRegion* region=&pools[i].regions[j];
+      fprintf(f,"%i %zx %zx %zx\n",i,region->start,region->size,region->used);
+    }
+  }
+  fclose(f);
+}
+
+void printPatchMemoryUsage()
+{
+  for(int i=0;i<EPP_CNT;i++)
   {
-    retval=addrFreeSpace;
+    addr_t mappedTotal=0;
+    addr_t usedTotal=0;
+    for(int j=0;j<pools[i].numRegions;j++)
+    {
+      mappedTotal+=pools[i].regions[j].size;
+      usedTotal+=pools[i].regions[j].used;
+    }
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"%s pool: this patch used %zu bytes, all patches %zu of %zu mapped bytes in %i regions\n",poolNames[i],(size_t)pools[i].usedByPatch,(size_t)usedTotal,(size_t)mappedTotal,pools[i].numRegions);
   }
-  reserveFreeSpaceInTarget(howMuch,0);
-  retval=addrFreeSpace;
-  freeSpaceLeft-=howMuch;
-  addrFreeSpace+=howMuch;
-  return retval;
-  //todo: if there's a little bit of free space left,
-  //we just discard it. This is wasteful
 }
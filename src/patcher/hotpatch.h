@@ -59,12 +59,50 @@
 #ifdef legacy
 addr_t getFreeSpaceForTransformation(TransformationInfo* trans,uint howMuch);
 #endif
+//patch memory in the target is divided into pools by the
+//protection it needs
+typedef enum
+{
+  EPP_CODE=0,//read and execute
+  EPP_RODATA,//read only
+  EPP_DATA,//read and write
+  EPP_CNT
+} E_PATCH_POOL;
+
+//which pool a section with the given sh_flags belongs in
+E_PATCH_POOL poolForSectionFlags(word_t shFlags);
+
+//get memory from the given pool, aligned to alignment
+//(which may be 0 or 1 for no alignment)
+addr_t getFreeSpaceInTargetPool(E_PATCH_POOL pool,uint howMuch,uint alignment);
+
+//get writable memory in the target, suitably aligned for any variable
 addr_t getFreeSpaceInTarget(uint howMuch);
 
-//mmap some contiguous space in the target, but don't
-//assume it's being used right now. It will be claimed
-//by later calls to getFreeSpaceInTarget
-//if where is non-NULL, try to map in the space at the given address
-//returns the address of where the space was actually mapped in
-addr_t reserveFreeSpaceInTarget(uint howMuch,addr_t where);
+//make sure pool has howMuch contiguous bytes available without
+//assuming they're being used right now. They will be claimed
+//by later calls to getFreeSpaceInTargetPool.
+//if where is non-NULL and new memory has to be mapped, try to map it
+//at the given address. Returns the address the next allocation
+//from the pool will start at (before alignment)
+addr_t reserveFreeSpaceInTarget(E_PATCH_POOL pool,uint howMuch,addr_t where);
+
+//from now on put new pool regions only where every byte of them is
+//within reach of a rel32 displacement from anywhere in
+//[nearLow,nearHigh), as close to it as possible, and, if maxAddr is
+//non-zero, entirely below maxAddr
+void setPatchPlacement(addr_t nearLow,addr_t nearHigh,addr_t maxAddr);
+//true if setPatchPlacement is in force and every region the pool
+//already has is within rel32 reach too, so that anything allocated
+//from it can be reached with a 5 byte jmp
+bool isPoolWithinRel32Reach(E_PATCH_POOL whichPool);
+
+//pools are remembered between patches to the same process so that
+//space left over by one patch can be used by the next.
+//loadPatchPools must be called before any memory is allocated
+//for a patch and savePatchPools once it has been applied
+void loadPatchPools(int pid);
+void savePatchPools(int pid);
+//log how much target memory the current patch and all patches are using
+void printPatchMemoryUsage();
 #endif
@@ -67,7 +67,9 @@
 #include <link.h>
 #include "elfutil.h"
 #include "target.h"
+#include "constants.h"
 #include "util/logging.h"
+#include "util/dictionary.h"
 
 
 //locate the address of the link map
@@ -102,41 +104,77 @@ addr_t locateLinkMap(ElfInfo* e)
   return result;
 }
 
-//looks for the dynamic symbol with a given name
-//in a linkmap entry
-//returns true (and stores result) on success
-bool locateSymbolInLinkMap(struct link_map* lm,addr_t* result,char* symName,int symNameHash)
+//what we need to look symbols up in one object in the target's link
+//map. Read once per target process, see loadLinkMapObjects
+typedef struct
+{
+  char name[256];
+  addr_t base;//l_addr, used to rebase symbol values
+  addr_t strtab;
+  addr_t symtab;
+  bool gnuHash;//use DT_GNU_HASH rather than DT_HASH
+  //DT_HASH
+  ElfXX_Word numBuckets;
+  ElfXX_Word numChains;
+  addr_t buckets;
+  addr_t chains;
+  //DT_GNU_HASH. The Bloom filter and the buckets are copied out of
+  //the target so that most misses never have to read from it
+  ElfXX_Word gnuNumBuckets;
+  ElfXX_Word gnuSymOffset;
+  ElfXX_Word gnuBloomSize;
+  ElfXX_Word gnuBloomShift;
+  addr_t* gnuBloom;
+  ElfXX_Word* gnuBuckets;
+  addr_t gnuChains;
+} LinkMapObject;
+
+//the objects in the link map of process linkMapPid
+static LinkMapObject* linkMapObjects=NULL;
+static int numLinkMapObjects=0;
+static int linkMapPid=0;
+//symbols already found in linkMapPid, name to addr_t*
+static Dictionary* runtimeSymbols=NULL;
+
+//the hash used by DT_GNU_HASH
+static uint32 gnuHash(char* name)
 {
+  uint32 h=5381;
+  for(unsigned char* c=(unsigned char*)name;*c;c++)
+  {
+    h=h*33+*c;
+  }
+  return h;
+}
+
+//reads what we need from the .dynamic section of one link map entry
+//returns false if symbols can't be looked up in it
+static bool readLinkMapObject(struct link_map* lm,LinkMapObject* obj)
+{
+  memset(obj,0,sizeof(LinkMapObject));
   //todo: this is unsafe, need to check pages mapped into target
   //to make sure this access will be ok
-  char nameBuf[256];
-  memset(nameBuf, 0, 256);
-
   //Start out trying to copy a small amount, as trying to copy 256
   //bytes could extend past mapped memory
   int maxName = 32;
   do
   {
-    memcpyFromTarget((byte*)nameBuf, (addr_t)lm->l_name, maxName);
+    memcpyFromTarget((byte*)obj->name, (addr_t)lm->l_name, maxName);
   }
-  while(nameBuf[maxName] != '\0' && (maxName += 32) <= 256);
+  while(obj->name[maxName] != '\0' && (maxName += 32) <= 256);
   
-  nameBuf[255]=0;
-  if(!strlen(nameBuf))
+  obj->name[255]=0;
+  if(!strlen(obj->name))
   {
     logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in nameless library, it's probably not what we want\n");
     return false;
   }
+  obj->base=lm->l_addr;
   
-  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Looking for symbol %s in link map for object %s loaded at 0x%x with dynamic section at 0x%x\n",symName,nameBuf,lm->l_addr,lm->l_ld);
-    
-  addr_t strtab=0;
-  addr_t symtab=0;
-  addr_t hashtableBuckets=0;
-  ElfXX_Word numBuckets=0;
-  addr_t hashtableChains=0;
+  logprintf(ELL_INFO_V2,ELS_LINKMAP,"Reading link map for object %s loaded at 0x%x with dynamic section at 0x%x\n",obj->name,lm->l_addr,lm->l_ld);
+
   addr_t hashtable=0;
-  
+  addr_t gnuHashtable=0;
   //first we look at the link the linkmap entry has to the .dynamic section
   //for whatever program or library it corresponds to
   ElfXX_Dyn dyn;
@@ -151,69 +189,162 @@ bool locateSymbolInLinkMap(struct link_map* lm,addr_t* result,char* symName,int
     switch(dyn.d_tag)
     {
     case DT_HASH:
-      {
-        hashtable=dyn.d_un.d_ptr;
-      }
+      hashtable=dyn.d_un.d_ptr;
+      break;
+    case DT_GNU_HASH:
+      gnuHashtable=dyn.d_un.d_ptr;
       break;
     case DT_STRTAB:
-      strtab=dyn.d_un.d_ptr;
+      obj->strtab=dyn.d_un.d_ptr;
       break;
     case DT_SYMTAB:
-      symtab=dyn.d_un.d_ptr;
-    case DT_SONAME:
+      obj->symtab=dyn.d_un.d_ptr;
       break;
     default:
       break;
     }
   }
 
-  if(!symtab || !strtab || !hashtable)
+  if(!obj->symtab || !obj->strtab || (!hashtable && !gnuHashtable))
   {
-    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in library %s because not all the needed entries were found in the .dynamic section\n",nameBuf);
+    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in library %s because not all the needed entries were found in the .dynamic section\n",obj->name);
     return false;
   }
-          
 
   //in practice, I sometimes see invalid hashtable entries and no good way that
   //I've found to detect them. So we just look for an invalid memory access and
   //bail when we get it, hope the symbol wasn't in that library
-  if(!memcpyFromTargetNoDeath((byte*)&numBuckets,hashtable,sizeof(ElfXX_Word)))
+  if(gnuHashtable)
   {
-    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in this library ('%s'), doesn't seem to contain valid hashtable\n",nameBuf);
+    ElfXX_Word header[4];
+    //an empty or absurdly large table is one of the invalid ones,
+    //and a lookup in it would divide by zero
+    if(memcpyFromTargetNoDeath((byte*)header,gnuHashtable,sizeof(header)) &&
+       header[0] && header[0]<=MAX_GNU_HASH_ENTRIES &&
+       header[2] && header[2]<=MAX_GNU_HASH_ENTRIES)
+    {
+      obj->gnuNumBuckets=header[0];
+      obj->gnuSymOffset=header[1];
+      obj->gnuBloomSize=header[2];
+      obj->gnuBloomShift=header[3];
+      addr_t bloomAddr=gnuHashtable+sizeof(header);
+      addr_t bucketsAddr=bloomAddr+obj->gnuBloomSize*sizeof(addr_t);
+      obj->gnuChains=bucketsAddr+obj->gnuNumBuckets*sizeof(ElfXX_Word);
+      obj->gnuBloom=zmalloc(obj->gnuBloomSize*sizeof(addr_t));
+      obj->gnuBuckets=zmalloc(obj->gnuNumBuckets*sizeof(ElfXX_Word));
+      if(memcpyFromTargetNoDeath((byte*)obj->gnuBloom,bloomAddr,obj->gnuBloomSize*sizeof(addr_t)) &&
+         memcpyFromTargetNoDeath((byte*)obj->gnuBuckets,bucketsAddr,obj->gnuNumBuckets*sizeof(ElfXX_Word)))
+      {
+        obj->gnuHash=true;
+        logprintf(ELL_INFO_V4,ELS_LINKMAP,"there are %i GNU hashtable buckets and %i Bloom filter words\n The hashtable lives at 0x%x\n",obj->gnuNumBuckets,obj->gnuBloomSize,gnuHashtable);
+        return true;
+      }
+      free(obj->gnuBloom);
+      free(obj->gnuBuckets);
+      obj->gnuBloom=NULL;
+      obj->gnuBuckets=NULL;
+    }
+    if(!hashtable)
+    {
+      logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in this library ('%s'), doesn't seem to contain valid GNU hashtable\n",obj->name);
+      return false;
+    }
+  }
+  
+  if(!memcpyFromTargetNoDeath((byte*)&obj->numBuckets,hashtable,sizeof(ElfXX_Word)) ||
+     !obj->numBuckets)
+  {
+    logprintf(ELL_WARN,ELS_LINKMAP,"Not examining symbols in this library ('%s'), doesn't seem to contain valid hashtable\n",obj->name);
     return false;
   }
-  ElfXX_Word numChains;
-  memcpyFromTarget((byte*)&numChains,hashtable + sizeof(ElfXX_Word),sizeof(ElfXX_Word));
+  memcpyFromTarget((byte*)&obj->numChains,hashtable + sizeof(ElfXX_Word),sizeof(ElfXX_Word));
   
-  logprintf(ELL_INFO_V4,ELS_LINKMAP,"there are %i hashtable buckets and %i chains\n The hashtable lives at 0x%x\n",numBuckets,numChains,hashtable);
-  hashtableBuckets=hashtable+2*sizeof(ElfXX_Word);
-  hashtableChains=hashtable+2*sizeof(ElfXX_Word)+numBuckets*sizeof(ElfXX_Word);
+  logprintf(ELL_INFO_V4,ELS_LINKMAP,"there are %i hashtable buckets and %i chains\n The hashtable lives at 0x%x\n",obj->numBuckets,obj->numChains,hashtable);
+  obj->buckets=hashtable+2*sizeof(ElfXX_Word);
+  obj->chains=hashtable+2*sizeof(ElfXX_Word)+obj->numBuckets*sizeof(ElfXX_Word);
+  return true;
+}
 
-  //now that we've found what we need to look at the hashtable, we actually index into
-  //the hash table
-  ElfXX_Word symIdx=0;
-  memcpyFromTarget((byte*)&symIdx,hashtableBuckets+sizeof(ElfXX_Word)*(symNameHash % numBuckets),sizeof(ElfXX_Word));
-  for(;symIdx != STN_UNDEF;memcpyFromTarget((byte*)&symIdx,hashtableChains+sizeof(ElfXX_Word)*symIdx,sizeof(ElfXX_Word)))
+//checks whether the symbol at symIdx in obj is the one we're looking for
+//returns true (and stores result) if it is and it's defined there.
+//Sets *import if it's only an import of the symbol
+static bool checkLinkMapSymbol(LinkMapObject* obj,ElfXX_Word symIdx,char* symName,
+                               addr_t* result,bool* import)
+{
+  logprintf(ELL_INFO_V4,ELS_LINKMAP,"symbol index is %i\n",symIdx);
+  ElfXX_Sym sym;
+  memcpyFromTarget((byte*)&sym,obj->symtab+sizeof(ElfXX_Sym)*symIdx,sizeof(ElfXX_Sym));
+
+  //todo: using strnmatchTarget we don't support symbols with names
+  //that are a substring of another symbol's name
+  if(!strnmatchTarget(symName,obj->strtab+sym.st_name))
   {
-    
-    logprintf(ELL_INFO_V4,ELS_LINKMAP,"symbol index is %i\n",symIdx);
-    ElfXX_Sym sym;
-    memcpyFromTarget((byte*)&sym,symtab+sizeof(ElfXX_Sym)*symIdx,sizeof(ElfXX_Sym));
+    return false;
+  }
+  if(0==sym.st_value && SHN_UNDEF==sym.st_shndx)
+  {
+    //this is an import symbol
+    *import=true;
+    return false;
+  }
+  logprintf(ELL_INFO_V1,ELS_LINKMAP,"Found symbol %s in %s\n",symName,obj->name);
+  *result=obj->base+sym.st_value;
+  return true;
+}
 
-    //todo: using strnmatchTarget we don't support symbols with names
-    //that are a substring of another symbol's name
-    if(strnmatchTarget(symName,strtab+sym.st_name))
+//looks for the dynamic symbol with a given name
+//in a linkmap entry
+//returns true (and stores result) on success
+static bool locateSymbolInLinkMapObject(LinkMapObject* obj,addr_t* result,char* symName,
+                                        uint32 sysvHash,uint32 gnuNameHash)
+{
+  bool import=false;
+  if(obj->gnuHash)
+  {
+    //the Bloom filter lets us rule most libraries out without
+    //reading from the target at all
+    uint bitsPerWord=sizeof(addr_t)*8;
+    addr_t bloomWord=obj->gnuBloom[(gnuNameHash/bitsPerWord) % obj->gnuBloomSize];
+    addr_t bloomMask=((addr_t)1<<(gnuNameHash % bitsPerWord)) |
+      ((addr_t)1<<((gnuNameHash >> obj->gnuBloomShift) % bitsPerWord));
+    if((bloomWord & bloomMask)!=bloomMask)
+    {
+      return false;
+    }
+    ElfXX_Word symIdx=obj->gnuBuckets[gnuNameHash % obj->gnuNumBuckets];
+    if(!symIdx || symIdx<obj->gnuSymOffset)
+    {
+      return false;
+    }
+    //the chain holds the hashes of the symbols in the bucket, with
+    //the low bit marking the last one
+    for(;;symIdx++)
     {
-      if(0==sym.st_value && SHN_UNDEF==sym.st_shndx)
+      ElfXX_Word chainHash;
+      memcpyFromTarget((byte*)&chainHash,obj->gnuChains+sizeof(ElfXX_Word)*(symIdx-obj->gnuSymOffset),sizeof(ElfXX_Word));
+      if((chainHash|1)==(gnuNameHash|1) &&
+         checkLinkMapSymbol(obj,symIdx,symName,result,&import))
+      {
+        return true;
+      }
+      if(import || (chainHash & 1))
       {
-        //this is an import symbol
         return false;
       }
-      logprintf(ELL_INFO_V1,ELS_LINKMAP,"Found symbol %s in %s\n",symName,nameBuf);
-      *result=lm->l_addr+sym.st_value;//l_addr is used to rebase the symbol index
+    }
+  }
+
+  //now that we've found what we need to look at the hashtable, we actually index into
+  //the hash table
+  ElfXX_Word symIdx=0;
+  memcpyFromTarget((byte*)&symIdx,obj->buckets+sizeof(ElfXX_Word)*(sysvHash % obj->numBuckets),sizeof(ElfXX_Word));
+  for(;symIdx != STN_UNDEF;memcpyFromTarget((byte*)&symIdx,obj->chains+sizeof(ElfXX_Word)*symIdx,sizeof(ElfXX_Word)))
+  {
+    if(checkLinkMapSymbol(obj,symIdx,symName,result,&import))
+    {
       return true;
     }
-    if(symIdx > numChains)
+    if(import || symIdx > obj->numChains)
     {
       return false;
     }
@@ -221,12 +352,22 @@ bool locateSymbolInLinkMap(struct link_map* lm,addr_t* result,char* symName,int
   return false;  
 }
 
-//the passed ElfInfo object must correspond to the
-//currently running target known to the methods
-//in target.c
-addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name)
+static void freeLinkMapObjects()
 {
-  //todo: cache this
+  for(int i=0;i<numLinkMapObjects;i++)
+  {
+    free(linkMapObjects[i].gnuBloom);
+    free(linkMapObjects[i].gnuBuckets);
+  }
+  free(linkMapObjects);
+  linkMapObjects=NULL;
+  numLinkMapObjects=0;
+}
+
+//reads the descriptions of all the objects in the target's link map
+static void loadLinkMapObjects(ElfInfo* e)
+{
+  freeLinkMapObjects();
   addr_t linkmapAddr=locateLinkMap(e);
   //there is a linkmap entry for the original binary and for each library that's been linked
   //in. We scan all the link maps and look for the symbol in the hash table of each
@@ -234,23 +375,109 @@ addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name)
   //the code by grugq (mentioned in Attribution in the file header) seem to indicate
   //that he considers this method slow
   //for details of the linkmap structure see /usr/include/link.h
-
   struct link_map lm;
+  int capacity=0;
   memcpyFromTarget((byte*)&lm,linkmapAddr,sizeof(lm));
   for(;;memcpyFromTarget((byte*)&lm,(addr_t)lm.l_next,sizeof(lm)))
   {
-    addr_t addr;//store the result address
-    //can't seem to get rid of a sign cast warning in below line, it seems
-    //different library versions of libelf have different signdness for the param there
-    if(locateSymbolInLinkMap(&lm,&addr,name,elf_hash(name)))
+    if(numLinkMapObjects==capacity)
+    {
+      capacity=capacity?capacity*2:16;
+      linkMapObjects=realloc(linkMapObjects,capacity*sizeof(LinkMapObject));
+      MALLOC_CHECK(linkMapObjects);
+    }
+    if(readLinkMapObject(&lm,&linkMapObjects[numLinkMapObjects]))
     {
-      return addr;
+      numLinkMapObjects++;
     }
     if(0==lm.l_next)
     {
       break;
     }
   }
-  death("could not locate runtime symbol %s\n",name);
-  return 0;
+  linkMapPid=getTargetPid();
+}
+
+//fills in any of results that are still 0 from runtimeSymbols or
+//the objects we have already read from the link map
+//returns how many are still missing
+static int resolveRuntimeSymbols(char** names,addr_t* results,int n)
+{
+  int numMissing=0;
+  for(int i=0;i<n;i++)
+  {
+    if(results[i])
+    {
+      continue;
+    }
+    addr_t* cached=dictGet(runtimeSymbols,names[i]);
+    if(cached)
+    {
+      results[i]=*cached;
+      continue;
+    }
+    //can't seem to get rid of a sign cast warning in below line, it seems
+    //different library versions of libelf have different signdness for the param there
+    uint32 sysvHash=elf_hash(names[i]);
+    uint32 gnuNameHash=gnuHash(names[i]);
+    for(int j=0;j<numLinkMapObjects;j++)
+    {
+      if(locateSymbolInLinkMapObject(&linkMapObjects[j],&results[i],names[i],sysvHash,gnuNameHash))
+      {
+        cached=zmalloc(sizeof(addr_t));
+        *cached=results[i];
+        dictInsert(runtimeSymbols,names[i],cached);
+        break;
+      }
+    }
+    if(!results[i])
+    {
+      numMissing++;
+    }
+  }
+  return numMissing;
+}
+
+//the passed ElfInfo object must correspond to the
+//currently running target known to the methods
+//in target.c
+bool locateRuntimeSymbolsInTarget(ElfInfo* e,char** names,addr_t* results,int n)
+{
+  if(linkMapPid!=getTargetPid() && runtimeSymbols)
+  {
+    dictDelete(runtimeSymbols,free);
+    runtimeSymbols=NULL;
+  }
+  if(!runtimeSymbols)
+  {
+    runtimeSymbols=dictCreate(100);
+  }
+  memset(results,0,n*sizeof(addr_t));
+  bool freshLinkMap=linkMapPid!=getTargetPid();
+  if(freshLinkMap)
+  {
+    loadLinkMapObjects(e);
+  }
+  int numMissing=resolveRuntimeSymbols(names,results,n);
+  if(numMissing && !freshLinkMap)
+  {
+    //the target may have loaded more libraries since we last read
+    //the link map
+    loadLinkMapObjects(e);
+    numMissing=resolveRuntimeSymbols(names,results,n);
+  }
+  return 0==numMissing;
+}
+
+//the passed ElfInfo object must correspond to the
+//currently running target known to the methods
+//in target.c
+addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name)
+{
+  addr_t addr;
+  if(!locateRuntimeSymbolsInTarget(e,&name,&addr,1))
+  {
+    death("could not locate runtime symbol %s\n",name);
+  }
+  return addr;
 }
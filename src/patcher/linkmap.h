@@ -68,5 +68,11 @@
 //the passed ElfInfo object must correspond to the
 //currently running target known to the methods
 //in target.c
+//dies if the symbol cannot be found
 addr_t locateRuntimeSymbolInTarget(ElfInfo* e,char* name);
+//finds all n names in one walk of the link map, storing their
+//addresses in results (0 for any that cannot be found). Libraries'
+//hash tables are read once per target process and symbols already
+//found are remembered. Returns true if all of them were found
+bool locateRuntimeSymbolsInTarget(ElfInfo* e,char** names,addr_t* results,int n);
 #endif
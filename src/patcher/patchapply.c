@@ -65,6 +65,7 @@
 #include "relocation.h"
 #include "versioning.h"
 #include <assert.h>
+#include <stdint.h>
 #include "symbol.h"
 #include "util/logging.h"
 #include "linkmap.h"
@@ -76,6 +77,7 @@
 #include "pmap.h"
 #include "patchapply.h"
 #include "katana_config.h"
+#include "remotecall.h"
 
 ElfInfo* patchedBin=NULL;
 ElfInfo* targetBin=NULL;
@@ -112,6 +114,220 @@ void transformVarData(VarInfo* var,Map* fdeMap,ElfInfo* patch)
   patchDataWithFDE(var,transformerFDE,targetBin,patch,patchedBin);
 }
 
+//Relocated variables whose transformation is put off until the target
+//first touches them (see config.lazyTransformMinBytes). Their new
+//locations are made inaccessible and each is transformed when a
+//thread faults on one of its pages
+static VarInfo** lazyVars=NULL;
+static bool* lazyVarPending=NULL;
+static int numLazyVars=0;
+
+static bool shouldTransformLazily(VarInfo* var)
+{
+  return config.lazyTransformMinBytes && var->type->length>=config.lazyTransformMinBytes &&
+    var->newLocation!=var->oldLocation;
+}
+
+static void deferVarTransformation(VarInfo* var)
+{
+  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"transforming var %s (%i bytes) when it is first used\n",var->name,var->type->length);
+  lazyVars=realloc(lazyVars,(numLazyVars+1)*sizeof(VarInfo*));
+  MALLOC_CHECK(lazyVars);
+  lazyVarPending=realloc(lazyVarPending,(numLazyVars+1)*sizeof(bool));
+  MALLOC_CHECK(lazyVarPending);
+  lazyVars[numLazyVars]=var;
+  lazyVarPending[numLazyVars]=true;
+  numLazyVars++;
+}
+
+static void forgetLazyVars()
+{
+  free(lazyVars);
+  free(lazyVarPending);
+  lazyVars=NULL;
+  lazyVarPending=NULL;
+  numLazyVars=0;
+}
+
+//first and one past the last page the lazy variable at idx is on
+static void getLazyVarPages(int idx,addr_t* low,addr_t* high)
+{
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  *low=lazyVars[idx]->newLocation & ~(pageSize-1);
+  *high=(lazyVars[idx]->newLocation+lazyVars[idx]->type->length+pageSize-1) & ~(pageSize-1);
+}
+
+static int transformLazyVarsIn(addr_t low,addr_t high,Map* fdeMap,ElfInfo* patch);
+
+//have faults reported to us on the pages of the variables still
+//pending and on no others. Anything else the target faults on, even
+//between those pages, is the program's own business
+static void watchPendingLazyVarPages()
+{
+  TargetRange* ranges=zmalloc((numLazyVars+1)*sizeof(TargetRange));
+  int numRanges=0;
+  for(int i=0;i<numLazyVars;i++)
+  {
+    if(lazyVarPending[i])
+    {
+      getLazyVarPages(i,&ranges[numRanges].low,&ranges[numRanges].high);
+      numRanges++;
+    }
+  }
+  watchTargetFaults(ranges,numRanges);
+  free(ranges);
+}
+
+//make the pages of every lazy variable inaccessible to the target and
+//have faults on them reported to us. If that can't be done they're
+//all transformed right away. The target must be stopped
+static void protectLazyVars(Map* fdeMap,ElfInfo* patch)
+{
+  if(!numLazyVars)
+  {
+    return;
+  }
+  RemoteCall* calls=zmalloc(numLazyVars*sizeof(RemoteCall));
+  for(int i=0;i<numLazyVars;i++)
+  {
+    addr_t low,high;
+    getLazyVarPages(i,&low,&high);
+    setRemoteSyscall(&calls[i],SYS_mprotect,3,(word_t)low,(word_t)(high-low),(word_t)PROT_NONE);
+  }
+  remoteCallBatch(calls,numLazyVars);
+  bool protectedAll=true;
+  for(int i=0;i<numLazyVars;i++)
+  {
+    if(isRemoteSyscallError(calls[i].result))
+    {
+      logprintf(ELL_WARN,ELS_PATCHAPPLY,"Could not protect the new location of %s in the target (errno %i), transforming all variables now\n",lazyVars[i]->name,(int)-calls[i].result);
+      protectedAll=false;
+      break;
+    }
+  }
+  free(calls);
+  if(!protectedAll)
+  {
+    transformLazyVarsIn(0,~(addr_t)0,fdeMap,patch);
+    forgetLazyVars();
+    return;
+  }
+  watchPendingLazyVarPages();
+}
+
+//transform every pending lazy variable with a page in [low,high) and
+//give the target back whichever of their pages no pending variable
+//is on any more. The target must be stopped. Returns how many
+//variables were transformed
+static int transformLazyVarsIn(addr_t low,addr_t high,Map* fdeMap,ElfInfo* patch)
+{
+  int numTransformed=0;
+  bool* transformedNow=zmalloc(numLazyVars*sizeof(bool));
+  for(int i=0;i<numLazyVars;i++)
+  {
+    addr_t varLow,varHigh;
+    getLazyVarPages(i,&varLow,&varHigh);
+    if(lazyVarPending[i] && varLow<high && low<varHigh)
+    {
+      transformVarData(lazyVars[i],fdeMap,patch);
+      lazyVarPending[i]=false;
+      transformedNow[i]=true;
+      numTransformed++;
+    }
+  }
+
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  RemoteCall* calls=NULL;
+  int numCalls=0;
+  for(int i=0;i<numLazyVars;i++)
+  {
+    if(!transformedNow[i])
+    {
+      continue;
+    }
+    addr_t varLow,varHigh;
+    getLazyVarPages(i,&varLow,&varHigh);
+    for(addr_t page=varLow;page<varHigh;page+=pageSize)
+    {
+      bool stillNeeded=false;
+      for(int j=0;j<numLazyVars && !stillNeeded;j++)
+      {
+        addr_t otherLow,otherHigh;
+        getLazyVarPages(j,&otherLow,&otherHigh);
+        stillNeeded=lazyVarPending[j] && otherLow<=page && page<otherHigh;
+      }
+      if(stillNeeded)
+      {
+        continue;
+      }
+      //extend the last call if this page follows on from it
+      if(numCalls && calls[numCalls-1].args[0]+calls[numCalls-1].args[1]==page)
+      {
+        calls[numCalls-1].args[1]+=pageSize;
+        continue;
+      }
+      calls=realloc(calls,(numCalls+1)*sizeof(RemoteCall));
+      MALLOC_CHECK(calls);
+      setRemoteSyscall(&calls[numCalls++],SYS_mprotect,3,(word_t)page,(word_t)pageSize,(word_t)(PROT_READ|PROT_WRITE));
+    }
+  }
+  if(numCalls)
+  {
+    remoteCallBatch(calls,numCalls);
+    for(int i=0;i<numCalls;i++)
+    {
+      if(isRemoteSyscallError(calls[i].result))
+      {
+        death("Could not unprotect transformed variable data at 0x%zx in the target (errno %i)\n",(size_t)calls[i].args[0],(int)-calls[i].result);
+      }
+    }
+  }
+  free(calls);
+  free(transformedNow);
+  return numTransformed;
+}
+
+//lets the target run, transforming each lazy variable when a thread
+//first touches it. Whatever hasn't been touched after
+//LAZY_TRANSFORM_MAX_MILLIS is transformed then, so that we can
+//detach. The target is stopped when this returns
+static void transformLazyVars(Map* fdeMap,ElfInfo* patch)
+{
+  if(!numLazyVars)
+  {
+    return;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  int numPending=numLazyVars;
+  int numFaults=0;
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  while(numPending)
+  {
+    continueAllThreads(NULL,0);
+    long millisLeft=LAZY_TRANSFORM_MAX_MILLIS-millisSince(&start);
+    pid_t tid=millisLeft>0?waitForTargetBreakpoint(millisLeft):0;
+    stopAllThreads();
+    addr_t faultAddr;
+    if(!tid || !getThreadFaultAddress(tid,&faultAddr))
+    {
+      break;
+    }
+    numFaults++;
+    addr_t page=faultAddr & ~(pageSize-1);
+    logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"thread %i touched 0x%zx\n",tid,(size_t)faultAddr);
+    numPending-=transformLazyVarsIn(page,page+pageSize,fdeMap,patch);
+    watchPendingLazyVarPages();
+  }
+  if(numPending)
+  {
+    logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"transforming the %i variables the target hasn't used in %li ms\n",numPending,millisSince(&start));
+    transformLazyVarsIn(0,~(addr_t)0,fdeMap,patch);
+  }
+  watchTargetFaults(NULL,0);
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"transformed %i variables on first use over %li ms, %i faults taken\n",numLazyVars,millisSince(&start),numFaults);
+}
+
 void relocateVar(VarInfo* var,ElfInfo* targetBin)
 {
   int symIdx=getSymtabIdx(targetBin,var->name,0);
@@ -127,6 +343,7 @@ void relocateVar(VarInfo* var,ElfInfo* targetBin)
   //now we write the symbol to the new binary
   Elf_Data* symTabData=getDataByERS(patchedBin,ERS_SYMTAB);
   gelf_update_sym(symTabData,symIdx,&sym);
+  invalidateSymbolAddressIndexes(patchedBin);
 
   logprintf(ELL_INFO_V4,ELS_PATCHAPPLY,"var new location is 0x%x\n",var->newLocation);
 
@@ -135,10 +352,87 @@ void relocateVar(VarInfo* var,ElfInfo* targetBin)
   applyRelocations(relocItems,IN_MEM);
 }
 
+//When set, trampolines that can be are put in while the target runs
+//(see writeTargetCodeLive) after the rest of the patch has gone in,
+//rather than with it
+static bool liveTrampolines=false;
+typedef struct
+{
+  addr_t at;
+  byte code[5];
+} LiveTrampoline;
+static LiveTrampoline* pendingTrampolines=NULL;
+static int numPendingTrampolines=0;
+
+//a trampoline can go in while the target runs if it replaces a single
+//instruction of the same length. Code built with -mfentry -mnop-mcount
+//starts every function with a 5 byte nop, possibly after an endbr.
+//gcc's -fpatchable-function-entry=5 leaves five 1 byte nops instead,
+//which a thread could be part way through. Those at the very entry
+//are made into a 5 byte nop now, while the target is stopped and
+//isSafeForCodeOnlyPatch has made sure no thread is inside them.
+//Returns where the nop is or 0 if there isn't one
+static addr_t findLiveTrampolineSite(addr_t entry)
+{
+  static const byte nop5[5]={0x0F,0x1F,0x44,0x00,0x00};
+  static const byte nopSled[5]={0x90,0x90,0x90,0x90,0x90};
+  static const byte endbr64[4]={0xF3,0x0F,0x1E,0xFA};
+  static const byte endbr32[4]={0xF3,0x0F,0x1E,0xFB};
+  byte code[9];
+  if(!memcpyFromTargetNoDeath(code,entry,sizeof(code)))
+  {
+    return 0;
+  }
+  if(!memcmp(code,nop5,5))
+  {
+    return entry;
+  }
+  if(!memcmp(code,nopSled,5))
+  {
+    memcpyToTargetCode(entry,(byte*)nop5,5);
+    return entry;
+  }
+  if((!memcmp(code,endbr64,4) || !memcmp(code,endbr32,4)) && !memcmp(code+4,nop5,5))
+  {
+    return entry+4;
+  }
+  return 0;
+}
+
 void insertTrampolineJump(addr_t insertAt,addr_t jumpTo)
 {
   printf("inserting at 0x%zx, address to jump to is 0x%zx\n",insertAt,jumpTo);
-  
+
+  addr_t liveSite=liveTrampolines?findLiveTrampolineSite(insertAt):0;
+  int64_t liveDisplacement=(int64_t)jumpTo-(int64_t)(liveSite+5);
+  if(liveSite && liveDisplacement>=INT32_MIN && liveDisplacement<=INT32_MAX)
+  {
+    pendingTrampolines=realloc(pendingTrampolines,(numPendingTrampolines+1)*sizeof(LiveTrampoline));
+    MALLOC_CHECK(pendingTrampolines);
+    LiveTrampoline* tramp=&pendingTrampolines[numPendingTrampolines++];
+    tramp->at=liveSite;
+    tramp->code[0]=0xE9;//jmp rel32
+    int32_t rel=(int32_t)liveDisplacement;
+    memcpy(tramp->code+1,&rel,4);
+    return;
+  }
+
+  //a jmp rel32 is only 5 bytes and, being direct, is cheap for the
+  //processor to follow. We can use it whenever the new code is
+  //within 2GB, which is where the patch memory is placed if at all possible
+  int64_t displacement=(int64_t)jumpTo-(int64_t)(insertAt+5);
+#ifdef KATANA_X86_64_ARCH
+  if(displacement>=INT32_MIN && displacement<=INT32_MAX)
+#endif
+  {
+    byte rel32Jump[5];
+    rel32Jump[0]=0xE9;//jmp rel32
+    int32_t rel=(int32_t)displacement;
+    memcpy(rel32Jump+1,&rel,4);
+    memcpyToTargetCode(insertAt,rel32Jump,5);
+    return;
+  }
+
   //remember that the JMP absolute is indirect, have to specify
   //memory location which hold the memory location to jump to
 #ifdef KATANA_X86_ARCH
@@ -161,17 +455,40 @@ void insertTrampolineJump(addr_t insertAt,addr_t jumpTo)
   #error Unknown architecture
   #endif
   
-  memcpyToTarget(insertAt,code,len);
-  //todo: probably don't need verify as memcpyToTarget can
-  //be made to verify it's writings
-  byte* verify=zmalloc(len);
-  memcpyFromTarget(verify,insertAt,len);
-  if(memcmp(code,verify,len))
+  //verified along with everything else when the transaction is committed
+  memcpyToTargetCode(insertAt,code,len);
+  free(code);
+}
+
+//puts in the trampolines insertTrampolineJump held back. Lets the
+//target run while doing so, it is stopped again when this returns
+static void installLiveTrampolines()
+{
+  if(!numPendingTrampolines)
   {
-    death("failed to copy code into target properly\n");
+    return;
   }
-  free(code);
-  free(verify);
+  TargetIOVec* vecs=zmalloc(numPendingTrampolines*sizeof(TargetIOVec));
+  for(int i=0;i<numPendingTrampolines;i++)
+  {
+    vecs[i].addr=pendingTrampolines[i].at;
+    vecs[i].data=pendingTrampolines[i].code;
+    vecs[i].len=5;
+  }
+  continueAllThreads(NULL,0);
+  writeTargetCodeLive(vecs,numPendingTrampolines);
+  stopAllThreads();
+  free(vecs);
+  finishLiveCodeWrites();
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"put in %i trampolines while the target ran\n",numPendingTrampolines);
+}
+
+static void forgetLiveTrampolines()
+{
+  free(pendingTrampolines);
+  pendingTrampolines=NULL;
+  numPendingTrampolines=0;
+  liveTrampolines=false;
 }
 
 void applyVariablePatch(VarInfo* var,Map* fdeMap,ElfInfo* patch)
@@ -200,7 +517,14 @@ void applyVariablePatch(VarInfo* var,Map* fdeMap,ElfInfo* patch)
     }
     if(var->type->fde)//might not have an fde if just a constant with a changed initializer
     {
-      transformVarData(var,fdeMap,patch);
+      if(shouldTransformLazily(var))
+      {
+        deferVarTransformation(var);
+      }
+      else
+      {
+        transformVarData(var,fdeMap,patch);
+      }
     }
     if(var->newLocation!=var->oldLocation)
     {
@@ -230,6 +554,124 @@ void applyVariablePatch(VarInfo* var,Map* fdeMap,ElfInfo* patch)
   }
 }
 
+//Point references to the function name in the target straight at
+//its new code at newAddr, so that calls don't have to go through the
+//trampoline at oldAddr. Uses the relocations in the target binary:
+//GOT and other pointer slots from the dynamic relocations, and, if the
+//binary was linked with --emit-relocs, direct calls and jumps from
+//.rela.text. Each reference is only changed if it really does still
+//refer to oldAddr. Returns how many references were changed
+int retargetReferencesToFunction(char* name,addr_t oldAddr,addr_t newAddr)
+{
+  int numRetargeted=0;
+  for(Elf_Scn* scn=elf_nextscn(targetBin->e,NULL);scn;scn=elf_nextscn(targetBin->e,scn))
+  {
+    GElf_Shdr shdr;
+    getShdr(scn,&shdr);
+    if((SHT_REL!=shdr.sh_type && SHT_RELA!=shdr.sh_type) || !shdr.sh_entsize)
+    {
+      continue;
+    }
+    //the symbols these relocations refer to
+    Elf_Scn* symScn=elf_getscn(targetBin->e,shdr.sh_link);
+    if(!symScn)
+    {
+      continue;
+    }
+    GElf_Shdr symShdr;
+    getShdr(symScn,&symShdr);
+    Elf_Data* symData=elf_getdata(symScn,NULL);
+    Elf_Data* data=elf_getdata(scn,NULL);
+    for(int j=0;j<data->d_size/shdr.sh_entsize;j++)
+    {
+      GElf_Rela rela;
+      if(SHT_RELA==shdr.sh_type)
+      {
+        gelf_getrela(data,j,&rela);
+      }
+      else
+      {
+        GElf_Rel rel;
+        gelf_getrel(data,j,&rel);
+        rela.r_offset=rel.r_offset;
+        rela.r_info=rel.r_info;
+        rela.r_addend=0;
+      }
+      GElf_Sym sym;
+      if(!ELF64_R_SYM(rela.r_info) || !gelf_getsym(symData,ELF64_R_SYM(rela.r_info),&sym))
+      {
+        continue;
+      }
+      char* symName=elf_strptr(targetBin->e,symShdr.sh_link,sym.st_name);
+      if(!symName || strcmp(symName,name))
+      {
+        continue;
+      }
+      addr_t where=rela.r_offset;
+      switch(ELF64_R_TYPE(rela.r_info))//elf64 because it's GElf
+      {
+#ifdef KATANA_X86_64_ARCH
+      case R_X86_64_GLOB_DAT:
+      case R_X86_64_JUMP_SLOT:
+      case R_X86_64_64:
+#else
+      case R_386_GLOB_DAT:
+      case R_386_JMP_SLOT:
+      case R_386_32:
+#endif
+        {
+          //a slot holding the function's address. A lazily bound
+          //JUMP_SLOT may not hold it yet, in which case leave it alone
+          addr_t value;
+          memcpyFromTarget((byte*)&value,where,sizeof(addr_t));
+          if(value!=oldAddr)
+          {
+            break;
+          }
+          memcpyToTarget(where,(byte*)&newAddr,sizeof(addr_t));
+          logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"retargeted pointer to %s at 0x%zx\n",name,where);
+          numRetargeted++;
+        }
+        break;
+#ifdef KATANA_X86_64_ARCH
+      case R_X86_64_PC32:
+      case R_X86_64_PLT32:
+#else
+      case R_386_PC32:
+      case R_386_PLT32:
+#endif
+        {
+          //only direct calls and jumps, which we can recognize by their
+          //opcode right before the displacement
+          byte insn[5];
+          memcpyFromTarget(insn,where-1,5);
+          if(0xE8!=insn[0] && 0xE9!=insn[0])
+          {
+            break;
+          }
+          int32_t rel;
+          memcpy(&rel,insn+1,4);
+          if(where+4+rel!=oldAddr)
+          {
+            break;
+          }
+          int64_t displacement=(int64_t)newAddr-(int64_t)(where+4);
+          if(displacement<INT32_MIN || displacement>INT32_MAX)
+          {
+            break;
+          }
+          rel=(int32_t)displacement;
+          memcpyToTargetCode(where,(byte*)&rel,4);
+          logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"retargeted %s to %s at 0x%zx\n",0xE8==insn[0]?"call":"jump",name,where-1);
+          numRetargeted++;
+        }
+        break;
+      }
+    }
+  }
+  return numRetargeted;
+}
+
 void applyFunctionPatch(SubprogramInfo* func,int pid,ElfInfo* targetBin,ElfInfo* patch)
 {
   logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"patching function %s\n",func->name);
@@ -257,7 +699,15 @@ void applyFunctionPatch(SubprogramInfo* func,int pid,ElfInfo* targetBin,ElfInfo*
     //track of where it is for future patches
     Elf_Data* symTabData=getDataByERS(patchedBin,ERS_SYMTAB);
     gelf_update_sym(symTabData,idx,&sym);
+    invalidateSymbolAddressIndexes(patchedBin);
+    //the trampoline still catches anything we can't retarget,
+    //such as function pointers stored in data
     insertTrampolineJump(oldAddr,addr);
+    if(isFlag(EKCF_P_RETARGET_REFERENCES))
+    {
+      int numRetargeted=retargetReferencesToFunction(func->name,oldAddr,addr);
+      logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"retargeted %i references to %s\n",numRetargeted,func->name);
+    }
 
   }
   else
@@ -339,11 +789,22 @@ addr_t copyInEntireSection(ElfInfo* patch,char* name,char* newName)
   {
     death("Failed to find data for section %s in patch\n",name);
   }
-  addr_t addr=getFreeSpaceInTarget(data->d_size);
+  GElf_Shdr shdr,shdrNew;
+  gelf_getshdr(scn,&shdr);
+  E_PATCH_POOL pool=poolForSectionFlags(shdr.sh_flags);
+  addr_t addr=getFreeSpaceInTargetPool(pool,data->d_size,shdr.sh_addralign);
   if(data->d_size)
   {
     logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"mapping in the entirety of %s Copying %li bytes to 0x%lx\n",name,(long)data->d_size,(unsigned long)addr);
-    memcpyToTarget(addr,data->d_buf,data->d_size);
+    if(EPP_DATA==pool)
+    {
+      memcpyToTarget(addr,data->d_buf,data->d_size);
+    }
+    else
+    {
+      //code and rodata pools aren't writable by the target
+      memcpyToTargetCode(addr,data->d_buf,data->d_size);
+    }
   }
   else
   {
@@ -352,8 +813,6 @@ addr_t copyInEntireSection(ElfInfo* patch,char* name,char* newName)
 
   //and create a section for it
   Elf_Scn* newscn = elf_newscn (patchedBin->e);
-  GElf_Shdr shdr,shdrNew;
-  gelf_getshdr(scn,&shdr);
   gelf_getshdr(scn,&shdrNew);
   shdrNew.sh_addr=addr;
   shdrNew.sh_name=addStrtabEntryToExisting(patchedBin,newName,true);
@@ -718,7 +1177,6 @@ void katanaPLT()
 #else
 #error Unknown architecture
 #endif
-  memcpyToTarget(shdr.sh_addr+2,(byte*)&addr,sizeof(addr));
   memcpy(pltData->d_buf+2,&addr,sizeof(addr));
   //now fix up the jmp in PLT0
   addr=newGOTAddress-(shdr.sh_addr+12); //subtraction because relative addressing
@@ -727,8 +1185,7 @@ void katanaPLT()
 #elif defined(KATANA_X86_64_ARCH)
   addr+=16;
 #endif
-  memcpyToTarget(shdr.sh_addr+8,(byte*)&addr,sizeof(addr));
-  memcpy(pltData->d_buf+2,&addr,sizeof(addr));
+  memcpy(pltData->d_buf+8,&addr,sizeof(addr));
   //now we've fixed up PLT0,
   //proceed to the rest
   uint pltEntsize=shdr.sh_entsize;
@@ -762,18 +1219,50 @@ void katanaPLT()
     //make it a pc-relative address again
     newAddr-=shdr.sh_addr+entryOffset+6;
 #endif
-    memcpyToTarget(shdr.sh_addr+entryOffset+2,(byte*)&newAddr,4);//todo: support large code model
-    memcpy(pltData->d_buf+entryOffset+2,&newAddr,4);
+    memcpy(pltData->d_buf+entryOffset+2,&newAddr,4);//todo: support large code model
   }
+  //every change above was made to our copy of the section, which
+  //otherwise matches what copyInEntireSection put in the target, so
+  //the whole PLT goes in with one write instead of one per entry
+  memcpyToTargetCode(shdr.sh_addr,pltData->d_buf,pltData->d_size);
 
 }
 
-void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
+//A compilation unit of the patch and what in it is to be patched
+typedef struct
 {
-  startPtrace(pid);
-  targetBin=targetBin_;
-  
-  
+  VarInfo** vars;//NULL-terminated
+  SubprogramInfo** subprograms;//NULL-terminated
+} PlannedUnit;
+
+//Everything about applying a patch that can be worked out without
+//stopping the target. It is put together while the target keeps
+//running so that the time the target is held is spent only on the
+//safety check and on the changes themselves
+typedef struct
+{
+  DwarfInfo* diPatch;
+  Map* fdeMap;//mapping between fde offsets and fde structures
+  PlannedUnit* units;
+  int numUnits;
+  //bytes of each pool the patch will need
+  uint amount[EPP_CNT];
+  //where in the target no thread may be when we patch
+  UnsafeFunctions unsafe;
+  //true if the patch only replaces functions: it changes no variable
+  //the target already has, so there is no data to be consistent with
+  //the code. Such a patch doesn't need a safe point
+  bool codeOnly;
+} PatchPlan;
+
+//build the plan for applying patch to the process pid. Only reads
+//from the target, so it doesn't need to be stopped
+static void preparePatchPlan(PatchPlan* plan,int pid,ElfInfo* patch)
+{
+  memset(plan,0,sizeof(PatchPlan));
+  setTargetPid(pid);
+  loadPatchPools(pid);
+
   //we create an on-disk version of the patched binary
   //setting this up is much easier than modifying the in-memory ELF
   //structures. It does, however, allow us to write an accurate symbol table,
@@ -806,74 +1295,142 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
   //this isn't necessarily going to be the case
   char cwd[PATH_MAX];
   getcwd(cwd,PATH_MAX);
-  DwarfInfo* diPatch=readDWARFTypes(patch,cwd);
-  Map* fdeMap=readDebugFrame(patch,false);//get mapping between fde offsets and fde structures
-  if(!fdeMap)
+  plan->diPatch=readDWARFTypes(patch,cwd);
+  plan->fdeMap=readDebugFrame(patch,false);
+  if(!plan->fdeMap)
   {
     death("Unable to read frame info, can't apply patch\n");
   }
-  
-
 
   //we need to know where malloc lives in the target because
-  //we may need it when dealing with the heap
-  addr_t mallocAddr=locateRuntimeSymbolInTarget(targetBin,"malloc");
-  if(mallocAddr)
-  {
-    setMallocAddress(mallocAddr);
-  }
-  else
+  //we may need it when dealing with the heap. The link map is read
+  //while the target runs; it only changes if the target loads or
+  //unloads a library in the meantime. Any other runtime symbols a
+  //patch needs belong in the same lookup, it's one walk of the link map
+  char* runtimeSymbolNames[]={"malloc","free"};
+  addr_t runtimeSymbolAddrs[2];
+  locateRuntimeSymbolsInTarget(targetBin,runtimeSymbolNames,runtimeSymbolAddrs,2);
+  if(!runtimeSymbolAddrs[0])
   {
     death("Cannot find malloc in the target program\n");
   }
+  setMallocAddress(runtimeSymbolAddrs[0]);
+  //only needed to give back what a patch that is backed out malloc'd
+  setFreeAddress(runtimeSymbolAddrs[1]);
   setTargetTextStart(targetBin->textStart[IN_MEM]);
+  getUnsafeFunctions(targetBin,patch,&plan->unsafe);
 
-  
-  bringTargetToSafeState(targetBin,patch,pid);
-
-  //reserve memory in a big block so that we'll have as much as we need
-  uint amount=0;
+  //work out how much memory in each pool we'll need so that it can be
+  //reserved in as few regions as possible
   GElf_Shdr shdr;
   char* sectionsToMapIn[]={".text.new",".rodata.new",".data.new",".rela.text.new",NULL};
   for(int i=0;sectionsToMapIn[i];i++)
   {
     getShdr(getSectionByName(patch,sectionsToMapIn[i]),&shdr);
-    amount+=shdr.sh_size;
+    plan->amount[poolForSectionFlags(shdr.sh_flags)]+=shdr.sh_size+shdr.sh_addralign;
   }
   //include their sizes so we can use ALTPLT/EXTPLT technique from ERESI/Elfsh
-  getShdrByERS(targetBin,ERS_GOT,&shdr);
-  amount+=shdr.sh_size;
-  getShdrByERS(targetBin,ERS_PLT,&shdr);
-  amount+=shdr.sh_size;
-  getShdrByERS(targetBin,ERS_GOTPLT,&shdr);
-  amount+=shdr.sh_size;
+  E_RECOGNIZED_SECTION pltSections[]={ERS_GOT,ERS_PLT,ERS_GOTPLT};
+  for(int i=0;i<3;i++)
+  {
+    getShdrByERS(targetBin,pltSections[i],&shdr);
+    plan->amount[poolForSectionFlags(shdr.sh_flags)]+=shdr.sh_size+shdr.sh_addralign;
+  }
 
   #ifdef KATANA_X86_64_ARCH
-  addr_t desiredAddress=0;
+  //keep patch memory within rel32 reach of the original text so it
+  //can be reached with direct jumps and calls. Code built with the
+  //small code model also needs all of it in the low 2GB
+  getShdrByERS(targetBin,ERS_TEXT,&shdr);
+  addr_t textLow=(addr_t)targetBin->textStart[IN_MEM];
+  setPatchPlacement(textLow,textLow+shdr.sh_size,patchedBin->textUsesSmallCodeModel?0x80000000UL:0);
+  #endif
 
-  //we need to request a memory address near the beginning
-  //of the binary to accomodate small code model
-  //TODO: make sure this is scalable, that I've taken
-  //all possibilities into account
-  MappedRegion* regions=0;
-  int numRegions=getMemoryMap(pid,&regions);
-  if(numRegions>=2)
+  for(List* cuLi=plan->diPatch->compilationUnits;cuLi;cuLi=cuLi->next)
   {
-    desiredAddress=(regions[1].high+1+sizeof(word_t));
-    uint misalignment=desiredAddress%sizeof(word_t);
-    desiredAddress-=misalignment;
+    plan->numUnits++;
   }
-  #endif
+  plan->units=zmalloc(sizeof(PlannedUnit)*plan->numUnits);
+  int unitIdx=0;
+  //retargeting references rewrites call sites and GOT slots, which
+  //can't be done safely in a running target
+  plan->codeOnly=!isFlag(EKCF_P_ALWAYS_SAFE_POINT) && !isFlag(EKCF_P_RETARGET_REFERENCES);
+  for(List* cuLi=plan->diPatch->compilationUnits;cuLi;cuLi=cuLi->next,unitIdx++)
+  {
+    CompilationUnit* cu=cuLi->value;
+    printf("reading patch compilation unit %s\n",cu->name);
+    plan->units[unitIdx].vars=(VarInfo**)dictValues(cu->tv->globalVars);
+    plan->units[unitIdx].subprograms=(SubprogramInfo**)dictValues(cu->subprograms);
+    VarInfo** vars=plan->units[unitIdx].vars;
+    for(int i=0;vars[i] && plan->codeOnly;i++)
+    {
+      plan->codeOnly=STN_UNDEF==getSymtabIdx(targetBin,vars[i]->name,0);
+    }
+  }
+  if(plan->codeOnly)
+  {
+    logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Patch only replaces code\n");
+  }
+}
 
-  #ifdef KATANA_X86_64_ARCH
-  addr_t receivedAddres=reserveFreeSpaceInTarget(amount,desiredAddress);
-  if(receivedAddres > 0xFFFFFFFF && patchedBin->textUsesSmallCodeModel)
+static void freePatchPlan(PatchPlan* plan)
+{
+  for(int i=0;i<plan->numUnits;i++)
   {
-    //todo: if at first we don't succeed, try again
-    death("Needed to put new memory pages in the lower 32 bits of the address space and was unable to accomplish this");
+    free(plan->units[i].vars);
+    free(plan->units[i].subprograms);
+  }
+  free(plan->units);
+  mapDelete(plan->fdeMap,NULL,free);
+  freeUnsafeFunctions(&plan->unsafe);
+  forgetLazyVars();
+  forgetLiveTrampolines();
+}
+
+//when the target reached the safe state it is held in while the
+//patch goes in. config.maxPauseMillis is measured from here
+static struct timespec pauseStart;
+
+//true if the target hasn't been held longer than config.maxPauseMillis
+//yet. step and name say what was just done, for the report if it has
+static bool withinPauseBudget(char* step,char* name)
+{
+  if(!config.maxPauseMillis)
+  {
+    return true;
+  }
+  long paused=millisSince(&pauseStart);
+  if(paused<=config.maxPauseMillis)
+  {
+    return true;
+  }
+  logprintf(ELL_WARN,ELS_PATCHAPPLY,"Pause budget of %i ms exceeded after %s%s%s: target stopped for %li ms so far. Backing out the patch\n",config.maxPauseMillis,step,name?" ":"",name?name:"",paused);
+  return false;
+}
+
+//make the changes the plan calls for. The target must be stopped
+//and in a safe state. Returns false if it couldn't be done within
+//config.maxPauseMillis, in which case the target's memory is as it
+//was before
+static bool commitPatchPlan(PatchPlan* plan,int pid,ElfInfo* patch)
+{
+  //from here on writes to the target are collected and made all at
+  //once at the end, so the target sees the patch appear in one step
+  //and we don't pay a syscall for every small write
+  beginTargetTransaction();
+
+  for(int i=0;i<EPP_CNT;i++)
+  {
+    if(plan->amount[i])
+    {
+      reserveFreeSpaceInTarget(i,plan->amount[i],0);
+    }
+  }
+  if(!withinPauseBudget("reserving patch memory",NULL))
+  {
+    abortTargetTransaction();
+    return false;
   }
-  #endif
-    
 
   //map in the entirety of .text.new
   patchTextAddr=copyInEntireSection(patch,".text.new",NULL);
@@ -888,32 +1445,40 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
   katanaPLT();
   
   writeOutPatchedBin(false);
+  if(!withinPauseBudget("copying in the patch sections and PLT",NULL))
+  {
+    abortTargetTransaction();
+    return false;
+  }
 
   logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Applying patches=======\n");
-  for(List* cuLi=diPatch->compilationUnits;cuLi;cuLi=cuLi->next)
+  for(int u=0;u<plan->numUnits;u++)
   {
-    CompilationUnit* cu=cuLi->value;
-    printf("reading patch compilation unit %s\n",cu->name);
-        
     //first patch variables
-    VarInfo** vars=(VarInfo**) dictValues(cu->tv->globalVars);
+    VarInfo** vars=plan->units[u].vars;
     for(int i=0;vars[i];i++)
     {
-      applyVariablePatch(vars[i],fdeMap,patch);
+      applyVariablePatch(vars[i],plan->fdeMap,patch);
+      if(!withinPauseBudget("patching variable",vars[i]->name))
+      {
+        abortTargetTransaction();
+        return false;
+      }
     }
-    free(vars);
 
     //then patch functions
-    SubprogramInfo** subprograms=(SubprogramInfo**)dictValues(cu->subprograms);
+    SubprogramInfo** subprograms=plan->units[u].subprograms;
     for(int i=0;subprograms[i];i++)
     {
       applyFunctionPatch(subprograms[i],pid,targetBin,patch);
+      if(!withinPauseBudget("patching function",subprograms[i]->name))
+      {
+        abortTargetTransaction();
+        return false;
+      }
     }
-    free(subprograms);
   }
 
-
-  mapDelete(fdeMap,NULL,free);
   logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"======Fixup Patch Relocations=======\n");
   fixupPatchRelocations(patch);
   logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"====================================\n");
@@ -946,11 +1511,84 @@ void readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
     reloc.symIdx=ELF64_R_SYM(rela.r_info);//elf64 because it's GElf
     applyRelocation(&reloc,IN_MEM);//todo: on disk as well
   }
+  if(!withinPauseBudget("relocating the patch",NULL))
+  {
+    abortTargetTransaction();
+    return false;
+  }
 
+  commitTargetTransaction();
+  //everything is in place by now, but the target hasn't run any of
+  //it, so it can still be put back exactly as it was
+  if(!withinPauseBudget("writing the patch into the target",NULL))
+  {
+    undoTargetTransaction();
+    return false;
+  }
+  return true;
+}
+
+bool readAndApplyPatch(int pid,ElfInfo* targetBin_,ElfInfo* patch)
+{
+  targetBin=targetBin_;
+  struct timespec phaseStart;
+  clock_gettime(CLOCK_MONOTONIC,&phaseStart);
+  PatchPlan plan;
+  preparePatchPlan(&plan,pid,patch);
+  long prepareMillis=millisSince(&phaseStart);
+
+  //the target is only stopped from here until endPtrace
+  clock_gettime(CLOCK_MONOTONIC,&phaseStart);
+  startPtrace(pid);
+  if(plan.codeOnly && isSafeForCodeOnlyPatch(targetBin,&plan.unsafe))
+  {
+    logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Not waiting for a safe point for a patch which only replaces code\n");
+    liveTrampolines=canWriteTargetCodeLive();
+  }
+  else
+  {
+    bringTargetToSafeState(targetBin,&plan.unsafe);
+  }
+  long safetyMillis=millisSince(&phaseStart);
+  clock_gettime(CLOCK_MONOTONIC,&phaseStart);
+  pauseStart=phaseStart;
+  bool applied=commitPatchPlan(&plan,pid,patch);
+  if(applied)
+  {
+    protectLazyVars(plan.fdeMap,patch);
+  }
+  long commitMillis=millisSince(&phaseStart);
+  if(applied)
+  {
+    installLiveTrampolines();
+  }
+  if(applied)
+  {
+    //the target runs again from here, only stopping to transform data
+    //the first time it touches it
+    transformLazyVars(plan.fdeMap,patch);
+  }
+  endPtrace(isFlag(EKCF_P_STOP_TARGET));
+  if(!applied)
+  {
+    freePatchPlan(&plan);
+    endELF(targetBin);
+    endELF(patchedBin);
+    cleanupDwarfVM();
+    fprintf(stderr,"The patch could not be applied within the pause budget of %i ms and was backed out, the target is unchanged. Try again when it is less busy\n",config.maxPauseMillis);
+    return false;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&phaseStart);
+  savePatchPools(pid);
+  printPatchMemoryUsage();
   writeOutPatchedBin(true);
+  freePatchPlan(&plan);
   endELF(targetBin);
   endELF(patchedBin);
   cleanupDwarfVM();
-  endPtrace(isFlag(EKCF_P_STOP_TARGET));
+  long finishMillis=millisSince(&phaseStart);
+  logprintf(ELL_INFO_V1,ELS_PATCHAPPLY,"Patch timing: %li ms preparing while the target ran, target stopped for %li ms (%li ms reaching a safe state, %li ms applying), %li ms writing out results\n",prepareMillis,safetyMillis+commitMillis,safetyMillis,commitMillis,finishMillis);
   printf("hooray! completed application of patch successfully\n");
+  return true;
 }
@@ -56,6 +56,8 @@
 #ifndef patchapply_h
 #define patchapply_h
 
-void readAndApplyPatch(int pid,ElfInfo* targetBin,ElfInfo* patch);
+//returns false if the patch had to be backed out because it couldn't
+//be applied within config.maxPauseMillis
+bool readAndApplyPatch(int pid,ElfInfo* targetBin,ElfInfo* patch);
 
 #endif
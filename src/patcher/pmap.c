@@ -60,6 +60,9 @@
 
 #include "pmap.h"
 #include <util/logging.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "arch.h"
 
 
 
@@ -87,18 +90,109 @@ int getMemoryMap(int pid,MappedRegion** regions)
     *regions=realloc(*regions,sizeof(MappedRegion)*numRegions);
     assert(*regions);
     memset(&(*regions)[numRegions-1],0,sizeof(MappedRegion));
-    sscanf(linebuf,"%zx-%zx",&(*regions)[numRegions-1].low,&(*regions)[numRegions-1].high);
+    MappedRegion* region=&(*regions)[numRegions-1];
+    char perms[5]="";
+    sscanf(linebuf,"%zx-%zx %4s",&region->low,&region->high,perms);
+    region->prot=('r'==perms[0]?PROT_READ:0) | ('w'==perms[1]?PROT_WRITE:0) |
+      ('x'==perms[2]?PROT_EXEC:0);
     char* path=strchr(linebuf,'/');
+    char* kernelName=strchr(linebuf,'[');
     if(path)
     {
-      strncpy((*regions)[numRegions-1].name,path,PATH_MAX-1);
+      strncpy(region->name,path,PATH_MAX-1);
+    }
+    else if(kernelName)
+    {
+      strncpy(region->name,kernelName,PATH_MAX-1);
     }
     else
     {
-      char* name="(no corresponding file)";
-      strcpy((*regions)[numRegions-1].name,name);
+      strcpy(region->name,ANONYMOUS_REGION_NAME);
     }
   }
   fclose(f);
   return numRegions;
 }
+
+//lowest address mmap will normally hand out (vm.mmap_min_addr)
+#define LOWEST_MAPPABLE_ADDR 0x10000
+#ifdef KATANA_X86_64_ARCH
+#define TOP_OF_USER_SPACE 0x7ffffffff000UL
+#else
+#define TOP_OF_USER_SPACE 0xc0000000UL
+#endif
+
+//how far the farthest byte of [addr,addr+size) is from the farthest
+//byte of [nearLow,nearHigh). The ranges must not overlap
+static addr_t spanDistance(addr_t addr,addr_t size,addr_t nearLow,addr_t nearHigh)
+{
+  if(addr>=nearHigh)
+  {
+    return addr+size-nearLow;
+  }
+  return nearHigh-addr;
+}
+
+addr_t findFreeGapNear(MappedRegion* regions,int numRegions,addr_t size,
+                       addr_t nearLow,addr_t nearHigh,addr_t maxDistance,addr_t maxAddr)
+{
+  addr_t pageSize=sysconf(_SC_PAGE_SIZE);
+  size=(size+pageSize-1)&~(pageSize-1);
+  addr_t best=0;
+  addr_t bestDistance=0;
+  addr_t gapLow=LOWEST_MAPPABLE_ADDR;
+  //maps lists regions in address order, look at the gap before each
+  //one and after the last
+  for(int i=0;i<=numRegions;i++)
+  {
+    addr_t gapHigh=i<numRegions?regions[i].low:TOP_OF_USER_SPACE;
+    if(gapHigh>gapLow && gapHigh-gapLow>=size)
+    {
+      //the nearest spot in the gap is at one end or the other
+      addr_t candidates[2]={gapLow,gapHigh-size};
+      for(int j=0;j<2;j++)
+      {
+        addr_t candidate=candidates[j];
+        addr_t distance=spanDistance(candidate,size,nearLow,nearHigh);
+        if(distance>maxDistance || (maxAddr && candidate+size>maxAddr))
+        {
+          continue;
+        }
+        if(!best || distance<bestDistance)
+        {
+          best=candidate;
+          bestDistance=distance;
+        }
+      }
+    }
+    if(i<numRegions && regions[i].high>gapLow)
+    {
+      gapLow=regions[i].high;
+    }
+  }
+  return best;
+}
+
+unsigned long long getProcessStartTime(int pid)
+{
+  char buf[64];
+  snprintf(buf,64,"/proc/%i/stat",pid);
+  FILE* f=fopen(buf,"r");
+  if(!f)
+  {
+    return 0;
+  }
+  char linebuf[1024];
+  char* line=fgets(linebuf,sizeof(linebuf),f);
+  fclose(f);
+  //the command name in field 2 is in parentheses and may itself
+  //contain spaces and parentheses, so count fields from the last ')'
+  char* fields=line?strrchr(line,')'):NULL;
+  unsigned long long startTime=0;
+  if(!fields || 1!=sscanf(fields+1,"%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s"
+                          " %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu",&startTime))
+  {
+    return 0;
+  }
+  return startTime;
+}
@@ -65,10 +65,17 @@
 #define PATH_MAX 4096
 #endif
 
+//the name given to mappings with no file behind them and none of
+//the kernel's names ([heap], [stack], ...) either
+#define ANONYMOUS_REGION_NAME "(no corresponding file)"
+
 typedef struct
 {
   addr_t low;
   addr_t high;
+  int prot;//PROT_READ etc. as the region is currently mapped
+  //the file mapped, the kernel's name for the region
+  //or ANONYMOUS_REGION_NAME
   char name[PATH_MAX];
 } MappedRegion;
 
@@ -77,3 +84,18 @@ typedef struct
 //this memory should be freed when it is no longer needed
 //returns -1 if /proc/pid/maps could not be opened
 int getMemoryMap(int pid,MappedRegion** regions);
+
+//find the best place to map size bytes given the address space
+//described by regions (as returned by getMemoryMap): the start of a
+//free gap for which every byte of the mapping would be within
+//maxDistance of every byte of [nearLow,nearHigh), choosing the
+//closest such spot. If maxAddr is non-zero the mapping must also end
+//at or below it. Returns 0 if there is no such place
+addr_t findFreeGapNear(MappedRegion* regions,int numRegions,addr_t size,
+                       addr_t nearLow,addr_t nearHigh,addr_t maxDistance,addr_t maxAddr);
+
+//the time, in clock ticks after boot, at which the process pid
+//started (field 22 of /proc/pid/stat). Together with the pid it tells
+//one process apart from a later one given the same pid.
+//Returns 0 if it can't be read
+unsigned long long getProcessStartTime(int pid);
@@ -0,0 +1,459 @@
+/*
+  File: remotecall.c
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Run batches of system calls and function calls inside the target
+               with a single stop/continue round trip
+*/
+
+#include "remotecall.h"
+#include "target.h"
+#include "arch.h"
+#include "util/logging.h"
+#include "constants.h"
+#include <stdarg.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/user.h>
+
+extern addr_t targetTextStart;
+
+//most calls we can make in one trip. Bounded so that the stub (at
+//most 85 bytes per call on x86_64) fits comfortably at the start of
+//any real program's text
+#define REMOTE_CALLS_PER_TRIP 12
+#define REMOTE_STUB_MAX_LEN (REMOTE_CALLS_PER_TRIP*96+1)
+//the x86_64 ABI lets leaf functions use 128 bytes below the stack
+//pointer without moving it, we must not clobber them
+#define RED_ZONE_SIZE 128
+
+void setRemoteSyscall(RemoteCall* call,word_t number,int numArgs,...)
+{
+  assert(numArgs<=REMOTE_CALL_MAX_ARGS);
+  memset(call,0,sizeof(RemoteCall));
+  call->type=ERCT_SYSCALL;
+  call->number=number;
+  call->numArgs=numArgs;
+  va_list ap;
+  va_start(ap,numArgs);
+  for(int i=0;i<numArgs;i++)
+  {
+    call->args[i]=va_arg(ap,word_t);
+  }
+  va_end(ap);
+}
+
+void setRemoteFunctionCall(RemoteCall* call,addr_t function,int numArgs,...)
+{
+  assert(numArgs<=REMOTE_CALL_MAX_ARGS);
+  memset(call,0,sizeof(RemoteCall));
+  call->type=ERCT_FUNCTION;
+  call->function=function;
+  call->numArgs=numArgs;
+  va_list ap;
+  va_start(ap,numArgs);
+  for(int i=0;i<numArgs;i++)
+  {
+    call->args[i]=va_arg(ap,word_t);
+  }
+  va_end(ap);
+}
+
+void setRemoteMmap(RemoteCall* call,word_t size,int prot,int extraFlags,addr_t desiredAddress)
+{
+  #ifdef KATANA_X86_ARCH
+  //the old i386 mmap syscall takes its arguments in a structure,
+  //mmap2 takes them in registers (with the offset in pages)
+  word_t number=SYS_mmap2;
+  #else
+  word_t number=SYS_mmap;
+  #endif
+  setRemoteSyscall(call,number,6,(word_t)desiredAddress,size,(word_t)prot,
+                   (word_t)(MAP_PRIVATE|MAP_ANONYMOUS|extraFlags),(word_t)-1,(word_t)0);
+}
+
+bool isRemoteSyscallError(word_t result)
+{
+  //the kernel returns -errno, and errno is never more than 4095
+  return result>(word_t)-4096;
+}
+
+typedef struct
+{
+  byte code[REMOTE_STUB_MAX_LEN];
+  int len;
+} Stub;
+
+static void emit(Stub* stub,int numBytes,...)
+{
+  va_list ap;
+  va_start(ap,numBytes);
+  for(int i=0;i<numBytes;i++)
+  {
+    stub->code[stub->len++]=(byte)va_arg(ap,int);
+  }
+  va_end(ap);
+}
+
+static void emitWord(Stub* stub,word_t value)
+{
+  memcpy(stub->code+stub->len,&value,sizeof(word_t));
+  stub->len+=sizeof(word_t);
+}
+
+#ifdef KATANA_X86_64_ARCH
+//REX prefix and opcode for mov reg,imm64 for each argument register
+static const byte syscallArgRegs[REMOTE_CALL_MAX_ARGS][2]=
+  {{0x48,0xbf},{0x48,0xbe},{0x48,0xba},{0x49,0xba},{0x49,0xb8},{0x49,0xb9}};//rdi rsi rdx r10 r8 r9
+static const byte functionArgRegs[REMOTE_CALL_MAX_ARGS][2]=
+  {{0x48,0xbf},{0x48,0xbe},{0x48,0xba},{0x48,0xb9},{0x49,0xb8},{0x49,0xb9}};//rdi rsi rdx rcx r8 r9
+
+static void emitCall(Stub* stub,RemoteCall* call,addr_t resultAddr)
+{
+  const byte (*argRegs)[2]=ERCT_SYSCALL==call->type?syscallArgRegs:functionArgRegs;
+  for(int i=0;i<call->numArgs;i++)
+  {
+    emit(stub,2,argRegs[i][0],argRegs[i][1]);
+    emitWord(stub,call->args[i]);
+  }
+  if(ERCT_SYSCALL==call->type)
+  {
+    emit(stub,2,0x48,0xb8);//mov rax,number
+    emitWord(stub,call->number);
+    emit(stub,2,0x0f,0x05);//syscall
+  }
+  else
+  {
+    //go through r11 rather than rax because al tells variadic
+    //functions how many vector registers hold arguments
+    emit(stub,2,0x49,0xbb);//mov r11,function
+    emitWord(stub,call->function);
+    emit(stub,2,0x31,0xc0);//xor eax,eax
+    emit(stub,3,0x41,0xff,0xd3);//call r11
+  }
+  emit(stub,2,0x48,0xa3);//mov [resultAddr],rax
+  emitWord(stub,resultAddr);
+}
+#elif defined(KATANA_X86_ARCH)
+//opcode for mov reg,imm32 for each syscall argument register
+static const byte syscallArgRegs[REMOTE_CALL_MAX_ARGS]={0xbb,0xb9,0xba,0xbe,0xbf,0xbd};//ebx ecx edx esi edi ebp
+
+static void emitCall(Stub* stub,RemoteCall* call,addr_t resultAddr)
+{
+  if(ERCT_SYSCALL==call->type)
+  {
+    for(int i=0;i<call->numArgs;i++)
+    {
+      emit(stub,1,syscallArgRegs[i]);
+      emitWord(stub,call->args[i]);
+    }
+    emit(stub,1,0xb8);//mov eax,number
+    emitWord(stub,call->number);
+    emit(stub,2,0xcd,0x80);//int 0x80
+  }
+  else
+  {
+    //cdecl, arguments pushed right to left. The stack is 16-byte
+    //aligned when the stub starts, keep it so at the call
+    word_t argBytes=call->numArgs*sizeof(word_t);
+    word_t padding=(16-argBytes%16)%16;
+    emit(stub,2,0x81,0xec);//sub esp,padding
+    emitWord(stub,padding);
+    for(int i=call->numArgs-1;i>=0;i--)
+    {
+      emit(stub,1,0x68);//push arg
+      emitWord(stub,call->args[i]);
+    }
+    emit(stub,1,0xb8);//mov eax,function
+    emitWord(stub,call->function);
+    emit(stub,2,0xff,0xd0);//call eax
+    emit(stub,2,0x81,0xc4);//add esp,argBytes+padding
+    emitWord(stub,argBytes+padding);
+  }
+  emit(stub,1,0xa3);//mov [resultAddr],eax
+  emitWord(stub,resultAddr);
+}
+#else
+#error Unknown architecture
+#endif
+
+//runs the stub of stubLen bytes at stubAddr (which must end in an
+//int3) in the target with the given registers, returning once
+//it reaches the int3. regs is updated to the registers at that
+//point. Returns false if it didn't get there within
+//REMOTE_CALL_TIMEOUT_MILLIS, the target is stopped wherever it was
+static bool runStub(struct user_regs_struct* regs,addr_t stubAddr,int stubLen)
+{
+  REG_IP(*regs)=stubAddr;
+  //if the target was stopped in the middle of a syscall, keep the
+  //kernel from trying to restart it on top of our stub
+#ifdef KATANA_X86_64_ARCH
+  regs->orig_rax=-1;
+#else
+  regs->orig_eax=-1;
+#endif
+  setTargetRegs(regs);
+  continuePtrace();
+  if(!waitForTargetTrap(REMOTE_CALL_TIMEOUT_MILLIS))
+  {
+    logprintf(ELL_WARN,ELS_HOTPATCH,"remote calls in the target did not finish within %i ms, abandoning them\n",REMOTE_CALL_TIMEOUT_MILLIS);
+    return false;
+  }
+  getTargetRegs(regs);
+  if(REG_IP(*regs)!=stubAddr+stubLen)
+  {
+    death("target stopped at 0x%zx instead of at the end of the remote call stub at 0x%zx\n",(addr_t)REG_IP(*regs),stubAddr+stubLen);
+  }
+  return true;
+}
+
+//stack pointer to run a stub with, leaving room below the
+//target's own stack for reserve bytes
+static addr_t stubStackPointer(struct user_regs_struct* regs,size_t reserve)
+{
+  addr_t sp=REG_SP(*regs)-RED_ZONE_SIZE-reserve;
+  return sp&~(addr_t)15;
+}
+
+//what a call that never ran is left with
+static void failRemoteCalls(RemoteCall* calls,int numCalls)
+{
+  for(int i=0;i<numCalls;i++)
+  {
+    calls[i].result=ERCT_SYSCALL==calls[i].type?(word_t)-ETIMEDOUT:0;
+  }
+}
+
+//runs up to REMOTE_CALLS_PER_TRIP calls with one continue
+static bool remoteCallTrip(RemoteCall* calls,int numCalls)
+{
+  struct user_regs_struct oldRegs,newRegs;
+  getTargetRegs(&oldRegs);
+  newRegs=oldRegs;
+
+  //results go on the target's stack, below anything it might be using
+  addr_t resultsAddr=stubStackPointer(&oldRegs,numCalls*sizeof(word_t));
+  REG_SP(newRegs)=resultsAddr;
+
+  Stub stub;
+  stub.len=0;
+  for(int i=0;i<numCalls;i++)
+  {
+    emitCall(&stub,&calls[i],resultsAddr+i*sizeof(word_t));
+  }
+  emit(&stub,1,0xcc);//int3, hand control back to us
+
+  //the start of text is normally code that has already run
+  //(_start), so nothing should be executing there. If we don't
+  //know where it is, the current instruction will do
+  addr_t stubAddr=targetTextStart?targetTextStart:REG_IP(oldRegs);
+  byte* oldText=zmalloc(stub.len);
+  peekTarget(oldText,stubAddr,stub.len);
+  pokeTargetCode(stubAddr,stub.code,stub.len);
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"running %i remote calls in the target with a %i byte stub at 0x%zx\n",numCalls,stub.len,stubAddr);
+
+  bool finished=runStub(&newRegs,stubAddr,stub.len);
+  if(finished)
+  {
+    word_t results[REMOTE_CALLS_PER_TRIP];
+    peekTarget((byte*)results,resultsAddr,numCalls*sizeof(word_t));
+    for(int i=0;i<numCalls;i++)
+    {
+      calls[i].result=results[i];
+    }
+  }
+  else
+  {
+    //we can't tell which of the calls completed
+    failRemoteCalls(calls,numCalls);
+  }
+
+  //put everything back the way it was. If the stub was abandoned
+  //part way, whatever it was in the middle of is forgotten with it
+  pokeTargetCode(stubAddr,oldText,stub.len);
+  free(oldText);
+  setTargetRegs(&oldRegs);
+  return finished;
+}
+
+bool remoteCallBatch(RemoteCall* calls,int numCalls)
+{
+  for(int i=0;i<numCalls;i+=REMOTE_CALLS_PER_TRIP)
+  {
+    int inTrip=numCalls-i;
+    if(inTrip>REMOTE_CALLS_PER_TRIP)
+    {
+      inTrip=REMOTE_CALLS_PER_TRIP;
+    }
+    if(!remoteCallTrip(calls+i,inTrip))
+    {
+      failRemoteCalls(calls+i+inTrip,numCalls-i-inTrip);
+      return false;
+    }
+  }
+  return true;
+}
+
+//Loop calling a function once for each entry in an array and
+//storing each return value in a second array. On entry the
+//registers hold: the argument array pointer, the result array
+//pointer, the count and the function address
+#ifdef KATANA_X86_64_ARCH
+//rbx=args r12=results r13=count r14=function
+static const byte callOverArrayLoop[]={
+  0x4d,0x85,0xed,       //loop: test r13,r13
+  0x74,0x19,            //      jz done
+  0x48,0x8b,0x3b,       //      mov rdi,[rbx]
+  0x31,0xc0,            //      xor eax,eax
+  0x41,0xff,0xd6,       //      call r14
+  0x49,0x89,0x04,0x24,  //      mov [r12],rax
+  0x48,0x83,0xc3,0x08,  //      add rbx,8
+  0x49,0x83,0xc4,0x08,  //      add r12,8
+  0x49,0xff,0xcd,       //      dec r13
+  0xeb,0xe2,            //      jmp loop
+  0xcc                  //done: int3
+};
+#else
+//ebx=args esi=results edi=count ebp=function
+static const byte callOverArrayLoop[]={
+  0x83,0xec,0x0c,       //      sub esp,12 (keeps the stack aligned at the call)
+  0x85,0xff,            //loop: test edi,edi
+  0x74,0x12,            //      jz done
+  0xff,0x33,            //      push dword [ebx]
+  0xff,0xd5,            //      call ebp
+  0x83,0xc4,0x04,       //      add esp,4
+  0x89,0x06,            //      mov [esi],eax
+  0x83,0xc3,0x04,       //      add ebx,4
+  0x83,0xc6,0x04,       //      add esi,4
+  0x4f,                 //      dec edi
+  0xeb,0xea,            //      jmp loop
+  0xcc                  //done: int3
+};
+#endif
+
+bool remoteCallOverArray(addr_t function,word_t* args,word_t* results,int num)
+{
+  if(num<=REMOTE_CALLS_PER_TRIP)
+  {
+    //not worth setting up the loop, one ordinary batch will do
+    RemoteCall calls[REMOTE_CALLS_PER_TRIP];
+    for(int i=0;i<num;i++)
+    {
+      setRemoteFunctionCall(&calls[i],function,1,args[i]);
+    }
+    bool finished=remoteCallBatch(calls,num);
+    for(int i=0;i<num;i++)
+    {
+      results[i]=calls[i].result;
+    }
+    return finished;
+  }
+
+  //scratch mapping holding the loop followed by the two arrays
+  size_t codeLen=(sizeof(callOverArrayLoop)+15)&~(size_t)15;
+  size_t arrayLen=num*sizeof(word_t);
+  size_t scratchLen=codeLen+2*arrayLen;
+  RemoteCall call;
+  setRemoteMmap(&call,scratchLen,PROT_READ|PROT_WRITE|PROT_EXEC,0,0);
+  if(!remoteCallBatch(&call,1))
+  {
+    memset(results,0,num*sizeof(word_t));
+    return false;
+  }
+  if(isRemoteSyscallError(call.result))
+  {
+    death("could not map scratch memory in the target for %i remote calls (errno %i)\n",num,(int)-call.result);
+  }
+  addr_t scratch=call.result;
+  addr_t argsAddr=scratch+codeLen;
+  addr_t resultsAddr=argsAddr+arrayLen;
+
+  byte* image=zmalloc(codeLen+arrayLen);
+  memcpy(image,callOverArrayLoop,sizeof(callOverArrayLoop));
+  memcpy(image+codeLen,args,arrayLen);
+  pokeTargetCode(scratch,image,codeLen+arrayLen);
+  free(image);
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"running %i calls of 0x%zx in a loop in the target\n",num,function);
+
+  struct user_regs_struct oldRegs,newRegs;
+  getTargetRegs(&oldRegs);
+  newRegs=oldRegs;
+  REG_SP(newRegs)=stubStackPointer(&oldRegs,0);
+#ifdef KATANA_X86_64_ARCH
+  REG_BX(newRegs)=argsAddr;
+  REG_12(newRegs)=resultsAddr;
+  REG_13(newRegs)=num;
+  REG_14(newRegs)=function;
+#else
+  REG_BX(newRegs)=argsAddr;
+  REG_SI(newRegs)=resultsAddr;
+  REG_DI(newRegs)=num;
+  REG_BP(newRegs)=function;
+#endif
+  bool finished=runStub(&newRegs,scratch,sizeof(callOverArrayLoop));
+  if(finished)
+  {
+    peekTarget((byte*)results,resultsAddr,arrayLen);
+  }
+  else
+  {
+    memset(results,0,arrayLen);
+  }
+  setTargetRegs(&oldRegs);
+
+  //a loop that was abandoned is no longer running once its registers
+  //are gone, so the mapping can go either way
+  setRemoteSyscall(&call,SYS_munmap,2,scratch,(word_t)scratchLen);
+  remoteCallBatch(&call,1);
+  return finished;
+}
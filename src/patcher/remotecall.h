@@ -0,0 +1,118 @@
+/*
+  File: remotecall.h
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Run batches of system calls and function calls inside the target
+               with a single stop/continue round trip
+*/
+
+#ifndef remotecall_h
+#define remotecall_h
+
+#include "types.h"
+
+#define REMOTE_CALL_MAX_ARGS 6
+
+typedef enum
+{
+  ERCT_SYSCALL,//a raw system call, number is the syscall number
+  ERCT_FUNCTION//a function in the target, function is its address
+} E_REMOTE_CALL_TYPE;
+
+typedef struct
+{
+  E_REMOTE_CALL_TYPE type;
+  word_t number;//syscall number for ERCT_SYSCALL
+  addr_t function;//address to call for ERCT_FUNCTION
+  int numArgs;
+  word_t args[REMOTE_CALL_MAX_ARGS];
+  word_t result;//filled in by remoteCallBatch
+} RemoteCall;
+
+//fill in call to be the system call number with the given
+//arguments (numArgs of them, each a word_t)
+void setRemoteSyscall(RemoteCall* call,word_t number,int numArgs,...);
+//fill in call to be a call of the function at the given address
+//in the target with the given arguments (numArgs of them, each a word_t)
+void setRemoteFunctionCall(RemoteCall* call,addr_t function,int numArgs,...);
+
+//fill in call to be an anonymous private mmap of size bytes, with
+//any extra flags given. The mapping is placed at desiredAddress if
+//possible, but MAP_FIXED is not used unless it is in extraFlags
+void setRemoteMmap(RemoteCall* call,word_t size,int prot,int extraFlags,addr_t desiredAddress);
+
+//makes all of the calls, in order, in the target. The calls are
+//made by a stub written over the start of the target's text
+//(see setTargetTextStart) and run with a single continue, so a whole
+//batch costs about the same as one call. Everything the stub
+//touches, code and registers, is restored before returning.
+//The result of each call is left in its result field.
+//Syscall results are raw, i.e. -errno on failure
+//Very large batches may take more than one round trip.
+//If the target doesn't get through them within
+//REMOTE_CALL_TIMEOUT_MILLIS (a malloc waiting on a lock one of the
+//stopped threads holds, say) they are abandoned, the target put back
+//as it was and false returned. Calls that may not have run are left
+//with -ETIMEDOUT (syscalls) or 0 (functions) as their result
+bool remoteCallBatch(RemoteCall* calls,int numCalls);
+
+//calls the function at the given address in the target once for
+//each of the num entries in args, passing it that entry as its only
+//argument and storing what it returns in the corresponding entry in
+//results. Takes a constant number of round trips however large num
+//is, the loop runs in the target out of a scratch mapping.
+//Times out as remoteCallBatch does, leaving every result 0
+bool remoteCallOverArray(addr_t function,word_t* args,word_t* results,int num);
+
+//true if result is an error returned by a raw syscall
+bool isRemoteSyscallError(word_t result);
+
+#endif
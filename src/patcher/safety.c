@@ -65,11 +65,13 @@
 #include "constants.h"
 #include <unistd.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
 #include "safety.h"
 #include "katana_config.h"
 #include "elfutil.h"
-
-static const int MAX_WAIT_SECONDS_BEFORE_TRY_CURRENT_FRAME = 2;
+#include "stackunwind.h"
+#include "hotpatch.h"
 
 FDE* getFDEForPC(ElfInfo* elf,addr_t pc)
 {
@@ -344,6 +346,8 @@ struct user_regs_struct restoreRegsFromRegisterRules(struct user_regs_struct cur
   return regs;
 }
 
+//used for printing backtraces, see below for the unwinding done to
+//check safety
 unw_addr_space_t unwindAddrSpace;
 void* unwindUPTHandle;
 unw_cursor_t unwindCursor;
@@ -370,17 +374,201 @@ typedef struct
   idx_t symIdx;
 } ActivationFrame;
 
-//returns list with data type ActivationFrame. This list will be a list
-//of stack frames relevant to the target it will be ordered oldest
-//(further up the stack) to newest (further down the stack). This
-//ordering may be counter-intuitive, but makes sense because if we
-//find a safety conflict in something up the stack, it invalidates
-//everything further down the stack too
-DList* findActivationFrames(ElfInfo* elf,int pid)
+//Unwinding the target's threads is done in parallel by katana
+//threads. ptrace requests only work from the katana thread that
+//attached, so the unwinders read memory with
+//memcpyFromTargetConcurrent and registers from a snapshot taken
+//while the target was stopped. Stacks are unwound with
+//unwindStackLocally (see stackunwind.h) where possible, otherwise
+//with libunwind, which still uses libunwind-ptrace to find unwind
+//info from the binaries on disk
+typedef struct
 {
-  DList* activationFramesHead=NULL;
-  startLibUnwind(pid);
-  unw_word_t ip;
+  pid_t tid;
+  struct user_regs_struct regs;
+  void* uptHandle;
+  //pcs of frames in the target's text, newest first
+  addr_t* pcs;
+  int numPcs;
+  int allocatedPcs;
+  bool failed;
+  bool unwoundLocally;//by unwindStackLocally rather than libunwind
+} ThreadUnwind;
+
+//the libunwind-ptrace functions want their own handle
+#define UPT_HANDLE(arg) (((ThreadUnwind*)(arg))->uptHandle)
+
+static int unwindFindProcInfo(unw_addr_space_t as,unw_word_t ip,unw_proc_info_t* pi,
+                              int needUnwindInfo,void* arg)
+{
+  return _UPT_find_proc_info(as,ip,pi,needUnwindInfo,UPT_HANDLE(arg));
+}
+
+static void unwindPutUnwindInfo(unw_addr_space_t as,unw_proc_info_t* pi,void* arg)
+{
+  _UPT_put_unwind_info(as,pi,UPT_HANDLE(arg));
+}
+
+static int unwindGetDynInfoListAddr(unw_addr_space_t as,unw_word_t* dilAddr,void* arg)
+{
+  return _UPT_get_dyn_info_list_addr(as,dilAddr,UPT_HANDLE(arg));
+}
+
+//libunwind-ptrace passes its own handle rather than our ThreadUnwind
+//back to this when it reads unwind tables, so arg must not be used
+static int unwindAccessMem(unw_addr_space_t as,unw_word_t addr,unw_word_t* val,
+                           int write,void* arg)
+{
+  if(write || !memcpyFromTargetConcurrent((byte*)val,addr,sizeof(unw_word_t)))
+  {
+    return -UNW_EINVAL;
+  }
+  return 0;
+}
+
+static int unwindAccessReg(unw_addr_space_t as,unw_regnum_t reg,unw_word_t* val,
+                           int write,void* arg)
+{
+  ThreadUnwind* unwind=arg;
+  if(write)
+  {
+    return -UNW_EINVAL;
+  }
+  //libunwind numbers the general purpose registers as dwarf does
+  if(UNW_REG_IP==reg)
+  {
+    *val=REG_IP(unwind->regs);
+  }
+  else if(reg>=0 && reg<UNW_REG_IP)
+  {
+    *val=getRegValueFromDwarfRegNum(unwind->regs,reg);
+  }
+  else
+  {
+    return -UNW_EBADREG;
+  }
+  return 0;
+}
+
+static int unwindAccessFpreg(unw_addr_space_t as,unw_regnum_t reg,unw_fpreg_t* val,
+                             int write,void* arg)
+{
+  return -UNW_EBADREG;
+}
+
+static int unwindResume(unw_addr_space_t as,unw_cursor_t* cursor,void* arg)
+{
+  return -UNW_EINVAL;
+}
+
+static int unwindGetProcName(unw_addr_space_t as,unw_word_t addr,char* buf,size_t bufLen,
+                             unw_word_t* offset,void* arg)
+{
+  return _UPT_get_proc_name(as,addr,buf,bufLen,offset,UPT_HANDLE(arg));
+}
+
+static unw_accessors_t concurrentUnwindAccessors=
+{
+  .find_proc_info=unwindFindProcInfo,
+  .put_unwind_info=unwindPutUnwindInfo,
+  .get_dyn_info_list_addr=unwindGetDynInfoListAddr,
+  .access_mem=unwindAccessMem,
+  .access_reg=unwindAccessReg,
+  .access_fpreg=unwindAccessFpreg,
+  .resume=unwindResume,
+  .get_proc_name=unwindGetProcName
+};
+
+//don't bother starting more unwinders than this
+#define MAX_UNWIND_THREADS 16
+
+typedef struct
+{
+  ThreadUnwind* unwinds;
+  int numUnwinds;
+  int next;//the next unwind for an unwinder to take
+  pthread_mutex_t lock;
+  addr_t lowpc;
+  addr_t highpc;
+} UnwindQueue;
+
+static void addFramePC(UnwindQueue* queue,ThreadUnwind* unwind,addr_t ip)
+{
+  if(queue->lowpc<=ip && ip<=queue->highpc)
+  {
+    if(unwind->numPcs==unwind->allocatedPcs)
+    {
+      unwind->allocatedPcs=unwind->allocatedPcs?unwind->allocatedPcs*2:32;
+      unwind->pcs=realloc(unwind->pcs,unwind->allocatedPcs*sizeof(addr_t));
+      MALLOC_CHECK(unwind->pcs);
+    }
+    unwind->pcs[unwind->numPcs++]=ip;
+  }
+}
+
+static void unwindTargetThread(UnwindQueue* queue,ThreadUnwind* unwind,unw_addr_space_t as)
+{
+  //the local unwinder needs no syscalls beyond copying the stack, but
+  //gives up on frames it has no or no simple call frame information
+  //for (the vdso, signal trampolines), which libunwind can handle
+  addr_t* pcs;
+  int numPcs=unwindStackLocally(&unwind->regs,&pcs);
+  if(numPcs>=0)
+  {
+    for(int i=0;i<numPcs;i++)
+    {
+      addFramePC(queue,unwind,pcs[i]);
+    }
+    free(pcs);
+    unwind->unwoundLocally=true;
+    return;
+  }
+  unw_cursor_t cursor;
+  unwind->uptHandle=_UPT_create(unwind->tid);
+  if(!unwind->uptHandle || unw_init_remote(&cursor,as,unwind)<0)
+  {
+    unwind->failed=true;
+    return;
+  }
+  //the current frame counts as much as any other
+  do
+  {
+    unw_word_t ip;
+    if(unw_get_reg(&cursor,UNW_REG_IP,&ip)<0)
+    {
+      break;
+    }
+    addFramePC(queue,unwind,ip);
+  } while(unw_step(&cursor)>0);
+}
+
+static void* unwindWorker(void* arg)
+{
+  UnwindQueue* queue=arg;
+  //address spaces cache unwind info and are not to be shared
+  unw_addr_space_t as=unw_create_addr_space(&concurrentUnwindAccessors,__LITTLE_ENDIAN);
+  while(true)
+  {
+    pthread_mutex_lock(&queue->lock);
+    int idx=queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if(idx>=queue->numUnwinds)
+    {
+      break;
+    }
+    unwindTargetThread(queue,&queue->unwinds[idx],as);
+  }
+  unw_destroy_addr_space(as);
+  return NULL;
+}
+
+//returns an array with the list of activation frames for each thread
+//of the target (see findActivationFrames), numThreads set to its
+//length and tids to their tids (which the caller must free)
+static DList** findAllActivationFrames(ElfInfo* elf,pid_t** tids,int* numThreads)
+{
+  UnwindQueue queue;
+  memset(&queue,0,sizeof(UnwindQueue));
   GElf_Shdr shdr;
   //todo: should support multiple text sections for applying
   //patches to already patched executables
@@ -388,21 +576,70 @@ DList* findActivationFrames(ElfInfo* elf,int pid)
   {
     death("gelf_getshdr failed\n");
   }
-  addr_t lowpc=shdr.sh_addr;
-  addr_t highpc=lowpc+shdr.sh_size;
-  
-  while (unw_step(&unwindCursor) > 0)
+  queue.lowpc=shdr.sh_addr;
+  queue.highpc=queue.lowpc+shdr.sh_size;
+
+  //registers have to come through ptrace, so are read here
+  *tids=getTargetThreadIds(&queue.numUnwinds);
+  refreshUnwindInfo((*tids)[0]);
+  queue.unwinds=zmalloc(queue.numUnwinds*sizeof(ThreadUnwind));
+  for(int i=0;i<queue.numUnwinds;i++)
   {
-    unw_get_reg(&unwindCursor, UNW_REG_IP, &ip);
-    if(lowpc<=ip && ip<=highpc)
+    queue.unwinds[i].tid=(*tids)[i];
+    getThreadRegs((*tids)[i],&queue.unwinds[i].regs);
+  }
+
+  int numUnwinders=sysconf(_SC_NPROCESSORS_ONLN);
+  if(numUnwinders>queue.numUnwinds)
+  {
+    numUnwinders=queue.numUnwinds;
+  }
+  if(numUnwinders>MAX_UNWIND_THREADS)
+  {
+    numUnwinders=MAX_UNWIND_THREADS;
+  }
+  pthread_mutex_init(&queue.lock,NULL);
+  pthread_t unwinders[MAX_UNWIND_THREADS];
+  int numStarted=0;
+  //we do one share of the work ourselves
+  for(;numStarted<numUnwinders-1;numStarted++)
+  {
+    if(pthread_create(&unwinders[numStarted],NULL,unwindWorker,&queue))
+    {
+      break;
+    }
+  }
+  unwindWorker(&queue);
+  for(int i=0;i<numStarted;i++)
+  {
+    pthread_join(unwinders[i],NULL);
+  }
+  pthread_mutex_destroy(&queue.lock);
+  int numLocal=0;
+  for(int i=0;i<queue.numUnwinds;i++)
+  {
+    numLocal+=queue.unwinds[i].unwoundLocally?1:0;
+  }
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Unwound %i target threads with %i unwinders, %i of them from call frame information alone\n",queue.numUnwinds,numStarted+1,numLocal);
+
+  //symbol lookup isn't safe to do from several threads, so it's done
+  //here once the unwinding is done
+  DList** frames=zmalloc(queue.numUnwinds*sizeof(DList*));
+  for(int i=0;i<queue.numUnwinds;i++)
+  {
+    ThreadUnwind* unwind=&queue.unwinds[i];
+    if(unwind->failed)
     {
-      //we found an activation frame that's in the text section for our program
-      //(i.e. as opposed to in libc or something)
+      death("Could not unwind the stack of target thread %i\n",unwind->tid);
+    }
+    for(int j=0;j<unwind->numPcs;j++)
+    {
+      addr_t ip=unwind->pcs[j];
       //now we try to find its symbol.
       idx_t symIdx=findSymbolContainingAddress(elf,ip,STT_FUNC,SHN_UNDEF);
       if(STN_UNDEF!=symIdx)
       {
-        logprintf(ELL_INFO_V1,ELS_SAFETY,"Found activation frame at 0x%x\n",ip);
+        logprintf(ELL_INFO_V1,ELS_SAFETY,"Found activation frame at 0x%x in thread %i\n",ip,unwind->tid);
         DList* li=zmalloc(sizeof(DList));
         li->value=zmalloc(sizeof(ActivationFrame));
         ((ActivationFrame*)li->value)->pc=ip;
@@ -410,135 +647,492 @@ DList* findActivationFrames(ElfInfo* elf,int pid)
         //push the frame (which will be further up the stack) onto the front
         //of the list. This gives us a list ordered from old to new
         //this is because rejecting an older frame will reject all newer ones
-        dlistPush(&activationFramesHead,NULL,li);
+        dlistPush(&frames[i],NULL,li);
       }
       //of if is STB_UNDEF, might be _start or something we don't care about
     }
+    if(unwind->uptHandle)
+    {
+      _UPT_destroy(unwind->uptHandle);
+    }
+    free(unwind->pcs);
   }
-  endLibUnwind();
-  return activationFramesHead;
+  free(queue.unwinds);
+  *numThreads=queue.numUnwinds;
+  return frames;
+}
+
+static int cmpUnsafeRanges(const void* a,const void* b)
+{
+  addr_t startA=((UnsafeRange*)a)->start;
+  addr_t startB=((UnsafeRange*)b)->start;
+  return startA<startB?-1:(startA>startB?1:0);
 }
 
-//find a location in the target where nothing that's being patched is being used.
-addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid,
-                                  bool avoidCurrentFrame)
+void getUnsafeFunctions(ElfInfo* targetBin,ElfInfo* patch,UnsafeFunctions* unsafe)
 {
-  DList* activationFrames=findActivationFrames(targetBin,pid);
   Elf_Data* unsafeFunctionsData=getDataByERS(patch,ERS_UNSAFE_FUNCTIONS);
   if(!unsafeFunctionsData)
   {
     death("Patch object does not contain any unsafe functions data. This should not be\n");
   }
-  size_t numUnsafeFunctions=unsafeFunctionsData->d_size/sizeof(idx_t);
+  int numUnsafe=unsafeFunctionsData->d_size/sizeof(idx_t);
+  unsafe->ranges=zmalloc(numUnsafe*sizeof(UnsafeRange));
   //have to go through and reindex them all
-  idx_t* unsafeFunctions=zmalloc(numUnsafeFunctions*sizeof(idx_t));
-  for(int i=0;i<numUnsafeFunctions;i++)
+  idx_t* symIdxs=zmalloc(numUnsafe*sizeof(idx_t));
+  memcpy(symIdxs,unsafeFunctionsData->d_buf,numUnsafe*sizeof(idx_t));
+  if(reindexSymbols(patch,targetBin,symIdxs,numUnsafe,ESFF_VERSIONED_SECTIONS_OK))
   {
-    idx_t symIdxPatch=((idx_t*)unsafeFunctionsData->d_buf)[i];
-    idx_t symIdxTarget=reindexSymbol(patch,targetBin,symIdxPatch,ESFF_VERSIONED_SECTIONS_OK);
-    if(STN_UNDEF==symIdxTarget)
+    death("Failed to reindex symbol for unsafe function\n");
+  }
+  for(int i=0;i<numUnsafe;i++)
+  {
+    GElf_Sym sym;
+    getSymbol(targetBin,symIdxs[i],&sym);
+    unsafe->ranges[i].start=sym.st_value;
+    unsafe->ranges[i].end=sym.st_value+sym.st_size;
+  }
+  free(symIdxs);
+  qsort(unsafe->ranges,numUnsafe,sizeof(UnsafeRange),cmpUnsafeRanges);
+  //a function may be listed more than once
+  unsafe->num=0;
+  for(int i=0;i<numUnsafe;i++)
+  {
+    if(unsafe->num && unsafe->ranges[unsafe->num-1].start==unsafe->ranges[i].start)
     {
-      death("Failed to reindex symbol for unsafe function\n");
+      UnsafeRange* last=&unsafe->ranges[unsafe->num-1];
+      last->end=max(last->end,unsafe->ranges[i].end);
+      continue;
     }
-    unsafeFunctions[i]=symIdxTarget;
+    unsafe->ranges[unsafe->num++]=unsafe->ranges[i];
   }
-  DList* deepestGoodFrameLi=NULL;
-  DList* li=activationFrames;
-  for(;li;li=li->next)
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Patch changes %i functions in the target\n",unsafe->num);
+}
+
+void freeUnsafeFunctions(UnsafeFunctions* unsafe)
+{
+  free(unsafe->ranges);
+  unsafe->ranges=NULL;
+  unsafe->num=0;
+}
+
+//the unsafe range with the greatest start not after pc, or NULL if
+//there isn't one
+static UnsafeRange* findUnsafeRange(UnsafeFunctions* unsafe,addr_t pc)
+{
+  int low=0;
+  int high=unsafe->num;
+  while(low<high)
   {
-    ActivationFrame* frame=li->value;
-    idx_t symIdx=frame->symIdx;
-    bool unsafe=false;
-    for(int i=0;i<numUnsafeFunctions;i++)
+    int mid=low+(high-low)/2;
+    if(unsafe->ranges[mid].start<=pc)
     {
-      if(symIdx==unsafeFunctions[i])
-      {
-        unsafe=true;
-        break;
-      }
+      low=mid+1;
     }
-    if(unsafe)
+    else
+    {
+      high=mid;
+    }
+  }
+  return low?&unsafe->ranges[low-1]:NULL;
+}
+
+static bool isUnsafeFunctionEntry(UnsafeFunctions* unsafe,addr_t pc)
+{
+  UnsafeRange* range=findUnsafeRange(unsafe,pc);
+  return range && range->start==pc;
+}
+
+static bool isFrameUnsafe(UnsafeFunctions* unsafe,ActivationFrame* frame)
+{
+  UnsafeRange* range=findUnsafeRange(unsafe,frame->pc);
+  //a thread right at the start of the function hasn't run any of
+  //it yet, so has no state depending on the old code or types. If
+  //the function is replaced it will run the new version once the
+  //trampoline is in
+  return range && range->start<frame->pc && frame->pc<range->end;
+}
+
+//a set of places to put breakpoints
+typedef struct
+{
+  addr_t* locs;
+  int num;
+  int allocated;
+} SpotSet;
+
+//duplicates are allowed until uniqueSpots is called
+static void addSpot(SpotSet* spots,addr_t loc)
+{
+  if(spots->num==spots->allocated)
+  {
+    spots->allocated=spots->allocated?spots->allocated*2:16;
+    spots->locs=realloc(spots->locs,spots->allocated*sizeof(addr_t));
+    MALLOC_CHECK(spots->locs);
+  }
+  spots->locs[spots->num++]=loc;
+}
+
+static int cmpSpots(const void* a,const void* b)
+{
+  addr_t addrA=*(addr_t*)a;
+  addr_t addrB=*(addr_t*)b;
+  return addrA<addrB?-1:(addrA>addrB?1:0);
+}
+
+//sort the spots and drop duplicates, a breakpoint can only go in once
+static void uniqueSpots(SpotSet* spots)
+{
+  if(!spots->num)
+  {
+    return;
+  }
+  qsort(spots->locs,spots->num,sizeof(addr_t),cmpSpots);
+  int numUnique=1;
+  for(int i=1;i<spots->num;i++)
+  {
+    if(spots->locs[i]!=spots->locs[numUnique-1])
+    {
+      spots->locs[numUnique++]=spots->locs[i];
+    }
+  }
+  spots->num=numUnique;
+}
+
+//Where the target's threads spend their time in the unsafe functions,
+//from sampling their stacks for a short while (see sampleTarget)
+typedef struct
+{
+  int numSamples;
+  //for each unsafe range, how many thread samples had a frame in it
+  int* onStack;
+  //for each unsafe range, how many times a thread that had a frame in
+  //it one sample didn't the next
+  int* exits;
+} SafetySamples;
+
+//which unsafe ranges a thread had frames in at its last sample
+typedef struct
+{
+  pid_t tid;
+  bool* present;
+} ThreadSample;
+
+//index of the unsafe range pc is inside, -1 if none
+static int unsafeRangeIndex(UnsafeFunctions* unsafe,addr_t pc)
+{
+  UnsafeRange* range=findUnsafeRange(unsafe,pc);
+  if(!range || pc>=range->end)
+  {
+    return -1;
+  }
+  return range-unsafe->ranges;
+}
+
+//lets the target run for config.safetySampleMillis, stopping it every
+//SAFETY_SAMPLE_INTERVAL_MILLIS to see which unsafe functions each
+//thread is in. A function a thread is always in while we watch (a
+//loop it waits in, say) is one it won't be leaving soon, so returns
+//into it are not worth stopping for. The target is stopped when this
+//returns
+static void sampleTarget(ElfInfo* targetBin,UnsafeFunctions* unsafe,SafetySamples* samples)
+{
+  samples->numSamples=0;
+  samples->onStack=zmalloc(sizeof(int)*(unsafe->num+1));
+  samples->exits=zmalloc(sizeof(int)*(unsafe->num+1));
+  ThreadSample* last=NULL;
+  int numLast=0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  while(millisSince(&start)<config.safetySampleMillis)
+  {
+    continueAllThreads(NULL,0);
+    //no breakpoints are set, this just deals with anything else that
+    //happens to the threads while they run
+    waitForTargetBreakpoint(SAFETY_SAMPLE_INTERVAL_MILLIS);
+    stopAllThreads();
+    pid_t* tids;
+    int numThreads;
+    DList** activationFrames=findAllActivationFrames(targetBin,&tids,&numThreads);
+    ThreadSample* current=zmalloc(sizeof(ThreadSample)*numThreads);
+    for(int i=0;i<numThreads;i++)
     {
-      logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) failed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc));
-      if(li->prev)
+      current[i].tid=tids[i];
+      current[i].present=zmalloc(sizeof(bool)*(unsafe->num+1));
+      for(DList* li=activationFrames[i];li;li=li->next)
       {
-        li->prev->next=NULL;
+        int idx=unsafeRangeIndex(unsafe,((ActivationFrame*)li->value)->pc);
+        if(idx>=0)
+        {
+          current[i].present[idx]=true;
+        }
       }
-      deleteDList(li,free);
-      li=NULL;
-      break;
+      for(int j=0;j<unsafe->num;j++)
+      {
+        samples->onStack[j]+=current[i].present[j]?1:0;
+      }
+      for(int k=0;k<numLast;k++)
+      {
+        if(last[k].tid!=tids[i])
+        {
+          continue;
+        }
+        for(int j=0;j<unsafe->num;j++)
+        {
+          samples->exits[j]+=(last[k].present[j] && !current[i].present[j])?1:0;
+        }
+        break;
+      }
+      deleteDList(activationFrames[i],free);
     }
-    else
+    for(int k=0;k<numLast;k++)
     {
-      deepestGoodFrameLi=li;
-      logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) passed safety check\n",((ActivationFrame*)deepestGoodFrameLi->value)->pc,getFunctionNameAtPC(targetBin,frame->pc));
+      free(last[k].present);
     }
+    free(last);
+    last=current;
+    numLast=numThreads;
+    free(activationFrames);
+    free(tids);
+    samples->numSamples++;
   }
-  if(!deepestGoodFrameLi)
+  for(int k=0;k<numLast;k++)
   {
-    printBacktrace(targetBin,pid);
-    death("All functions with activation frames on the stack require patching. The application will never be in a patchable state!");
+    free(last[k].present);
   }
-
-  if(deepestGoodFrameLi->prev && avoidCurrentFrame)
+  free(last);
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Sampled the target's stacks %i times in %li ms\n",samples->numSamples,millisSince(&start));
+  for(int j=0;j<unsafe->num;j++)
   {
-    //never break in the current function if possible
-    deepestGoodFrameLi = deepestGoodFrameLi->prev;
+    if(samples->onStack[j])
+    {
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"%s: on a stack in %i thread samples, left %i times\n",getFunctionNameAtPC(targetBin,unsafe->ranges[j].start),samples->onStack[j],samples->exits[j]);
+    }
   }
-  
-  return ((ActivationFrame*)deepestGoodFrameLi->value)->pc;
 }
 
+static void freeSafetySamples(SafetySamples* samples)
+{
+  free(samples->onStack);
+  free(samples->exits);
+  memset(samples,0,sizeof(SafetySamples));
+}
+
+//whether pc is in an unsafe function threads were seen to stay in
+//for the whole of the sampling
+static bool isParkedIn(UnsafeFunctions* unsafe,SafetySamples* samples,addr_t pc)
+{
+  if(!samples || !samples->numSamples)
+  {
+    return false;
+  }
+  int idx=unsafeRangeIndex(unsafe,pc);
+  return idx>=0 && samples->onStack[idx]>=PARKED_MIN_SAMPLES && !samples->exits[idx];
+}
 
-void bringTargetToSafeState(ElfInfo* targetBin,ElfInfo* patch,int pid)
+//looks at one thread's activation frames. Returns whether any of them
+//are unsafe, adding the return address of each unsafe frame to spots.
+//If samples are given, returns into functions the thread is parked in
+//are left out: they come around often and the thread is no closer to
+//being safe when they do
+static bool addSafeBreakpointsForThread(ElfInfo* targetBin,DList* activationFrames,
+                                        UnsafeFunctions* unsafe,SafetySamples* samples,
+                                        pid_t tid,SpotSet* spots)
 {
-  bool avoidCurrentFrame = true;
-  addr_t safeBreakpointSpot=findSafeBreakpointForPatch(targetBin,patch,pid, avoidCurrentFrame);
-  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Setting breakpoint to apply patch at 0x%x\n",
-            safeBreakpointSpot);
-  setBreakpoint(safeBreakpointSpot);
-  continuePtrace();
-  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Continuing until we reach safe spot to patch. . .\n");
-  bool breakpointReached=false;
-  int numIterations = config.maxWaitForPatching*1e6/WAIT_FOR_SAFE_PATCHING_USLEEP;
-  for(int i=0;i<numIterations;i++)
+  bool threadUnsafe=false;
+  for(DList* li=activationFrames;li;li=li->next)
   {
-    if(avoidCurrentFrame &&
-       i * WAIT_FOR_SAFE_PATCHING_USLEEP > (MAX_WAIT_SECONDS_BEFORE_TRY_CURRENT_FRAME*1e6))
+    ActivationFrame* frame=li->value;
+    if(!isFrameUnsafe(unsafe,frame))
     {
-      logprintf(ELL_INFO_V2, ELS_PATCHAPPLY,
-                "Program still waiting for breakpoint, relaxing restriction on current function\n");
-      kill(pid,SIGSTOP);
-      waitpid(pid, NULL, WUNTRACED);
-      removeBreakpoint(safeBreakpointSpot);
-      avoidCurrentFrame = false;
-      safeBreakpointSpot = findSafeBreakpointForPatch(targetBin, patch, pid, avoidCurrentFrame);
-      setBreakpoint(safeBreakpointSpot);
-      continuePtrace();
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"Activation frame at 0x%x (%s) in thread %i passed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc),tid);
+      continue;
     }
-    logprintf(ELL_INFO_V3,ELS_PATCHAPPLY,"Iterating waiting for breakpoint to be hit\n");
-    if(0!=waitpid(-1,NULL,WNOHANG))
+    logprintf(ELL_INFO_V1,ELS_SAFETY,"Activation frame at 0x%x (%s) in thread %i failed safety check\n",frame->pc,getFunctionNameAtPC(targetBin,frame->pc),tid);
+    if(!li->prev)
     {
-      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Reached breakpoint\n");
-      breakpointReached=true;
-      break;
+      printBacktrace(targetBin,tid);
+      death("All functions with activation frames on the stack of thread %i require patching. The application will never be in a patchable state!",tid);
+    }
+    //when this frame returns the thread will be back in the one above
+    //it. Even if that is unsafe too the thread is one step closer
+    addr_t returnAddr=((ActivationFrame*)li->prev->value)->pc;
+    if(isParkedIn(unsafe,samples,returnAddr))
+    {
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"Not stopping at 0x%x, thread %i was never seen to leave %s\n",returnAddr,tid,getFunctionNameAtPC(targetBin,returnAddr));
+    }
+    else
+    {
+      addSpot(spots,returnAddr);
     }
-    usleep(WAIT_FOR_SAFE_PATCHING_USLEEP);
+    threadUnsafe=true;
   }
-  if(breakpointReached)
+  return threadUnsafe;
+}
+
+//find the locations in the target, the return addresses of every
+//unsafe frame of every thread, at which the target may next have
+//become safe to patch. Returns how many threads are unsafe right now.
+//If none are it is safe to patch
+static int findSafeBreakpointsForPatch(ElfInfo* targetBin,UnsafeFunctions* unsafe,
+                                       SafetySamples* samples,SpotSet* spots)
+{
+  pid_t* tids;
+  int numThreads;
+  DList** activationFrames=findAllActivationFrames(targetBin,&tids,&numThreads);
+  int numUnsafeThreads=0;
+  for(int i=0;i<numThreads;i++)
   {
-    removeBreakpoint(safeBreakpointSpot);
+    if(addSafeBreakpointsForThread(targetBin,activationFrames[i],unsafe,samples,tids[i],spots))
+    {
+      numUnsafeThreads++;
+    }
+    deleteDList(activationFrames[i],free);
   }
-  else
+  free(activationFrames);
+  free(tids);
+  return numUnsafeThreads;
+}
+
+//Every thread has to be out of the functions being patched at the
+//same moment. While some aren't, breakpoints go on the return address
+//of every unsafe frame and we let the target run. Each time one is
+//hit everything is stopped and checked again, so the first moment
+//nothing unsafe is left is the one we patch at. Breakpoints also go
+//on the entry points of the unsafe functions: a thread about to
+//enter one is safe where it is, so it is held there while the others
+//catch up. If config.safetySampleMillis is set and the target isn't
+//safe right away, its stacks are sampled first to leave out return
+//addresses which are hit often without getting anywhere
+void bringTargetToSafeState(ElfInfo* targetBin,UnsafeFunctions* unsafe)
+{
+  SafetySamples samples;
+  memset(&samples,0,sizeof(SafetySamples));
+  bool sampled=!config.safetySampleMillis;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  long maxWaitMillis=config.maxWaitForPatching*1000L;
+  pid_t* heldTids=NULL;
+  int numHeld=0;
+  //cleared if holding threads looks like it's keeping the others
+  //from getting anywhere (they might be waiting on a held one)
+  bool holdAtEntries=true;
+  while(true)
   {
-    death("Program does not seem to be reaching safe state, aborting patching\n");
+    SpotSet spots;
+    memset(&spots,0,sizeof(SpotSet));
+    int numUnsafeThreads=findSafeBreakpointsForPatch(targetBin,unsafe,&samples,&spots);
+    if(!numUnsafeThreads)
+    {
+      free(spots.locs);
+      break;
+    }
+    if(!sampled)
+    {
+      free(spots.locs);
+      sampleTarget(targetBin,unsafe,&samples);
+      sampled=true;
+      continue;
+    }
+    long millisLeft=maxWaitMillis-millisSince(&start);
+    if(millisLeft<=0)
+    {
+      death("Program does not seem to be reaching safe state, aborting patching\n");
+    }
+    if(holdAtEntries)
+    {
+      for(int i=0;i<unsafe->num;i++)
+      {
+        addSpot(&spots,unsafe->ranges[i].start);
+      }
+    }
+    uniqueSpots(&spots);
+    logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"%i threads unsafe, setting %i breakpoints\n",numUnsafeThreads,spots.num);
+    for(int i=0;i<spots.num;i++)
+    {
+      logprintf(ELL_INFO_V3,ELS_PATCHAPPLY,"Setting breakpoint to apply patch at 0x%x\n",
+                spots.locs[i]);
+      setBreakpoint(spots.locs[i]);
+    }
+    continueAllThreads(heldTids,numHeld);
+    logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Continuing until we reach safe spot to patch. . .\n");
+    struct timespec roundStart;
+    clock_gettime(CLOCK_MONOTONIC,&roundStart);
+    long roundMillis=millisLeft<RECHECK_SAFETY_MILLIS?millisLeft:RECHECK_SAFETY_MILLIS;
+    bool reachedReturn=false;
+    pid_t tid;
+    while((tid=waitForTargetBreakpoint(roundMillis-millisSince(&roundStart))))
+    {
+      struct user_regs_struct regs;
+      getThreadRegs(tid,&regs);
+      if(holdAtEntries && isUnsafeFunctionEntry(unsafe,REG_IP(regs)-1))
+      {
+        logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Holding thread %i at entry to %s\n",tid,getFunctionNameAtPC(targetBin,REG_IP(regs)-1));
+        heldTids=realloc(heldTids,(numHeld+1)*sizeof(pid_t));
+        MALLOC_CHECK(heldTids);
+        heldTids[numHeld++]=tid;
+        continue;
+      }
+      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Thread %i reached breakpoint after %li ms\n",tid,millisSince(&start));
+      reachedReturn=true;
+      break;
+    }
+    stopAllThreads();
+    for(int i=0;i<spots.num;i++)
+    {
+      removeBreakpoint(spots.locs[i]);
+    }
+    free(spots.locs);
+    if(!reachedReturn)
+    {
+      logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"No breakpoint reached yet, checking the target's threads again\n");
+      if(numHeld)
+      {
+        logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"Releasing the %i threads held at function entries\n",numHeld);
+        numHeld=0;
+        holdAtEntries=false;
+      }
+    }
   }
+  free(heldTids);
+  freeSafetySamples(&samples);
+  logprintf(ELL_INFO_V2,ELS_PATCHAPPLY,"All target threads are in a safe state to patch\n");
 }
 
 
+bool isSafeForCodeOnlyPatch(ElfInfo* targetBin,UnsafeFunctions* unsafe)
+{
+  //the trampolines will be jmp rel32 if the patch code is in reach,
+  //otherwise the longer absolute jump (see insertTrampolineJump)
+  addr_t trampolineLen=isPoolWithinRel32Reach(EPP_CODE)?5:MAX_TRAMPOLINE_LEN;
+  //not just where each thread is now, but everywhere it will return
+  //to (including pcs interrupted by signals) must be outside the
+  //bytes a trampoline overwrites
+  pid_t* tids;
+  int numThreads;
+  DList** activationFrames=findAllActivationFrames(targetBin,&tids,&numThreads);
+  bool safe=true;
+  for(int i=0;i<numThreads;i++)
+  {
+    for(DList* li=activationFrames[i];li && safe;li=li->next)
+    {
+      addr_t pc=((ActivationFrame*)li->value)->pc;
+      UnsafeRange* range=findUnsafeRange(unsafe,pc);
+      if(range && range->start<pc && pc<range->start+trampolineLen)
+      {
+        logprintf(ELL_INFO_V2,ELS_SAFETY,"Thread %i has a frame at 0x%x, inside where a trampoline goes\n",tids[i],pc);
+        safe=false;
+      }
+    }
+    deleteDList(activationFrames[i],free);
+  }
+  free(activationFrames);
+  free(tids);
+  return safe;
+}
+
 void printBacktrace(ElfInfo* elf,int pid)
 {
-  startLibUnwind(pid);
   unw_word_t ip;
   GElf_Shdr shdr;
   //todo: should support multiple text sections for applying
@@ -549,7 +1143,25 @@ void printBacktrace(ElfInfo* elf,int pid)
   }
   addr_t lowpc=shdr.sh_addr;
   addr_t highpc=lowpc+shdr.sh_size;
-  
+
+  struct user_regs_struct regs;
+  getThreadRegs(pid,&regs);
+  addr_t* pcs;
+  int numPcs=unwindStackLocally(&regs,&pcs);
+  if(numPcs>=0)
+  {
+    for(int i=0;i<numPcs;i++)
+    {
+      if(lowpc<=pcs[i] && pcs[i]<=highpc)
+      {
+        printf("0x%lx: %s\n",(unsigned long)pcs[i],getFunctionNameAtPC(elf,pcs[i]));
+      }
+    }
+    free(pcs);
+    return;
+  }
+
+  startLibUnwind(pid);
   while (unw_step(&unwindCursor) > 0)
   {
     unw_get_reg(&unwindCursor, UNW_REG_IP, &ip);
@@ -56,10 +56,37 @@
 #ifndef safety_h
 #define safety_h
 
+//conversion between dwarf register numbers and x86 registers
+long int getRegValueFromDwarfRegNum(struct user_regs_struct regs,int num);
+
+//pid may be the tid of any of the target's threads
 void printBacktrace(ElfInfo* elf,int pid);
 
-//find a location in the target where nothing that's being patched is being used.
-addr_t findSafeBreakpointForPatch(ElfInfo* targetBin,ElfInfo* patch,int pid, bool avoidCurrentFrame);
+//the code of the functions the patch changes, as ranges of addresses
+//in the target sorted by start. Worked out before the target is
+//stopped so that checking a frame during the pause is a binary search
+typedef struct
+{
+  addr_t start;
+  addr_t end;//one past the last byte
+} UnsafeRange;
+typedef struct
+{
+  UnsafeRange* ranges;
+  int num;
+} UnsafeFunctions;
+
+void getUnsafeFunctions(ElfInfo* targetBin,ElfInfo* patch,UnsafeFunctions* unsafe);
+void freeUnsafeFunctions(UnsafeFunctions* unsafe);
+
+//returns once no thread of the target has an activation frame for
+//any function the patch changes, with all threads stopped
+void bringTargetToSafeState(ElfInfo* targetBin,UnsafeFunctions* unsafe);
 
-void bringTargetToSafeState(ElfInfo* targetBin,ElfInfo* patch,int pid);
+//for a patch which only replaces code: whether it can be applied
+//right now, with all threads stopped, without waiting for a safe
+//point. Threads still running the old code may go on doing so, it's
+//only the bytes the trampolines overwrite that no thread may be
+//part of the way through
+bool isSafeForCodeOnlyPatch(ElfInfo* targetBin,UnsafeFunctions* unsafe);
 #endif
@@ -0,0 +1,899 @@
+/*
+  File: stackunwind.c
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Unwinds the stacks of the stopped target locally, using the .eh_frame of the objects loaded in it
+*/
+
+#include "stackunwind.h"
+#include "target.h"
+#include "pmap.h"
+#include "elfparse.h"
+#include "safety.h"
+#include "eh_pe.h"
+#include "util/util.h"
+#include "util/logging.h"
+#include <elf.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+//dwarf register numbers. The return address column stands for the
+//instruction pointer
+#ifdef KATANA_X86_64_ARCH
+#define UNWIND_NUM_REGS 17
+#define UNWIND_SP_REG 7
+#define UNWIND_RA_REG 16
+#else
+#define UNWIND_NUM_REGS 9
+#define UNWIND_SP_REG 4
+#define UNWIND_RA_REG 8
+#endif
+
+#ifndef DW_EH_PE_omit
+#define DW_EH_PE_omit 0xff
+#endif
+
+//never copy more of a stack than this. Anything above it is read
+//from the target a word at a time, which is slow but still works
+#define MAX_STACK_SNAPSHOT (256*1024)
+#define MAX_UNWIND_FRAMES 512
+//how deeply DW_CFA_remember_state may nest
+#define MAX_REMEMBERED_ROWS 8
+
+//the call frame information of one object mapped into the target
+typedef struct
+{
+  char* name;
+  addr_t base;//where its ELF header is mapped
+  addr_t textLow;
+  addr_t textHigh;
+  //copy of the loaded segment holding .eh_frame_hdr and .eh_frame.
+  //NULL if the object has no usable call frame information
+  byte* image;
+  addr_t imageAddr;
+  size_t imageLen;
+  addr_t hdrAddr;//address of .eh_frame_hdr
+  //offset in image of the .eh_frame_hdr search table, pairs of
+  //(initial location, FDE address) relative to hdrAddr
+  size_t tableOff;
+  size_t numTableEntries;
+  bool inUse;//seen by the latest refreshUnwindInfo
+} UnwindObject;
+
+static UnwindObject* objects=NULL;
+static int numObjects=0;
+//the target's memory map as of the latest refresh, used to find out
+//how far up each stack goes
+static MappedRegion* regions=NULL;
+static int numRegions=0;
+
+//reads the CFI copied out of an object
+typedef struct
+{
+  UnwindObject* obj;
+  size_t off;//offset into obj->image
+  size_t end;
+  bool bad;//set when we run off the end
+} CFIReader;
+
+static uint64_t readFixed(CFIReader* r,int numBytes)
+{
+  uint64_t value=0;
+  if(r->off+numBytes>r->end)
+  {
+    r->bad=true;
+    return 0;
+  }
+  memcpy(&value,r->obj->image+r->off,numBytes);
+  r->off+=numBytes;
+  return value;
+}
+
+static word_t readULEB(CFIReader* r)
+{
+  word_t value=0;
+  int shift=0;
+  byte b;
+  do
+  {
+    b=readFixed(r,1);
+    if(shift<sizeof(word_t)*8)
+    {
+      value|=(word_t)(b&0x7f)<<shift;
+    }
+    shift+=7;
+  } while((b&0x80) && !r->bad);
+  return value;
+}
+
+static sword_t readSLEB(CFIReader* r)
+{
+  word_t value=0;
+  int shift=0;
+  byte b;
+  do
+  {
+    b=readFixed(r,1);
+    if(shift<sizeof(word_t)*8)
+    {
+      value|=(word_t)(b&0x7f)<<shift;
+    }
+    shift+=7;
+  } while((b&0x80) && !r->bad);
+  if(shift<sizeof(word_t)*8 && (b&0x40))
+  {
+    value|=~(word_t)0<<shift;
+  }
+  return (sword_t)value;
+}
+
+//reads a pointer with one of the DW_EH_PE_ encodings. Indirect
+//pointers are not followed, we only ever skip over those
+static addr_t readEncoded(CFIReader* r,byte encoding)
+{
+  if(DW_EH_PE_omit==encoding)
+  {
+    return 0;
+  }
+  addr_t location=r->obj->imageAddr+r->off;
+  addr_t value;
+  switch(encoding&0x0f)
+  {
+  case DW_EH_PE_absptr:
+    value=readFixed(r,sizeof(addr_t));
+    break;
+  case DW_EH_PE_uleb128:
+    value=readULEB(r);
+    break;
+  case DW_EH_PE_udata2:
+    value=(uint16_t)readFixed(r,2);
+    break;
+  case DW_EH_PE_udata4:
+    value=(uint32_t)readFixed(r,4);
+    break;
+  case DW_EH_PE_udata8:
+    value=readFixed(r,8);
+    break;
+  case DW_EH_PE_sleb128:
+    value=readSLEB(r);
+    break;
+  case DW_EH_PE_sdata2:
+    value=(int16_t)readFixed(r,2);
+    break;
+  case DW_EH_PE_sdata4:
+    value=(int32_t)readFixed(r,4);
+    break;
+  case DW_EH_PE_sdata8:
+    value=(int64_t)readFixed(r,8);
+    break;
+  default:
+    r->bad=true;
+    return 0;
+  }
+  switch(encoding&0x70)
+  {
+  case DW_EH_PE_absptr:
+    return value;
+  case DW_EH_PE_pcrel:
+    return value+location;
+  case DW_EH_PE_datarel:
+    return value+r->obj->hdrAddr;
+  default:
+    r->bad=true;
+    return 0;
+  }
+}
+
+//finds the object's .eh_frame_hdr through its program headers and
+//copies the segment it's in. Returns false if that can't be done
+static bool loadUnwindObject(UnwindObject* obj)
+{
+  ElfXX_Ehdr ehdr;
+  if(!memcpyFromTargetConcurrent((byte*)&ehdr,obj->base,sizeof(ehdr)) ||
+     memcmp(ehdr.e_ident,ELFMAG,SELFMAG) || ehdr.e_phentsize!=sizeof(ElfXX_Phdr))
+  {
+    return false;
+  }
+  ElfXX_Phdr* phdrs=zmalloc(ehdr.e_phnum*sizeof(ElfXX_Phdr));
+  if(!memcpyFromTargetConcurrent((byte*)phdrs,obj->base+ehdr.e_phoff,ehdr.e_phnum*sizeof(ElfXX_Phdr)))
+  {
+    free(phdrs);
+    return false;
+  }
+  //the difference between where the object was linked to be and
+  //where it actually is
+  addr_t bias=0;
+  bool haveBias=false;
+  ElfXX_Phdr* ehFrameHdr=NULL;
+  addr_t pageMask=~((addr_t)sysconf(_SC_PAGE_SIZE)-1);
+  for(int i=0;i<ehdr.e_phnum;i++)
+  {
+    if(PT_LOAD==phdrs[i].p_type && !haveBias)
+    {
+      bias=obj->base-(phdrs[i].p_vaddr&pageMask);
+      haveBias=true;
+    }
+    else if(PT_GNU_EH_FRAME==phdrs[i].p_type)
+    {
+      ehFrameHdr=&phdrs[i];
+    }
+  }
+  obj->textLow=~(addr_t)0;
+  for(int i=0;i<ehdr.e_phnum;i++)
+  {
+    if(PT_LOAD!=phdrs[i].p_type)
+    {
+      continue;
+    }
+    if(phdrs[i].p_flags & PF_X)
+    {
+      addr_t low=bias+phdrs[i].p_vaddr;
+      obj->textLow=low<obj->textLow?low:obj->textLow;
+      obj->textHigh=low+phdrs[i].p_memsz>obj->textHigh?low+phdrs[i].p_memsz:obj->textHigh;
+    }
+    if(ehFrameHdr && phdrs[i].p_vaddr<=ehFrameHdr->p_vaddr &&
+       ehFrameHdr->p_vaddr<phdrs[i].p_vaddr+phdrs[i].p_filesz)
+    {
+      obj->imageAddr=bias+phdrs[i].p_vaddr;
+      obj->imageLen=phdrs[i].p_filesz;
+    }
+  }
+  if(!ehFrameHdr || !obj->imageLen)
+  {
+    free(phdrs);
+    return false;
+  }
+  obj->hdrAddr=bias+ehFrameHdr->p_vaddr;
+  free(phdrs);
+
+  obj->image=zmalloc(obj->imageLen);
+  if(!memcpyFromTargetConcurrent(obj->image,obj->imageAddr,obj->imageLen))
+  {
+    free(obj->image);
+    obj->image=NULL;
+    return false;
+  }
+  CFIReader r={.obj=obj,.off=obj->hdrAddr-obj->imageAddr,.end=obj->imageLen,.bad=false};
+  byte version=readFixed(&r,1);
+  byte ehFramePtrEncoding=readFixed(&r,1);
+  byte fdeCountEncoding=readFixed(&r,1);
+  byte tableEncoding=readFixed(&r,1);
+  readEncoded(&r,ehFramePtrEncoding);
+  obj->numTableEntries=readEncoded(&r,fdeCountEncoding);
+  obj->tableOff=r.off;
+  //the only table encoding anyone uses, and the only one that can be
+  //binary searched without decoding every entry
+  if(r.bad || 1!=version || (DW_EH_PE_datarel|DW_EH_PE_sdata4)!=tableEncoding ||
+     obj->tableOff+obj->numTableEntries*8>obj->imageLen)
+  {
+    free(obj->image);
+    obj->image=NULL;
+    return false;
+  }
+  return true;
+}
+
+void refreshUnwindInfo(int pid)
+{
+  free(regions);
+  regions=NULL;
+  numRegions=getMemoryMap(pid,&regions);
+  if(numRegions<0)
+  {
+    numRegions=0;
+  }
+  for(int i=0;i<numObjects;i++)
+  {
+    objects[i].inUse=false;
+  }
+  int numLoaded=0;
+  for(int i=0;i<numRegions;i++)
+  {
+    char* name=regions[i].name;
+    //the first mapping of a file is where its ELF header is
+    if('/'!=name[0] || (i>0 && !strcmp(regions[i-1].name,name)))
+    {
+      continue;
+    }
+    bool known=false;
+    for(int j=0;j<numObjects && !known;j++)
+    {
+      if(objects[j].base==regions[i].low && !strcmp(objects[j].name,name))
+      {
+        objects[j].inUse=known=true;
+      }
+    }
+    if(known)
+    {
+      continue;
+    }
+    objects=realloc(objects,(numObjects+1)*sizeof(UnwindObject));
+    MALLOC_CHECK(objects);
+    UnwindObject* obj=&objects[numObjects++];
+    memset(obj,0,sizeof(UnwindObject));
+    obj->name=strdup(name);
+    obj->base=regions[i].low;
+    obj->inUse=true;
+    //objects without call frame information are remembered too, so
+    //we don't try them again every time
+    if(loadUnwindObject(obj))
+    {
+      numLoaded++;
+    }
+    else
+    {
+      logprintf(ELL_INFO_V2,ELS_SAFETY,"No usable call frame information for %s\n",name);
+    }
+  }
+  //forget whatever has been unloaded
+  int numKept=0;
+  for(int i=0;i<numObjects;i++)
+  {
+    if(objects[i].inUse)
+    {
+      objects[numKept++]=objects[i];
+      continue;
+    }
+    free(objects[i].name);
+    free(objects[i].image);
+  }
+  numObjects=numKept;
+  logprintf(ELL_INFO_V2,ELS_SAFETY,"Call frame information for %i objects in the target, %i newly loaded\n",numObjects,numLoaded);
+}
+
+static UnwindObject* findUnwindObject(addr_t pc)
+{
+  for(int i=0;i<numObjects;i++)
+  {
+    if(objects[i].image && objects[i].textLow<=pc && pc<objects[i].textHigh)
+    {
+      return &objects[i];
+    }
+  }
+  return NULL;
+}
+
+//binary search of .eh_frame_hdr for the FDE that may cover pc.
+//Returns its offset in the object's image or -1
+static ssize_t findFDEOffset(UnwindObject* obj,addr_t pc)
+{
+  size_t low=0;
+  size_t high=obj->numTableEntries;
+  while(high-low>1)
+  {
+    size_t middle=low+(high-low)/2;
+    int32_t initialLoc;
+    memcpy(&initialLoc,obj->image+obj->tableOff+middle*8,4);
+    if(obj->hdrAddr+(sword_t)initialLoc<=pc)
+    {
+      low=middle;
+    }
+    else
+    {
+      high=middle;
+    }
+  }
+  if(!obj->numTableEntries)
+  {
+    return -1;
+  }
+  int32_t fdeOffset;
+  memcpy(&fdeOffset,obj->image+obj->tableOff+low*8+4,4);
+  addr_t fdeAddr=obj->hdrAddr+(sword_t)fdeOffset;
+  if(fdeAddr<obj->imageAddr || fdeAddr>=obj->imageAddr+obj->imageLen)
+  {
+    return -1;
+  }
+  return fdeAddr-obj->imageAddr;
+}
+
+//reads the length that starts every CIE and FDE, leaving r at the
+//start of its contents and limited to them
+static bool readEntryLength(CFIReader* r)
+{
+  uint64_t len=readFixed(r,4);
+  if(0xffffffff==len)
+  {
+    len=readFixed(r,8);
+  }
+  if(r->bad || !len || r->off+len>r->end)
+  {
+    return false;
+  }
+  r->end=r->off+len;
+  return true;
+}
+
+typedef struct
+{
+  word_t codeAlign;
+  sword_t dataAlign;
+  word_t raReg;
+  byte fdeEncoding;
+  bool hasAugmentationData;
+  bool signalFrame;//the S augmentation: pcs in these frames are not return addresses
+  size_t instrsOff;
+  size_t instrsEnd;
+} UnwindCIE;
+
+static bool parseCIE(UnwindObject* obj,size_t off,UnwindCIE* cie)
+{
+  CFIReader r={.obj=obj,.off=off,.end=obj->imageLen,.bad=false};
+  if(!readEntryLength(&r) || 0!=readFixed(&r,4))
+  {
+    return false;
+  }
+  memset(cie,0,sizeof(UnwindCIE));
+  byte version=readFixed(&r,1);
+  char* augmentation=(char*)obj->image+r.off;
+  size_t augmentationLen=strnlen(augmentation,r.end-r.off);
+  if(r.off+augmentationLen>=r.end)
+  {
+    return false;
+  }
+  r.off+=augmentationLen+1;
+  if(strstr(augmentation,"eh"))
+  {
+    readFixed(&r,sizeof(addr_t));
+  }
+  cie->codeAlign=readULEB(&r);
+  cie->dataAlign=readSLEB(&r);
+  cie->raReg=1==version?readFixed(&r,1):readULEB(&r);
+  cie->fdeEncoding=DW_EH_PE_absptr;
+  if('z'==augmentation[0])
+  {
+    cie->hasAugmentationData=true;
+    word_t augmentationDataLen=readULEB(&r);
+    size_t augmentationDataEnd=r.off+augmentationDataLen;
+    for(char* c=augmentation+1;*c && !r.bad;c++)
+    {
+      if('R'==*c)
+      {
+        cie->fdeEncoding=readFixed(&r,1);
+      }
+      else if('P'==*c)
+      {
+        readEncoded(&r,readFixed(&r,1)&~DW_EH_PE_indirect);
+      }
+      else if('L'==*c)
+      {
+        readFixed(&r,1);
+      }
+      else if('S'==*c)
+      {
+        cie->signalFrame=true;
+      }
+      else
+      {
+        break;//the length lets us skip anything we don't know
+      }
+    }
+    r.off=augmentationDataEnd;
+  }
+  cie->instrsOff=r.off;
+  cie->instrsEnd=r.end;
+  return !r.bad && r.off<=r.end;
+}
+
+typedef enum
+{
+  EUR_SAME=0,//also what registers without a rule get
+  EUR_UNDEFINED,
+  EUR_OFFSET,//saved at CFA+value
+  EUR_VAL_OFFSET,//is CFA+value
+  EUR_REGISTER,//saved in register value
+  EUR_UNSUPPORTED//given by a DWARF expression
+} E_UNWIND_RULE;
+
+typedef struct
+{
+  E_UNWIND_RULE type;
+  sword_t value;
+} UnwindRule;
+
+//the rules for finding the caller's registers at one pc
+typedef struct
+{
+  word_t cfaReg;
+  sword_t cfaOffset;
+  bool cfaUnsupported;//given by a DWARF expression
+  UnwindRule rules[UNWIND_NUM_REGS];
+} UnwindRow;
+
+static void setRule(UnwindRow* row,word_t reg,E_UNWIND_RULE type,sword_t value)
+{
+  //rules for registers we don't track (vector registers and such)
+  //can safely be ignored
+  if(reg<UNWIND_NUM_REGS)
+  {
+    row->rules[reg].type=type;
+    row->rules[reg].value=value;
+  }
+}
+
+static void restoreRule(UnwindRow* row,UnwindRow* initialRow,word_t reg)
+{
+  if(reg<UNWIND_NUM_REGS)
+  {
+    row->rules[reg]=initialRow->rules[reg];
+  }
+}
+
+//executes call frame instructions from r until the location passes
+//pc. initialRow is the row the CIE's instructions produced (for
+//DW_CFA_restore). Returns false on anything we can't deal with
+static bool runCFIProgram(CFIReader* r,UnwindCIE* cie,UnwindRow* row,UnwindRow* initialRow,
+                          addr_t loc,addr_t pc)
+{
+  UnwindRow remembered[MAX_REMEMBERED_ROWS];
+  int numRemembered=0;
+  while(r->off<r->end && !r->bad)
+  {
+    byte op=readFixed(r,1);
+    byte operand=op&0x3f;
+    word_t reg;
+    word_t len;
+    switch(op&0xc0)
+    {
+    case DW_CFA_advance_loc:
+      loc+=operand*cie->codeAlign;
+      if(loc>pc)
+      {
+        return true;
+      }
+      continue;
+    case DW_CFA_offset:
+      setRule(row,operand,EUR_OFFSET,(sword_t)readULEB(r)*cie->dataAlign);
+      continue;
+    case DW_CFA_restore:
+      restoreRule(row,initialRow,operand);
+      continue;
+    }
+    switch(op)
+    {
+    case DW_CFA_nop:
+    case DW_CFA_GNU_args_size:
+      if(DW_CFA_GNU_args_size==op)
+      {
+        readULEB(r);
+      }
+      break;
+    case DW_CFA_set_loc:
+    case DW_CFA_advance_loc1:
+    case DW_CFA_advance_loc2:
+    case DW_CFA_advance_loc4:
+      if(DW_CFA_set_loc==op)
+      {
+        loc=readEncoded(r,cie->fdeEncoding);
+      }
+      else
+      {
+        loc+=readFixed(r,DW_CFA_advance_loc4==op?4:op-DW_CFA_advance_loc1+1)*cie->codeAlign;
+      }
+      if(loc>pc)
+      {
+        return true;
+      }
+      break;
+    case DW_CFA_offset_extended:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_OFFSET,(sword_t)readULEB(r)*cie->dataAlign);
+      break;
+    case DW_CFA_offset_extended_sf:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_OFFSET,readSLEB(r)*cie->dataAlign);
+      break;
+    case DW_CFA_GNU_negative_offset_extended:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_OFFSET,-(sword_t)readULEB(r)*cie->dataAlign);
+      break;
+    case DW_CFA_val_offset:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_VAL_OFFSET,(sword_t)readULEB(r)*cie->dataAlign);
+      break;
+    case DW_CFA_val_offset_sf:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_VAL_OFFSET,readSLEB(r)*cie->dataAlign);
+      break;
+    case DW_CFA_restore_extended:
+      restoreRule(row,initialRow,readULEB(r));
+      break;
+    case DW_CFA_undefined:
+      setRule(row,readULEB(r),EUR_UNDEFINED,0);
+      break;
+    case DW_CFA_same_value:
+      setRule(row,readULEB(r),EUR_SAME,0);
+      break;
+    case DW_CFA_register:
+      reg=readULEB(r);
+      setRule(row,reg,EUR_REGISTER,readULEB(r));
+      break;
+    case DW_CFA_remember_state:
+      if(MAX_REMEMBERED_ROWS==numRemembered)
+      {
+        return false;
+      }
+      remembered[numRemembered++]=*row;
+      break;
+    case DW_CFA_restore_state:
+      if(!numRemembered)
+      {
+        return false;
+      }
+      *row=remembered[--numRemembered];
+      break;
+    case DW_CFA_def_cfa:
+      row->cfaReg=readULEB(r);
+      row->cfaOffset=readULEB(r);
+      row->cfaUnsupported=false;
+      break;
+    case DW_CFA_def_cfa_sf:
+      row->cfaReg=readULEB(r);
+      row->cfaOffset=readSLEB(r)*cie->dataAlign;
+      row->cfaUnsupported=false;
+      break;
+    case DW_CFA_def_cfa_register:
+      row->cfaReg=readULEB(r);
+      row->cfaUnsupported=false;
+      break;
+    case DW_CFA_def_cfa_offset:
+      row->cfaOffset=readULEB(r);
+      break;
+    case DW_CFA_def_cfa_offset_sf:
+      row->cfaOffset=readSLEB(r)*cie->dataAlign;
+      break;
+    case DW_CFA_def_cfa_expression:
+      len=readULEB(r);
+      r->off+=len;
+      row->cfaUnsupported=true;
+      break;
+    case DW_CFA_expression:
+    case DW_CFA_val_expression:
+      reg=readULEB(r);
+      len=readULEB(r);
+      r->off+=len;
+      setRule(row,reg,EUR_UNSUPPORTED,0);
+      break;
+    default:
+      return false;
+    }
+  }
+  return !r->bad;
+}
+
+//works out the rules for unwinding from pc. signalFrame is set if the
+//caller's pc will not be a return address
+static bool findUnwindRow(addr_t pc,UnwindRow* row,bool* signalFrame)
+{
+  UnwindObject* obj=findUnwindObject(pc);
+  if(!obj)
+  {
+    return false;
+  }
+  ssize_t fdeOff=findFDEOffset(obj,pc);
+  if(fdeOff<0)
+  {
+    return false;
+  }
+  CFIReader r={.obj=obj,.off=fdeOff,.end=obj->imageLen,.bad=false};
+  if(!readEntryLength(&r))
+  {
+    return false;
+  }
+  size_t ciePointerOff=r.off;
+  uint32_t ciePointer=readFixed(&r,4);
+  if(!ciePointer || ciePointer>ciePointerOff)
+  {
+    return false;
+  }
+  UnwindCIE cie;
+  if(!parseCIE(obj,ciePointerOff-ciePointer,&cie))
+  {
+    return false;
+  }
+  addr_t pcBegin=readEncoded(&r,cie.fdeEncoding);
+  addr_t pcRange=readEncoded(&r,cie.fdeEncoding&0x0f);
+  if(r.bad || pc<pcBegin || pc>=pcBegin+pcRange)
+  {
+    return false;
+  }
+  if(cie.hasAugmentationData)
+  {
+    r.off+=readULEB(&r);
+  }
+
+  memset(row,0,sizeof(UnwindRow));
+  CFIReader cieR={.obj=obj,.off=cie.instrsOff,.end=cie.instrsEnd,.bad=false};
+  if(!runCFIProgram(&cieR,&cie,row,row,0,~(addr_t)0))
+  {
+    return false;
+  }
+  UnwindRow initialRow=*row;
+  *signalFrame=cie.signalFrame;
+  return runCFIProgram(&r,&cie,row,&initialRow,pcBegin,pc) &&
+    !row->cfaUnsupported && row->cfaReg<UNWIND_NUM_REGS &&
+    cie.raReg==UNWIND_RA_REG;
+}
+
+//a copy of the top of a thread's stack
+typedef struct
+{
+  byte* data;
+  addr_t low;
+  size_t len;
+} StackSnapshot;
+
+static void takeStackSnapshot(StackSnapshot* stack,addr_t sp)
+{
+  stack->low=sp;
+  stack->len=0;
+  stack->data=NULL;
+  for(int i=0;i<numRegions;i++)
+  {
+    if(regions[i].low<=sp && sp<regions[i].high)
+    {
+      stack->len=regions[i].high-sp;
+      break;
+    }
+  }
+  if(stack->len>MAX_STACK_SNAPSHOT)
+  {
+    stack->len=MAX_STACK_SNAPSHOT;
+  }
+  if(!stack->len)
+  {
+    return;
+  }
+  stack->data=zmalloc(stack->len);
+  if(!memcpyFromTargetConcurrent(stack->data,stack->low,stack->len))
+  {
+    free(stack->data);
+    stack->data=NULL;
+    stack->len=0;
+  }
+}
+
+static bool readStackWord(StackSnapshot* stack,addr_t addr,word_t* value)
+{
+  if(addr>=stack->low && addr+sizeof(word_t)<=stack->low+stack->len)
+  {
+    memcpy(value,stack->data+(addr-stack->low),sizeof(word_t));
+    return true;
+  }
+  return memcpyFromTargetConcurrent((byte*)value,addr,sizeof(word_t));
+}
+
+int unwindStackLocally(struct user_regs_struct* regs,addr_t** pcs)
+{
+  word_t values[UNWIND_NUM_REGS];
+  bool known[UNWIND_NUM_REGS];
+  for(int i=0;i<UNWIND_NUM_REGS;i++)
+  {
+    values[i]=UNWIND_RA_REG==i?REG_IP(*regs):getRegValueFromDwarfRegNum(*regs,i);
+    known[i]=true;
+  }
+  StackSnapshot stack;
+  takeStackSnapshot(&stack,values[UNWIND_SP_REG]);
+  *pcs=zmalloc(MAX_UNWIND_FRAMES*sizeof(addr_t));
+  int numPcs=0;
+  //the innermost pc is where the thread is, not a return address
+  bool exactPC=true;
+  while(values[UNWIND_RA_REG])
+  {
+    addr_t pc=values[UNWIND_RA_REG];
+    if(MAX_UNWIND_FRAMES==numPcs)
+    {
+      goto failed;
+    }
+    (*pcs)[numPcs++]=pc;
+    //a return address may be just past the end of the calling
+    //function if the call was the last thing in it
+    UnwindRow row;
+    bool signalFrame;
+    if(!findUnwindRow(exactPC?pc:pc-1,&row,&signalFrame) || !known[row.cfaReg])
+    {
+      goto failed;
+    }
+    if(EUR_UNDEFINED==row.rules[UNWIND_RA_REG].type)
+    {
+      break;//the outermost frame (_start or a thread's start routine)
+    }
+    addr_t cfa=values[row.cfaReg]+row.cfaOffset;
+    word_t newValues[UNWIND_NUM_REGS];
+    bool newKnown[UNWIND_NUM_REGS];
+    for(int i=0;i<UNWIND_NUM_REGS;i++)
+    {
+      UnwindRule* rule=&row.rules[i];
+      newValues[i]=values[i];
+      newKnown[i]=known[i];
+      switch(rule->type)
+      {
+      case EUR_SAME:
+        break;
+      case EUR_OFFSET:
+        newKnown[i]=readStackWord(&stack,cfa+rule->value,&newValues[i]);
+        break;
+      case EUR_VAL_OFFSET:
+        newValues[i]=cfa+rule->value;
+        break;
+      case EUR_REGISTER:
+        newKnown[i]=rule->value<UNWIND_NUM_REGS && known[rule->value];
+        if(newKnown[i])
+        {
+          newValues[i]=values[rule->value];
+        }
+        break;
+      default:
+        newKnown[i]=false;
+      }
+    }
+    //the CFA is by definition the caller's stack pointer, and
+    //stacks grow down, so anything else means we've gone wrong
+    if(!newKnown[UNWIND_RA_REG] || cfa<=values[UNWIND_SP_REG])
+    {
+      goto failed;
+    }
+    newValues[UNWIND_SP_REG]=cfa;
+    newKnown[UNWIND_SP_REG]=true;
+    memcpy(values,newValues,sizeof(values));
+    memcpy(known,newKnown,sizeof(known));
+    exactPC=signalFrame;
+  }
+  free(stack.data);
+  return numPcs;
+
+ failed:
+  free(stack.data);
+  free(*pcs);
+  *pcs=NULL;
+  return -1;
+}
@@ -0,0 +1,82 @@
+/*
+  File: stackunwind.h
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Unwinds the stacks of the stopped target locally, using the .eh_frame of the objects loaded in it
+*/
+
+#ifndef stackunwind_h
+#define stackunwind_h
+#include "types.h"
+#include "arch.h"
+#include <sys/user.h>
+
+//Unwinding without libunwind-ptrace. The call frame information of
+//the executable and every library loaded in the target is read once
+//(straight out of the target's memory, .eh_frame_hdr and .eh_frame
+//are mapped) and kept. A thread's stack is then copied in one read
+//and unwound entirely in katana.
+
+//brings the cached call frame information up to date with what is
+//mapped into process pid, loading anything new. Must be called, from
+//the katana thread that attached, before unwindStackLocally and
+//whenever the target may have loaded or unloaded something since
+void refreshUnwindInfo(int pid);
+
+//unwinds the stack of a thread whose registers are regs, storing the
+//pc of each frame, newest first, in an array *pcs which the caller
+//must free. Returns how many there are, or -1 if the stack could not
+//be unwound all the way (a frame with no call frame information, or
+//information we don't understand). May be called from any thread,
+//and from several at once
+int unwindStackLocally(struct user_regs_struct* regs,addr_t** pcs);
+
+#endif
@@ -63,181 +63,1659 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/user.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include "katana_config.h"
 #include "util/logging.h"
 #include "util/map.h"
+#include "remotecall.h"
 
 
 int pid;
+//file descriptor for /proc/<pid>/mem, open while we're attached.
+//-1 if it could not be opened
+static int memFd=-1;
 addr_t mallocAddress=0;
+addr_t freeAddress=0;
 addr_t targetTextStart=0;
 
 typedef struct
 {
-  byte origCode[4];
+  byte origCode;//the byte the int3 replaced
 } BreakpointRestoreInfo;
 //maps addresses to BreakpointRestoreInfo
 Map* breakpointRestoreInfo=NULL;
 
+//Cache of whole pages of target memory, keyed by page address.
+//Reads are served from here so that walking a structure in the
+//target (the link map, hash tables, strings) costs one transfer per
+//page rather than several PEEKs per field. Only valid while the
+//target is stopped: emptied whenever we let it run and updated
+//(by dropping pages) whenever we write to it
+static Map* pageCache=NULL;
+static size_t pageSize=0;
+static uint pageCacheHits=0;
+static uint pageCacheMisses=0;
+//reads bigger than this many pages bypass the cache, they're
+//usually one-off bulk copies and would just evict useful pages
+#define PAGE_CACHE_MAX_READ_PAGES 16
+#define PAGE_CACHE_BUCKETS 1024
+
+static void invalidatePageCache()
+{
+  if(!pageCache)
+  {
+    return;
+  }
+  logprintf(ELL_INFO_V3,ELS_HOTPATCH,"dropping %i cached target pages (%u hits, %u misses)\n",mapSize(pageCache),pageCacheHits,pageCacheMisses);
+  mapDelete(pageCache,free,free);
+  pageCache=NULL;
+}
+
+//drop any cached pages overlapping [addr,addr+len)
+static void invalidateCachedRange(addr_t addr,size_t len)
+{
+  if(!pageCache || !len)
+  {
+    return;
+  }
+  addr_t lastPage=(addr+len-1) & ~(pageSize-1);
+  for(addr_t page=addr & ~(pageSize-1);page<=lastPage;page+=pageSize)
+  {
+    mapRemove(pageCache,&page,free,free);
+  }
+}
+
 void setMallocAddress(addr_t addr)
 {
-  mallocAddress=addr;
+  mallocAddress=addr;
+}
+
+void setFreeAddress(addr_t addr)
+{
+  freeAddress=addr;
+}
+
+void setTargetTextStart(addr_t addr)
+{
+  targetTextStart=addr;
+}
+
+//A thread (task) of the target. Every one of them is traced so that
+//the whole process can be held still while we look at it and patch it
+typedef struct
+{
+  pid_t tid;
+  bool running;
+  //signals the thread stopped with that were meant for the program
+  //rather than for us, in the order they arrived. They are delivered
+  //when the thread is continued (see releasePendingSignals)
+  int* pendingSignals;
+  int numPendingSignals;
+  //if the thread was stopped by a fault in the watched range (see
+  //watchTargetFaults), the address it faulted on. 0 otherwise
+  addr_t faultAddr;
+  //true until the thread has reported the SIGSTOP every thread starts
+  //being traced with (from PTRACE_ATTACH, or from the kernel for one
+  //created by a thread we trace). Any later SIGSTOP is the program's
+  bool initialStopPending;
+} TargetThread;
+static TargetThread* threads=NULL;
+static int numThreads=0;
+static int allocatedThreads=0;
+
+static int findThread(pid_t tid)
+{
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].tid==tid)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int addThread(pid_t tid)
+{
+  if(numThreads==allocatedThreads)
+  {
+    allocatedThreads=allocatedThreads?allocatedThreads*2:16;
+    threads=realloc(threads,allocatedThreads*sizeof(TargetThread));
+    MALLOC_CHECK(threads);
+  }
+  threads[numThreads].tid=tid;
+  threads[numThreads].running=true;
+  threads[numThreads].pendingSignals=NULL;
+  threads[numThreads].numPendingSignals=0;
+  threads[numThreads].faultAddr=0;
+  threads[numThreads].initialStopPending=true;
+  return numThreads++;
+}
+
+static void queuePendingSignal(int idx,int sig)
+{
+  TargetThread* thread=&threads[idx];
+  thread->pendingSignals=realloc(thread->pendingSignals,(thread->numPendingSignals+1)*sizeof(int));
+  MALLOC_CHECK(thread->pendingSignals);
+  thread->pendingSignals[thread->numPendingSignals++]=sig;
+}
+
+//empties the thread's pending signals. ptrace can only hand the
+//thread one signal as it is continued, which is returned (0 if there
+//are none). The rest are sent to it again with tgkill, they are
+//queued by the kernel and delivered as soon as it runs
+static int releasePendingSignals(int idx)
+{
+  TargetThread* thread=&threads[idx];
+  int sig=thread->numPendingSignals?thread->pendingSignals[0]:0;
+  for(int i=1;i<thread->numPendingSignals;i++)
+  {
+    syscall(SYS_tgkill,pid,thread->tid,thread->pendingSignals[i]);
+  }
+  free(thread->pendingSignals);
+  thread->pendingSignals=NULL;
+  thread->numPendingSignals=0;
+  return sig;
+}
+
+static void removeThread(int idx)
+{
+  if(threads[idx].tid==pid)
+  {
+    death("The target process exited while katana was working on it\n");
+  }
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"target thread %i exited\n",threads[idx].tid);
+  free(threads[idx].pendingSignals);
+  memmove(threads+idx,threads+idx+1,(numThreads-idx-1)*sizeof(TargetThread));
+  numThreads--;
+}
+
+//faults on addresses in any of these ranges are ours
+static TargetRange* faultWatchRanges=NULL;
+static int numFaultWatchRanges=0;
+
+//if the thread stopped with sig because of a fault in a watched
+//range, the address it faulted on. 0 otherwise
+static addr_t watchedFaultAddress(pid_t tid,int sig)
+{
+  if(SIGSEGV!=sig || !numFaultWatchRanges)
+  {
+    return 0;
+  }
+  siginfo_t info;
+  if(ptrace(PTRACE_GETSIGINFO,tid,NULL,&info)<0)
+  {
+    return 0;
+  }
+  addr_t addr=(addr_t)info.si_addr;
+  for(int i=0;i<numFaultWatchRanges;i++)
+  {
+    if(faultWatchRanges[i].low<=addr && addr<faultWatchRanges[i].high)
+    {
+      return addr;
+    }
+  }
+  return 0;
+}
+
+//whether the thread has just executed one of our int3s
+static bool threadAtBreakpoint(pid_t tid)
+{
+  if(!breakpointRestoreInfo)
+  {
+    return false;
+  }
+  struct user_regs_struct regs;
+  getThreadRegs(tid,&regs);
+  addr_t loc=REG_IP(regs)-1;
+  return mapExists(breakpointRestoreInfo,&loc);
+}
+
+//deals with the stops that tell us about threads rather than about
+//the thread itself. Returns true if status was one of those, in which
+//case the thread has been dealt with and is running again
+static bool handleThreadEvent(pid_t tid,int status)
+{
+  if(WIFEXITED(status) || WIFSIGNALED(status))
+  {
+    int idx=findThread(tid);
+    if(idx>=0)
+    {
+      removeThread(idx);
+    }
+    return true;
+  }
+  if(WIFSTOPPED(status) && (status>>8)==(SIGTRAP|(PTRACE_EVENT_CLONE<<8)))
+  {
+    //a traced thread made a new one, which the kernel has attached
+    //us to. It will report its own initial stop
+    unsigned long newTid;
+    if(ptrace(PTRACE_GETEVENTMSG,tid,NULL,&newTid)>=0 && findThread(newTid)<0)
+    {
+      logprintf(ELL_INFO_V2,ELS_HOTPATCH,"target thread %i created thread %lu\n",tid,newTid);
+      addThread(newTid);
+    }
+    ptrace(PTRACE_CONT,tid,NULL,NULL);
+    return true;
+  }
+  return false;
+}
+
+//waits for the thread at idx to report the SIGSTOP it has been sent
+//(by PTRACE_ATTACH, tgkill or the kernel when a traced thread is
+//created). Other signals that turn up first are kept for the
+//program. Returns false if the thread exited instead
+static bool waitForThreadStop(int idx)
+{
+  pid_t tid=threads[idx].tid;
+  while(true)
+  {
+    int status;
+    if(waitpid(tid,&status,__WALL)<0)
+    {
+      if(ECHILD==errno)
+      {
+        removeThread(idx);
+        return false;
+      }
+      perror("waitpid failed while stopping target thread");
+      death(NULL);
+    }
+    if(handleThreadEvent(tid,status))
+    {
+      if(idx>=numThreads || threads[idx].tid!=tid)
+      {
+        return false;//it exited
+      }
+      continue;
+    }
+    int sig=WSTOPSIG(status);
+    if(SIGSTOP==sig)
+    {
+      threads[idx].running=false;
+      threads[idx].initialStopPending=false;
+      return true;
+    }
+    //anything else stopped it before our SIGSTOP could, which is
+    //still queued and will stop it before it runs any code. A trap
+    //from one of our breakpoints is not the program's business,
+    //removeBreakpoint takes care of the thread. Nor is a fault we're
+    //watching for: continued without the signal, the thread will
+    //just make the same access again
+    if((SIGTRAP!=sig || !threadAtBreakpoint(tid)) && !watchedFaultAddress(tid,sig))
+    {
+      queuePendingSignal(idx,sig);
+    }
+    ptrace(PTRACE_CONT,tid,NULL,NULL);
+  }
+}
+
+//attach to a thread we aren't yet tracing and wait for it to stop
+static void attachThread(pid_t tid)
+{
+  if(ptrace(PTRACE_ATTACH,tid,NULL,NULL)<0)
+  {
+    if(ESRCH==errno)
+    {
+      return;//gone already
+    }
+    //EPERM means we are already tracing it: it was created by one
+    //of the threads we trace and we haven't heard about it yet
+    if(EPERM!=errno || tid==pid)
+    {
+      fprintf(stderr,"ptrace failed to attach to thread %i with errno %d\n",tid,errno);
+      death(NULL);
+    }
+  }
+  int idx=addThread(tid);
+  if(waitForThreadStop(idx))
+  {
+    //have the kernel attach us to any threads it creates from now on
+    ptrace(PTRACE_SETOPTIONS,tid,NULL,(void*)PTRACE_O_TRACECLONE);
+  }
+}
+
+//attach to every thread in /proc/<pid>/task we aren't yet tracing.
+//Threads can be created while we do that, so we keep going until a
+//pass turns up nothing new
+static void attachNewThreads()
+{
+  char taskDirName[64];
+  snprintf(taskDirName,64,"/proc/%i/task",pid);
+  bool foundNew=true;
+  while(foundNew)
+  {
+    foundNew=false;
+    DIR* taskDir=opendir(taskDirName);
+    if(!taskDir)
+    {
+      death("Could not open %s to find the target's threads\n",taskDirName);
+    }
+    struct dirent* entry;
+    while((entry=readdir(taskDir)))
+    {
+      pid_t tid=atoi(entry->d_name);
+      if(tid<=0 || findThread(tid)>=0)
+      {
+        continue;
+      }
+      attachThread(tid);
+      foundNew=true;
+    }
+    closedir(taskDir);
+  }
+}
+
+pid_t* getTargetThreadIds(int* num)
+{
+  pid_t* tids=zmalloc(numThreads*sizeof(pid_t));
+  for(int i=0;i<numThreads;i++)
+  {
+    tids[i]=threads[i].tid;
+  }
+  *num=numThreads;
+  return tids;
+}
+
+void stopAllThreads()
+{
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].running)
+    {
+      syscall(SYS_tgkill,pid,threads[i].tid,SIGSTOP);
+    }
+  }
+  for(int i=0;i<numThreads;)
+  {
+    //threads created meanwhile are appended as running and come
+    //with a SIGSTOP of their own
+    if(!threads[i].running || waitForThreadStop(i))
+    {
+      i++;
+    }
+  }
+  attachNewThreads();
+}
+
+void continueAllThreads(pid_t* except,int numExcept)
+{
+  //once the target runs anything we cached may be stale
+  invalidatePageCache();
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].running)
+    {
+      continue;
+    }
+    bool held=false;
+    for(int j=0;j<numExcept;j++)
+    {
+      held=held || except[j]==threads[i].tid;
+    }
+    if(held)
+    {
+      continue;
+    }
+    int sig=releasePendingSignals(i);
+    if(ptrace(PTRACE_CONT,threads[i].tid,NULL,(void*)(long)sig)<0)
+    {
+      fprintf(stderr,"ptrace failed to continue thread %i with errno %d\n",threads[i].tid,errno);
+      death(NULL);
+    }
+    threads[i].faultAddr=0;
+    threads[i].running=true;
+  }
+}
+
+//checks, without blocking, whether any thread has hit one of our
+//breakpoints. Returns its tid if so or 0. Everything else that has
+//happened to the threads meanwhile is dealt with
+static pid_t pollTargetBreakpoint()
+{
+  while(true)
+  {
+    int status;
+    pid_t tid=waitpid(-1,&status,__WALL|WNOHANG);
+    if(tid<=0)
+    {
+      return 0;
+    }
+    if(handleThreadEvent(tid,status))
+    {
+      continue;
+    }
+    int idx=findThread(tid);
+    if(idx<0)
+    {
+      //a new thread reporting in before its creator did
+      idx=addThread(tid);
+    }
+    int sig=WSTOPSIG(status);
+    if(SIGTRAP==sig && threadAtBreakpoint(tid))
+    {
+      threads[idx].running=false;
+      return tid;
+    }
+    addr_t faultAddr=watchedFaultAddress(tid,sig);
+    if(faultAddr)
+    {
+      threads[idx].running=false;
+      threads[idx].faultAddr=faultAddr;
+      return tid;
+    }
+    //not for us. New threads start with a SIGSTOP which we swallow.
+    //Any other SIGSTOP (someone ran kill -STOP on the target) is held
+    //until we next continue or detach from the thread, delivering it
+    //now would stop the thread where we can't tell it from our own
+    //stops. Anything else goes straight to the program
+    if(SIGSTOP==sig)
+    {
+      if(!threads[idx].initialStopPending)
+      {
+        queuePendingSignal(idx,sig);
+      }
+      threads[idx].initialStopPending=false;
+      sig=0;
+    }
+    ptrace(PTRACE_CONT,tid,NULL,(void*)(long)sig);
+  }
+}
+
+//signalfd reporting SIGCHLD, which katana is sent whenever a traced
+//thread changes state. -1 until it's first needed
+static int childSignalFd=-1;
+
+static void openChildSignalFd()
+{
+  if(childSignalFd>=0)
+  {
+    return;
+  }
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask,SIGCHLD);
+  //it has to be blocked for the signalfd to get it
+  sigprocmask(SIG_BLOCK,&mask,NULL);
+  childSignalFd=signalfd(-1,&mask,SFD_NONBLOCK|SFD_CLOEXEC);
+  if(childSignalFd<0)
+  {
+    perror("signalfd failed");
+    death(NULL);
+  }
+}
+
+//timerfd that becomes readable timeoutMillis from now. The timer
+//keeps the deadline fixed however many times we're woken by threads
+//doing other things in the meantime
+static int startDeadlineTimer(int timeoutMillis)
+{
+  int timerFd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC);
+  if(timerFd<0)
+  {
+    perror("timerfd_create failed");
+    death(NULL);
+  }
+  struct itimerspec expiry;
+  memset(&expiry,0,sizeof(expiry));
+  expiry.it_value.tv_sec=timeoutMillis/1000;
+  expiry.it_value.tv_nsec=(timeoutMillis%1000)*1000000L;
+  timerfd_settime(timerFd,0,&expiry,NULL);
+  return timerFd;
+}
+
+pid_t waitForTargetBreakpoint(int timeoutMillis)
+{
+  openChildSignalFd();
+  pid_t tid=pollTargetBreakpoint();
+  if(tid || timeoutMillis<=0)
+  {
+    return tid;
+  }
+  int timerFd=startDeadlineTimer(timeoutMillis);
+  struct pollfd fds[2]={{.fd=childSignalFd,.events=POLLIN},{.fd=timerFd,.events=POLLIN}};
+  while(!tid)
+  {
+    if(poll(fds,2,-1)<0)
+    {
+      if(EINTR==errno)
+      {
+        continue;
+      }
+      perror("poll failed waiting for the target");
+      death(NULL);
+    }
+    //SIGCHLDs coalesce, so each wakeup deals with every thread that
+    //has changed state
+    struct signalfd_siginfo info;
+    while(read(childSignalFd,&info,sizeof(info))>0)
+    {
+    }
+    tid=pollTargetBreakpoint();
+    if(fds[1].revents & POLLIN)
+    {
+      break;
+    }
+  }
+  close(timerFd);
+  return tid;
+}
+
+bool waitForTargetTrap(int timeoutMillis)
+{
+  openChildSignalFd();
+  int idx=findThread(pid);
+  int timerFd=startDeadlineTimer(timeoutMillis);
+  struct pollfd fds[2]={{.fd=childSignalFd,.events=POLLIN},{.fd=timerFd,.events=POLLIN}};
+  bool timedOut=false;
+  bool trapped=false;
+  while(true)
+  {
+    int status;
+    pid_t got=waitpid(pid,&status,__WALL|WNOHANG);
+    if(got<0)
+    {
+      perror("waitpid failed waiting for the target to finish remote calls");
+      death(NULL);
+    }
+    if(got>0)
+    {
+      if(handleThreadEvent(pid,status))
+      {
+        continue;
+      }
+      int sig=WSTOPSIG(status);
+      if(SIGTRAP==sig)
+      {
+        trapped=true;
+        if(!timedOut)
+        {
+          break;
+        }
+        //it got there just as we gave up on it. The SIGSTOP we sent
+        //is still to come and will stop it before it runs anything
+        ptrace(PTRACE_CONT,pid,NULL,NULL);
+        continue;
+      }
+      if(SIGSTOP==sig && timedOut)
+      {
+        break;
+      }
+      //the program's own signal, keep it for when the target runs
+      //for real. Handlers won't run in the middle of our code
+      queuePendingSignal(idx,sig);
+      ptrace(PTRACE_CONT,pid,NULL,NULL);
+      continue;
+    }
+    if(poll(fds,timedOut?1:2,-1)<0)
+    {
+      if(EINTR==errno)
+      {
+        continue;
+      }
+      perror("poll failed waiting for the target");
+      death(NULL);
+    }
+    struct signalfd_siginfo info;
+    while(read(childSignalFd,&info,sizeof(info))>0)
+    {
+    }
+    if(!timedOut && (fds[1].revents & POLLIN))
+    {
+      //most likely blocked on a lock held by one of the threads we
+      //have stopped. Stop it wherever it is
+      timedOut=true;
+      syscall(SYS_tgkill,pid,pid,SIGSTOP);
+    }
+  }
+  close(timerFd);
+  threads[idx].running=false;
+  return trapped;
+}
+
+void setTargetPid(int pid_)
+{
+  pid=pid_;
+}
+
+int getTargetPid()
+{
+  return pid;
+}
+
+void startPtrace(int pid_)
+{
+  pid=pid_;
+  if(ptrace(PTRACE_ATTACH,pid,NULL,NULL)<0)
+  {
+    fprintf(stderr,"ptrace failed to attach to process with errno %d\n", errno);
+    death(NULL);
+  }
+  //kill(pid,SIGSTOP);
+  /*if(ptrace(PTRACE_CONT,pid,NULL,SIGSTOP)<0)
+  {
+    //just make sure the process is running
+    perror("failed to continue process\n");
+    death(NULL);
+    }*/
+
+  addThread(pid);
+  if(!waitForThreadStop(0))
+  {
+    death("The target process exited as katana attached to it\n");
+  }
+  ptrace(PTRACE_SETOPTIONS,pid,NULL,(void*)PTRACE_O_TRACECLONE);
+  //the other threads have to be held too, or they could be running
+  //the code we're about to change
+  attachNewThreads();
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"attached to %i threads of process %i\n",numThreads,pid);
+
+  //writes through /proc/<pid>/mem ignore page protections just like
+  //PTRACE_POKEDATA does, but can cover any number of bytes at any
+  //alignment in one syscall. We open it once for the whole attach
+  char memFname[64];
+  snprintf(memFname,64,"/proc/%i/mem",pid);
+  memFd=open(memFname,O_RDWR);
+  pageSize=sysconf(_SC_PAGE_SIZE);
+  if(memFd<0)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Could not open %s (errno %d), will write to read-only target memory with ptrace\n",memFname,errno);
+  }
+  printf("started ptrace\n");
+}
+
+void continuePtrace()
+{
+  //once the target runs anything we cached may be stale
+  invalidatePageCache();
+  //only the main thread runs, the code katana has it run must not
+  //race with the rest of the program
+  if((ptrace(PTRACE_CONT , pid , NULL , NULL)) < 0)
+  {
+    perror("ptrace cont failed");
+    exit(-1);
+  }
+  //this while loop idea courtesy of Phrack at
+  // http://phrack.org/issues.html?issue=59&id=8#article
+  //seems to cause issues with mmapTarget though, so
+  //we won't use it for now
+  //todo: figure out its purpose and if it's necessary
+  //int s;
+	//while (!WIFSTOPPED(s)) waitpid(pid , &s , WNOHANG);
+
+}
+
+void endPtrace(bool stopProcess)
+{
+  invalidatePageCache();
+  if(memFd>=0)
+  {
+    close(memFd);
+    memFd=-1;
+  }
+  for(int i=0;i<numThreads;i++)
+  {
+    if(ptrace(PTRACE_DETACH,threads[i].tid,NULL,(void*)(long)releasePendingSignals(i))<0)
+    {
+      if(threads[i].tid!=pid && ESRCH==errno)
+      {
+        continue;//exited
+      }
+      fprintf(stderr,"ptrace failed to detach from thread %i\n",threads[i].tid);
+      death(NULL);
+    }
+  }
+  free(threads);
+  threads=NULL;
+  numThreads=allocatedThreads=0;
+  if(childSignalFd>=0)
+  {
+    close(childSignalFd);
+    childSignalFd=-1;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGCHLD);
+    sigprocmask(SIG_UNBLOCK,&mask,NULL);
+  }
+  if(stopProcess)
+  {
+    kill(pid,SIGSTOP);
+  }
+  else
+  {
+    kill(pid,SIGCONT);
+  }
+
+}
+
+
+void modifyTarget(addr_t addr,word_t value)
+{
+  invalidateCachedRange(addr,sizeof(word_t));
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Trying to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
+  if(ptrace(PTRACE_POKEDATA,pid,addr,value)<0)
+  {
+    logprintf(ELL_ERR,ELS_HOTPATCH,"Failed to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
+    perror("ptrace POKEDATA failed in modifyTarget\n");
+    death(NULL);
+  }
+  //writes are verified in bulk by the callers (see verifyTargetWrites)
+}
+
+//todo: look more into this. ptrace
+//man page says it's required but in practice doesn't seem to be
+#define require_ptrace_alignment
+
+//copies numBytes from data to addr in target one word at a time with
+//PTRACE_POKEDATA. This is the slow path, only used for memory
+//process_vm_writev refuses to write (e.g. read-only text pages)
+static bool ptraceWriteRange(addr_t addr,byte* data,size_t numBytes);
+
+//copies numBytes from addr in target to data one word at a time with
+//PTRACE_PEEKDATA. Slow path, see ptraceWriteRange
+//returns false if ptrace fails
+static bool ptraceReadRange(byte* data,addr_t addr,size_t numBytes)
+{
+  for(size_t i=0;i<numBytes;i+=PTRACE_WORD_SIZE)
+  {
+    //PEEKDATA returns the data, so errno is the only way to detect failure
+    errno=0;
+    word_t val=ptrace(PTRACE_PEEKDATA,pid,addr+i,NULL);
+    if(errno)
+    {
+      //Do not log as error because the caller may be NoDeath
+      logprintf(ELL_INFO_V1, ELS_HOTPATCH, "Failed to peek data at 0x%zx. Errno %d\n", (word_t)(addr  + i), errno);
+      return false;
+    }
+    if(i+PTRACE_WORD_SIZE<=numBytes)
+    {
+      memcpy(data+i,&val,PTRACE_WORD_SIZE);
+    }
+    else
+    {
+      logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyFromTarget: wasn't aligned\n");
+      //at the end and wasn't aligned
+      memcpy(data+i,&val,numBytes-i);
+    }
+  }
+  return true;
+}
+
+static bool ptraceWriteRange(addr_t addr,byte* data,size_t numBytes)
+{
+  #ifdef require_ptrace_alignment
+  //ptrace requires all addresses to be word-aligned
+  addr_t misalignment=addr%PTRACE_WORD_SIZE;
+  if(misalignment)
+  {
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"misalignment is %i, addr is 0x%x\n",misalignment,addr);
+    byte firstWord[PTRACE_WORD_SIZE];
+    assert(PTRACE_WORD_SIZE==sizeof(word_t));
+    //we'll be copying back a few bytes that already existed
+    if(!ptraceReadRange(firstWord,addr-misalignment,PTRACE_WORD_SIZE))
+    {
+      return false;
+    }
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copied bytes {0x%x,0x%x,0x%x,0%x} from 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],(uint)(addr-misalignment));
+    size_t bytesInWd=min(PTRACE_WORD_SIZE-misalignment,numBytes);
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copying in %i patch bytes in first wd\n",(int)bytesInWd);
+    memcpy(&firstWord[misalignment],data,bytesInWd);
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"now copying bytes {0x%x,0x%x,0x%x,0x%x} to 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],addr-misalignment);
+    word_t wd;
+    memcpy(&wd,firstWord,sizeof(word_t));
+    modifyTarget(addr-misalignment,wd);
+    data+=bytesInWd;
+    numBytes-=bytesInWd;
+    addr+=bytesInWd;
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"addr is now 0x%x\n",addr);
+    if(0==numBytes)
+    {
+      return true;
+    }
+    //now we're all set to carry on copying normally from an aligned address
+  }
+
+  assert(0==addr%PTRACE_WORD_SIZE);
+  #endif
+
+  
+  for(size_t i=0;i<numBytes;i+=PTRACE_WORD_SIZE)
+  {
+    if(i+PTRACE_WORD_SIZE<=numBytes)
+    {
+      word_t val;
+      memcpy(&val,data+i,sizeof(word_t));
+      modifyTarget(addr+i,val);
+    }
+    else
+    {
+      assert(sizeof(word_t)==PTRACE_WORD_SIZE);
+      word_t tmp=0;
+      if(!ptraceReadRange((byte*)&tmp,addr+i,sizeof(word_t)))
+      {
+        return false;
+      }
+      memcpy(&tmp,data+i,numBytes-i);
+      modifyTarget(addr+i,tmp);
+    }
+  }
+  return true;
+}
+
+//reads or writes numBytes at addr in the target through /proc/<pid>/mem
+//returns false if that isn't possible
+static bool procMemTransfer(addr_t addr,byte* data,size_t numBytes,bool write)
+{
+  if(memFd<0)
+  {
+    return false;
+  }
+  while(numBytes>0)
+  {
+    ssize_t done;
+    if(write)
+    {
+      done=pwrite64(memFd,data,numBytes,(off64_t)addr);
+    }
+    else
+    {
+      done=pread64(memFd,data,numBytes,(off64_t)addr);
+    }
+    if(done<=0)
+    {
+      logprintf(ELL_INFO_V3,ELS_HOTPATCH,"could not %s %zu bytes at 0x%zx through /proc/%i/mem (errno %d)\n",write?"write":"read",numBytes,addr,pid,errno);
+      return false;
+    }
+    addr+=done;
+    data+=done;
+    numBytes-=done;
+  }
+  return true;
+}
+
+//process_vm_readv/process_vm_writev will not take more than IOV_MAX
+//iovecs in a single call, so bigger transfers are done in batches
+#define TARGET_IOV_BATCH 1024
+
+//cleared the first time the kernel refuses vectored transfers
+//outright (ENOSYS on kernels older than 3.2, EPERM under some
+//security policies) so we don't keep asking for every transfer
+static bool vmTransferAvailable=true;
+
+//moves data between katana and the target. Runs of ranges are handed
+//to process_vm_readv/process_vm_writev in one syscall per batch. When
+//the kernel stops part of the way through (it will not write to
+//read-only pages, for example) the rest of the range it stopped in is
+//moved with ptrace and the vectored transfer resumes with the next range
+//returns false if some of the data could not be transferred at all
+static bool transferTargetVec(TargetIOVec* vecs,int numVecs,bool write)
+{
+  struct iovec local[TARGET_IOV_BATCH];
+  struct iovec remote[TARGET_IOV_BATCH];
+  int i=0;
+  size_t offset=0;//how much of vecs[i] has been transferred already
+  while(i<numVecs)
+  {
+    if(offset>=vecs[i].len)
+    {
+      i++;
+      offset=0;
+      continue;
+    }
+    ssize_t transferred=-1;
+    if(vmTransferAvailable)
+    {
+      int cnt=0;
+      for(int j=i;j<numVecs && cnt<TARGET_IOV_BATCH;j++)
+      {
+        size_t skip=(j==i)?offset:0;
+        if(vecs[j].len==skip)
+        {
+          continue;
+        }
+        local[cnt].iov_base=vecs[j].data+skip;
+        local[cnt].iov_len=vecs[j].len-skip;
+        remote[cnt].iov_base=(void*)(vecs[j].addr+skip);
+        remote[cnt].iov_len=local[cnt].iov_len;
+        cnt++;
+      }
+      if(write)
+      {
+        transferred=process_vm_writev(pid,local,cnt,remote,cnt,0);
+      }
+      else
+      {
+        transferred=process_vm_readv(pid,local,cnt,remote,cnt,0);
+      }
+      if(transferred<0 && (ENOSYS==errno || EPERM==errno))
+      {
+        logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Vectored transfers to the target are not available (errno %d), using ptrace for all target memory access\n",errno);
+        vmTransferAvailable=false;
+      }
+    }
+    if(transferred>0)
+    {
+      size_t left=transferred;
+      while(left>0)
+      {
+        size_t inVec=vecs[i].len-offset;
+        if(left>=inVec)
+        {
+          left-=inVec;
+          i++;
+          offset=0;
+        }
+        else
+        {
+          offset+=left;
+          left=0;
+        }
+      }
+      continue;
+    }
+    //the kernel would not move the next piece for us
+    //so fall back on /proc/<pid>/mem and then ptrace for the
+    //remainder of this range
+    if(procMemTransfer(vecs[i].addr+offset,vecs[i].data+offset,vecs[i].len-offset,write))
+    {
+      i++;
+      offset=0;
+      continue;
+    }
+    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"using ptrace to %s %zu bytes at 0x%zx\n",write?"write":"read",vecs[i].len-offset,vecs[i].addr+offset);
+    bool success;
+    if(write)
+    {
+      success=ptraceWriteRange(vecs[i].addr+offset,vecs[i].data+offset,vecs[i].len-offset);
+    }
+    else
+    {
+      success=ptraceReadRange(vecs[i].data+offset,vecs[i].addr+offset,vecs[i].len-offset);
+    }
+    if(!success)
+    {
+      return false;
+    }
+    i++;
+    offset=0;
+  }
+  return true;
+}
+
+int cmpTargetIOVecByAddr(const void* a,const void* b)
+{
+  addr_t addrA=((TargetIOVec*)a)->addr;
+  addr_t addrB=((TargetIOVec*)b)->addr;
+  return addrA<addrB?-1:(addrA>addrB?1:0);
+}
+
+//reads the ranges straight from the target, ignoring any pending
+//transaction. Returns false if any of them could not be read
+static bool readTargetNow(TargetIOVec* vecs,int numVecs)
+{
+  return transferTargetVec(vecs,numVecs,false);
+}
+
+static int cmpAddr(const void* a,const void* b)
+{
+  addr_t addrA=*(addr_t*)a;
+  addr_t addrB=*(addr_t*)b;
+  return addrA<addrB?-1:(addrA>addrB?1:0);
+}
+
+//bring every page in pages (sorted, no duplicates) into the cache,
+//all in one transfer if we can. Pages which can't be read (e.g. the
+//read runs off the end of a mapping) are just left out
+static void fetchPages(addr_t* pages,int numPages)
+{
+  TargetIOVec* vecs=zmalloc(sizeof(TargetIOVec)*numPages);
+  for(int i=0;i<numPages;i++)
+  {
+    vecs[i].addr=pages[i];
+    vecs[i].data=zmalloc(pageSize);
+    vecs[i].len=pageSize;
+  }
+  bool allRead=readTargetNow(vecs,numPages);
+  for(int i=0;i<numPages;i++)
+  {
+    if(allRead || readTargetNow(&vecs[i],1))
+    {
+      addr_t* key=zmalloc(sizeof(addr_t));
+      *key=pages[i];
+      mapInsert(pageCache,key,vecs[i].data);
+    }
+    else
+    {
+      free(vecs[i].data);
+    }
+  }
+  free(vecs);
+}
+
+//like readTargetNow but serves what it can from the page cache,
+//fetching the missing pages of all the ranges together
+static bool readTargetCached(TargetIOVec* vecs,int numVecs)
+{
+  //pages of a target we haven't stopped can change under us
+  if(!pageSize || !numThreads)
+  {
+    return readTargetNow(vecs,numVecs);
+  }
+  if(!pageCache)
+  {
+    pageCache=size_tMapCreate(PAGE_CACHE_BUCKETS);
+  }
+  //first find every page we need that isn't cached yet
+  int numMissing=0;
+  int allocated=0;
+  addr_t* missing=NULL;
+  for(int i=0;i<numVecs;i++)
+  {
+    if(!vecs[i].len || vecs[i].len>PAGE_CACHE_MAX_READ_PAGES*pageSize)
+    {
+      continue;
+    }
+    addr_t lastPage=(vecs[i].addr+vecs[i].len-1) & ~(pageSize-1);
+    for(addr_t page=vecs[i].addr & ~(pageSize-1);page<=lastPage;page+=pageSize)
+    {
+      if(mapExists(pageCache,&page))
+      {
+        continue;
+      }
+      if(numMissing==allocated)
+      {
+        allocated=allocated?2*allocated:16;
+        missing=realloc(missing,allocated*sizeof(addr_t));
+        MALLOC_CHECK(missing);
+      }
+      missing[numMissing++]=page;
+    }
+  }
+  if(numMissing)
+  {
+    qsort(missing,numMissing,sizeof(addr_t),cmpAddr);
+    int numUnique=1;
+    for(int i=1;i<numMissing;i++)
+    {
+      if(missing[i]!=missing[numUnique-1])
+      {
+        missing[numUnique++]=missing[i];
+      }
+    }
+    pageCacheMisses+=numUnique;
+    fetchPages(missing,numUnique);
+  }
+  free(missing);
+
+  //now fill in each range from the cache, going to the target
+  //directly for anything the cache couldn't hold
+  bool success=true;
+  for(int i=0;i<numVecs;i++)
+  {
+    addr_t addr=vecs[i].addr;
+    size_t done=0;
+    while(done<vecs[i].len && vecs[i].len<=PAGE_CACHE_MAX_READ_PAGES*pageSize)
+    {
+      addr_t page=(addr+done) & ~(pageSize-1);
+      byte* cached=mapGet(pageCache,&page);
+      if(!cached)
+      {
+        break;
+      }
+      size_t offset=addr+done-page;
+      size_t amount=pageSize-offset;
+      if(amount>vecs[i].len-done)
+      {
+        amount=vecs[i].len-done;
+      }
+      memcpy(vecs[i].data+done,cached+offset,amount);
+      done+=amount;
+      pageCacheHits++;
+    }
+    if(done<vecs[i].len)
+    {
+      TargetIOVec rest={addr+done,vecs[i].data+done,vecs[i].len-done};
+      success=readTargetNow(&rest,1) && success;
+    }
+  }
+  return success;
+}
+
+//With EKCF_CHECK_PTRACE_WRITES, reads back everything just written in
+//one bulk transfer and compares each range with what we meant to
+//write. Dies naming the exact bytes that differ if they don't match
+static void verifyTargetWrites(TargetIOVec* vecs,int numVecs)
+{
+  if(!isFlag(EKCF_CHECK_PTRACE_WRITES) || !numVecs)
+  {
+    return;
+  }
+  size_t total=0;
+  for(int i=0;i<numVecs;i++)
+  {
+    total+=vecs[i].len;
+  }
+  byte* readBack=zmalloc(total?total:1);
+  TargetIOVec* readVecs=zmalloc(sizeof(TargetIOVec)*numVecs);
+  for(int i=0,pos=0;i<numVecs;pos+=vecs[i].len,i++)
+  {
+    readVecs[i].addr=vecs[i].addr;
+    readVecs[i].data=readBack+pos;
+    readVecs[i].len=vecs[i].len;
+  }
+  if(!readTargetNow(readVecs,numVecs))
+  {
+    death("failed to read back %zu bytes written to the target for verification\n",total);
+  }
+  for(int i=0;i<numVecs;i++)
+  {
+    if(!memcmp(vecs[i].data,readVecs[i].data,vecs[i].len))
+    {
+      continue;
+    }
+    //find exactly which bytes are wrong
+    size_t first=0;
+    while(first<vecs[i].len && vecs[i].data[first]==readVecs[i].data[first])
+    {
+      first++;
+    }
+    size_t last=vecs[i].len;
+    while(last>first && vecs[i].data[last-1]==readVecs[i].data[last-1])
+    {
+      last--;
+    }
+    death("failed to validate write to target: bytes 0x%zx-0x%zx of the %zu byte range at 0x%zx differ from what was written\n",vecs[i].addr+first,vecs[i].addr+last,vecs[i].len,vecs[i].addr);
+  }
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"verified %i ranges (%zu bytes) written to the target\n",numVecs,total);
+  free(readVecs);
+  free(readBack);
+}
+
+//writes the ranges to the target right away, ignoring any pending transaction
+static void writeTargetNow(TargetIOVec* vecs,int numVecs)
+{
+  for(int i=0;i<numVecs;i++)
+  {
+    invalidateCachedRange(vecs[i].addr,vecs[i].len);
+  }
+  if(!transferTargetVec(vecs,numVecs,true))
+  {
+    perror("writing to target failed");
+    death(NULL);
+  }
+}
+
+//like writeTargetNow but for read-only (usually executable) memory.
+//Ranges that are adjacent in the target are merged so that each run
+//of code costs a single positional write. vecs will be sorted by address
+static void writeTargetCodeNow(TargetIOVec* vecs,int numVecs)
+{
+  if(memFd<0)
+  {
+    writeTargetNow(vecs,numVecs);
+    return;
+  }
+  qsort(vecs,numVecs,sizeof(TargetIOVec),cmpTargetIOVecByAddr);
+  for(int i=0;i<numVecs;)
+  {
+    //find the run of ranges starting at i which are back to back in the target
+    int j=i+1;
+    size_t runLen=vecs[i].len;
+    while(j<numVecs && vecs[j].addr==vecs[i].addr+runLen)
+    {
+      runLen+=vecs[j].len;
+      j++;
+    }
+    byte* run=vecs[i].data;
+    if(j-i>1)
+    {
+      run=zmalloc(runLen);
+      for(int k=i,pos=0;k<j;pos+=vecs[k].len,k++)
+      {
+        memcpy(run+pos,vecs[k].data,vecs[k].len);
+      }
+    }
+    logprintf(ELL_INFO_V3,ELS_HOTPATCH,"writing %zu bytes of code at 0x%zx\n",runLen,vecs[i].addr);
+    invalidateCachedRange(vecs[i].addr,runLen);
+    if(!procMemTransfer(vecs[i].addr,run,runLen,true))
+    {
+      TargetIOVec runVec={vecs[i].addr,run,runLen};
+      writeTargetNow(&runVec,1);
+    }
+    if(run!=vecs[i].data)
+    {
+      free(run);
+    }
+    i=j;
+  }
+}
+
+//single range versions of the above. Used for the temporary code
+//and breakpoints katana places in the target, which must take
+//effect right away even in the middle of a transaction
+void pokeTargetCode(addr_t addr,byte* data,int numBytes)
+{
+  TargetIOVec vec={addr,data,numBytes};
+  writeTargetCodeNow(&vec,1);
+  verifyTargetWrites(&vec,1);
+}
+
+void peekTarget(byte* data,addr_t addr,int numBytes)
+{
+  TargetIOVec vec={addr,data,numBytes};
+  if(!readTargetNow(&vec,1))
+  {
+    perror("reading from target failed");
+    death(NULL);
+  }
+}
+
+//////////////////////////////////////////////////////////////
+//Write journal. While a transaction is open, writes to the target
+//are not made right away. They are collected here, with overlapping
+//and adjacent writes merged into single ranges, and flushed all at
+//once when the transaction is committed. Reads made during the
+//transaction see the pending writes. For every byte the transaction
+//touches we also keep what the target held before, read in a single
+//batch at commit, so that a committed transaction can be undone.
+//////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  addr_t addr;
+  size_t len;
+  byte* data;//what will be written at commit
+  byte* preImage;//what the target held before the transaction
+  bool code;//true if any write merged into this entry was to code
+} JournalEntry;
+
+typedef struct
+{
+  bool open;
+  //sorted by address. No two entries overlap or are adjacent
+  JournalEntry* entries;
+  int numEntries;
+  int allocated;
+  int numWrites;//number of writes recorded, for statistics
+} WriteJournal;
+
+static WriteJournal journal;
+
+//index of the first entry which ends at or after addr
+//(i.e. overlaps or is adjacent to anything starting at addr)
+static int journalFirstEntryReaching(addr_t addr)
+{
+  int low=0;
+  int high=journal.numEntries;
+  while(low<high)
+  {
+    int middle=low+(high-low)/2;
+    JournalEntry* e=&journal.entries[middle];
+    if(e->addr+e->len<addr)
+    {
+      low=middle+1;
+    }
+    else
+    {
+      high=middle;
+    }
+  }
+  return low;
+}
+
+static void freeJournalEntries()
+{
+  for(int i=0;i<journal.numEntries;i++)
+  {
+    free(journal.entries[i].data);
+    free(journal.entries[i].preImage);
+  }
+  free(journal.entries);
+  journal.entries=NULL;
+  journal.numEntries=0;
+  journal.allocated=0;
+  journal.numWrites=0;
+}
+
+static void journalWrite(addr_t addr,byte* data,size_t len,bool code)
+{
+  if(!len)
+  {
+    return;
+  }
+  journal.numWrites++;
+  addr_t end=addr+len;
+  //entries [first,last) overlap or are adjacent to the new write
+  int first=journalFirstEntryReaching(addr);
+  int last=first;
+  while(last<journal.numEntries && journal.entries[last].addr<=end)
+  {
+    last++;
+  }
+  addr_t newStart=addr;
+  addr_t newEnd=end;
+  if(last>first)
+  {
+    JournalEntry* lastEntry=&journal.entries[last-1];
+    newStart=addr<journal.entries[first].addr?addr:journal.entries[first].addr;
+    newEnd=end>lastEntry->addr+lastEntry->len?end:lastEntry->addr+lastEntry->len;
+  }
+  JournalEntry merged;
+  merged.addr=newStart;
+  merged.len=newEnd-newStart;
+  merged.data=zmalloc(merged.len);
+  merged.preImage=NULL;//read at commit, see fetchJournalPreImages
+  merged.code=code;
+
+  //copy over what the existing entries hold. Any gaps between them
+  //still have their original contents in the target, so there is
+  //nothing to fetch until the transaction is committed
+  for(int k=first;k<last;k++)
+  {
+    JournalEntry* e=&journal.entries[k];
+    memcpy(merged.data+(e->addr-newStart),e->data,e->len);
+    merged.code=merged.code || e->code;
+    free(e->data);
+  }
+  memcpy(merged.data+(addr-newStart),data,len);
+
+  //replace entries [first,last) with the merged one
+  int removed=last-first;
+  if(0==removed)
+  {
+    if(journal.numEntries==journal.allocated)
+    {
+      journal.allocated=journal.allocated?2*journal.allocated:64;
+      journal.entries=realloc(journal.entries,journal.allocated*sizeof(JournalEntry));
+      MALLOC_CHECK(journal.entries);
+    }
+    memmove(&journal.entries[first+1],&journal.entries[first],
+            (journal.numEntries-first)*sizeof(JournalEntry));
+    journal.numEntries++;
+  }
+  else if(removed>1)
+  {
+    memmove(&journal.entries[first+1],&journal.entries[last],
+            (journal.numEntries-last)*sizeof(JournalEntry));
+    journal.numEntries-=removed-1;
+  }
+  journal.entries[first]=merged;
+}
+
+//copy any pending writes which overlap [addr,addr+len) over data
+static void journalOverlay(byte* data,addr_t addr,size_t len)
+{
+  addr_t end=addr+len;
+  for(int k=journalFirstEntryReaching(addr);k<journal.numEntries;k++)
+  {
+    JournalEntry* e=&journal.entries[k];
+    if(e->addr>=end)
+    {
+      break;
+    }
+    addr_t from=addr>e->addr?addr:e->addr;
+    addr_t to=end<e->addr+e->len?end:e->addr+e->len;
+    if(from<to)
+    {
+      memcpy(data+(from-addr),e->data+(from-e->addr),to-from);
+    }
+  }
+}
+
+//reads what the target holds under every journal entry, in one
+//transfer. Writes are held back until commit, so right up until the
+//journal is flushed the target still has its original contents there
+static void fetchJournalPreImages()
+{
+  if(!journal.numEntries)
+  {
+    return;
+  }
+  TargetIOVec* vecs=zmalloc(sizeof(TargetIOVec)*journal.numEntries);
+  for(int i=0;i<journal.numEntries;i++)
+  {
+    JournalEntry* e=&journal.entries[i];
+    e->preImage=zmalloc(e->len);
+    vecs[i].addr=e->addr;
+    vecs[i].data=e->preImage;
+    vecs[i].len=e->len;
+  }
+  if(!readTargetNow(vecs,journal.numEntries))
+  {
+    death("Unable to read the original contents of the %i ranges about to be written to the target\n",journal.numEntries);
+  }
+  free(vecs);
+}
+
+//writes either the new data or the pre-image of every journal entry
+//to the target, code and data ranges each in one batch
+static void flushJournal(bool preImage)
+{
+  int numVecs=journal.numEntries?journal.numEntries:1;
+  //room for the data ranges too, they're appended for verification
+  TargetIOVec* codeVecs=zmalloc(sizeof(TargetIOVec)*2*numVecs);
+  TargetIOVec* dataVecs=zmalloc(sizeof(TargetIOVec)*numVecs);
+  int numCode=0;
+  int numData=0;
+  for(int i=0;i<journal.numEntries;i++)
+  {
+    JournalEntry* e=&journal.entries[i];
+    TargetIOVec* vec=e->code?&codeVecs[numCode++]:&dataVecs[numData++];
+    vec->addr=e->addr;
+    vec->data=preImage?e->preImage:e->data;
+    vec->len=e->len;
+  }
+  if(numData)
+  {
+    writeTargetNow(dataVecs,numData);
+  }
+  if(numCode)
+  {
+    writeTargetCodeNow(codeVecs,numCode);
+  }
+  //one readback for the whole transaction
+  memcpy(codeVecs+numCode,dataVecs,numData*sizeof(TargetIOVec));
+  verifyTargetWrites(codeVecs,numCode+numData);
+  free(codeVecs);
+  free(dataVecs);
+}
+
+//Memory allocated in the target while a transaction is open. It is
+//given back if the transaction is aborted or undone, so that backing
+//out a patch doesn't leave its memory behind
+typedef struct
+{
+  addr_t addr;
+  word_t size;
+  bool mapped;//mmapped (and so munmapped) rather than malloc'd
+} TargetAllocation;
+static TargetAllocation* allocations=NULL;
+static int numAllocations=0;
+
+static void recordTargetAllocation(addr_t addr,word_t size,bool mapped)
+{
+  if(!journal.open)
+  {
+    return;
+  }
+  allocations=realloc(allocations,(numAllocations+1)*sizeof(TargetAllocation));
+  MALLOC_CHECK(allocations);
+  allocations[numAllocations].addr=addr;
+  allocations[numAllocations].size=size;
+  allocations[numAllocations].mapped=mapped;
+  numAllocations++;
 }
 
-void setTargetTextStart(addr_t addr)
+void recordTargetMapping(addr_t addr,word_t size)
 {
-  targetTextStart=addr;
+  recordTargetAllocation(addr,size,true);
 }
 
-void startPtrace(int pid_)
+static void forgetTargetAllocations()
 {
-  pid=pid_;
-  if(ptrace(PTRACE_ATTACH,pid,NULL,NULL)<0)
+  free(allocations);
+  allocations=NULL;
+  numAllocations=0;
+}
+
+//munmaps and frees everything recorded, all in one batch of remote
+//calls. The target must not still be using any of it
+static void releaseTargetAllocations()
+{
+  RemoteCall* calls=zmalloc((numAllocations?numAllocations:1)*sizeof(RemoteCall));
+  int numCalls=0;
+  int numLeaked=0;
+  //most recent first, the way they'd unwind in the program
+  for(int i=numAllocations-1;i>=0;i--)
   {
-    fprintf(stderr,"ptrace failed to attach to process with errno %d\n", errno);
-    death(NULL);
+    if(allocations[i].mapped)
+    {
+      setRemoteSyscall(&calls[numCalls++],SYS_munmap,2,allocations[i].addr,allocations[i].size);
+    }
+    else if(freeAddress)
+    {
+      setRemoteFunctionCall(&calls[numCalls++],freeAddress,1,allocations[i].addr);
+    }
+    else
+    {
+      numLeaked++;
+    }
   }
-  //kill(pid,SIGSTOP);
-  /*if(ptrace(PTRACE_CONT,pid,NULL,SIGSTOP)<0)
+  if(numLeaked)
   {
-    //just make sure the process is running
-    perror("failed to continue process\n");
-    death(NULL);
-    }*/
-
-  //this line included on recommendation of phrack
-  //http://phrack.org/issues.html?issue=59&id=8#article
-  //I'm not entirely positive why
-  //todo: figure this out
-  waitpid(pid , NULL , WUNTRACED);
-  printf("started ptrace\n");
+    logprintf(ELL_WARN,ELS_HOTPATCH,"location of free in the target is unknown, leaving %i objects malloc'd there\n",numLeaked);
+  }
+  if(numCalls)
+  {
+    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"releasing %i regions of memory allocated in the target\n",numCalls);
+    if(!remoteCallBatch(calls,numCalls))
+    {
+      logprintf(ELL_WARN,ELS_HOTPATCH,"timed out releasing memory allocated in the target, some of it may be left behind\n");
+    }
+  }
+  free(calls);
+  forgetTargetAllocations();
 }
 
-void continuePtrace()
+void beginTargetTransaction()
 {
-  if((ptrace(PTRACE_CONT , pid , NULL , NULL)) < 0)
+  if(journal.open)
   {
-    perror("ptrace cont failed");
-    exit(-1);
+    death("A target transaction is already open\n");
   }
-  //this while loop idea courtesy of Phrack at
-  // http://phrack.org/issues.html?issue=59&id=8#article
-  //seems to cause issues with mmapTarget though, so
-  //we won't use it for now
-  //todo: figure out its purpose and if it's necessary
-  //int s;
-	//while (!WIFSTOPPED(s)) waitpid(pid , &s , WNOHANG);
-
+  //forget the pre-image and allocations of any earlier transaction
+  freeJournalEntries();
+  forgetTargetAllocations();
+  journal.open=true;
 }
 
-void endPtrace(bool stopProcess)
+void commitTargetTransaction()
 {
-  
-  if(ptrace(PTRACE_DETACH,pid,NULL,NULL)<0)
+  if(!journal.open)
   {
-    fprintf(stderr,"ptrace failed to detach\n");
-    death(NULL);
+    death("No target transaction is open\n");
   }
-  if(stopProcess)
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"committing %i writes to the target as %i ranges\n",journal.numWrites,journal.numEntries);
+  journal.open=false;
+  fetchJournalPreImages();
+  flushJournal(false);
+}
+
+void abortTargetTransaction()
+{
+  if(!journal.open)
   {
-    kill(pid,SIGSTOP);
+    death("No target transaction is open\n");
   }
-  else
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"discarding %i pending writes to the target\n",journal.numWrites);
+  journal.open=false;
+  freeJournalEntries();
+  releaseTargetAllocations();
+}
+
+void undoTargetTransaction()
+{
+  if(journal.open)
   {
-    kill(pid,SIGCONT);
+    death("Cannot undo a target transaction that is still open\n");
   }
-
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"restoring %i ranges of the target to their state before the last transaction\n",journal.numEntries);
+  flushJournal(true);
+  freeJournalEntries();
+  releaseTargetAllocations();
 }
 
+bool inTargetTransaction()
+{
+  return journal.open;
+}
 
-void modifyTarget(addr_t addr,word_t value)
+//copies each of the given ranges into the target
+void memcpyToTargetVec(TargetIOVec* vecs,int numVecs)
 {
-  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"Trying to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
-  if(ptrace(PTRACE_POKEDATA,pid,addr,value)<0)
+  if(!journal.open)
   {
-    logprintf(ELL_ERR,ELS_HOTPATCH,"Failed to poke data at 0x%x with value 0x%x\n",(word_t)addr,(word_t)value);
-    perror("ptrace POKEDATA failed in modifyTarget\n");
-    death(NULL);
+    writeTargetNow(vecs,numVecs);
+    verifyTargetWrites(vecs,numVecs);
+    return;
   }
-  //test to make sure the write went through
-  if(isFlag(EKCF_CHECK_PTRACE_WRITES))
+  for(int i=0;i<numVecs;i++)
   {
-    word_t val=ptrace(PTRACE_PEEKDATA,pid,addr);
-    if(errno)
-    {
-      logprintf(ELL_ERR, ELS_HOTPATCH, "Failed to peek data at 0x%x. Errno %d\n", (word_t)addr, errno);
-      perror("ptrace PEEKDATA failed\n");
-      death(NULL);
-    }
-    if(val!=value)
-    {
-      death("modifyTarget failed, failed to validate result of write\n");
-    }
-    else
-    {
-      logprintf(ELL_INFO_V4,ELS_HOTPATCH,"modifyTarget validated write\n");
-    }
+    journalWrite(vecs[i].addr,vecs[i].data,vecs[i].len,false);
   }
 }
 
-//todo: look more into this. ptrace
-//man page says it's required but in practice doesn't seem to be
-#define require_ptrace_alignment
-
 //copies numBytes from data to addr in target
 void memcpyToTarget(addr_t addr,byte* data,int numBytes)
 {
-  #ifdef require_ptrace_alignment
-  //ptrace requires all addresses to be word-aligned
-  addr_t misalignment=addr%PTRACE_WORD_SIZE;
-  if(misalignment)
+  TargetIOVec vec={addr,data,numBytes};
+  memcpyToTargetVec(&vec,1);
+}
+
+void memcpyToTargetCodeVec(TargetIOVec* vecs,int numVecs)
+{
+  if(!journal.open)
   {
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"misalignment is %i, addr is 0x%x\n",misalignment,addr);
-    byte firstWord[PTRACE_WORD_SIZE];
-    assert(PTRACE_WORD_SIZE==sizeof(word_t));
-    //we'll be copying back a few bytes that already existed
-    memcpyFromTarget(firstWord,addr-misalignment,PTRACE_WORD_SIZE);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copied bytes {0x%x,0x%x,0x%x,0%x} from 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],(uint)(addr-misalignment));
-    int bytesInWd=min(PTRACE_WORD_SIZE-misalignment,numBytes);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"copying in %i patch bytes in first wd\n",bytesInWd);
-    memcpy(&firstWord[misalignment],data,bytesInWd);
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"now copying bytes {0x%x,0x%x,0x%x,0x%x} to 0x%x\n",(uint)firstWord[0],(uint)firstWord[1],(uint)firstWord[2],(uint)firstWord[3],addr-misalignment);
-    word_t wd;
-    memcpy(&wd,firstWord,sizeof(word_t));
-    modifyTarget(addr-misalignment,wd);
-    data+=bytesInWd;
-    numBytes-=bytesInWd;
-    addr+=bytesInWd;
-    logprintf(ELL_INFO_V4,ELS_HOTPATCH,"addr is now 0x%x\n",addr);
-    if(0==numBytes)
-    {
-      return;
-    }
-    //now we're all set to carry on copying normally from an aligned address
+    writeTargetCodeNow(vecs,numVecs);
+    verifyTargetWrites(vecs,numVecs);
+    return;
+  }
+  for(int i=0;i<numVecs;i++)
+  {
+    journalWrite(vecs[i].addr,vecs[i].data,vecs[i].len,true);
   }
+}
 
-  assert(0==addr%PTRACE_WORD_SIZE);
-  #endif
+void memcpyToTargetCode(addr_t addr,byte* data,int numBytes)
+{
+  TargetIOVec vec={addr,data,numBytes};
+  memcpyToTargetCodeVec(&vec,1);
+}
 
-  
-  for(int i=0;i<numBytes;i+=PTRACE_WORD_SIZE)
+//fills each of the given ranges with data from the target
+//returns false if any of them could not be read
+bool memcpyFromTargetVecNoDeath(TargetIOVec* vecs,int numVecs)
+{
+  if(!readTargetCached(vecs,numVecs))
   {
-    if(i+PTRACE_WORD_SIZE<=numBytes)
-    {
-      word_t val;
-      memcpy(&val,data+i,sizeof(word_t));
-      modifyTarget(addr+i,val);
-    }
-    else
+    return false;
+  }
+  if(journal.open)
+  {
+    for(int i=0;i<numVecs;i++)
     {
-      assert(sizeof(word_t)==PTRACE_WORD_SIZE);
-      word_t tmp=0;
-      memcpyFromTarget((byte*)&tmp,addr+i,sizeof(word_t));
-      memcpy(&tmp,data+i,numBytes-i);
-      modifyTarget(addr+i,tmp);
+      journalOverlay(vecs[i].data,vecs[i].addr,vecs[i].len);
     }
   }
+  return true;
 }
 
 //like memcpyFromTarget except doesn't kill katana
@@ -246,27 +1724,8 @@ void memcpyToTarget(addr_t addr,byte* data,int numBytes)
 bool memcpyFromTargetNoDeath(byte* data,long addr,int numBytes)
 {
   logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyFromTarget: getting %i bytes from 0x%x\n",numBytes,(uint)addr);
-  for(int i=0;i<numBytes;i+=4)
-  {
-    uint val=ptrace(PTRACE_PEEKDATA,pid,addr+i);
-    if(errno)
-    {
-      //Do not log as error because this function is NoDeath
-      logprintf(ELL_INFO_V1, ELS_HOTPATCH, "Failed to peek data at 0x%llx. Errno %d\n", (word_t)(addr  + i), errno);
-      return false;
-    }
-    if(i+PTRACE_WORD_SIZE<=numBytes)
-    {
-      memcpy(data+i,&val,PTRACE_WORD_SIZE);
-    }
-    else
-    {
-      logprintf(ELL_INFO_V4,ELS_HOTPATCH,"memcpyFromTarget: wasn't aligned\n");
-      //at the end and wasn't aligned
-      memcpy(data+i,&val,numBytes-i);
-    }
-  }
-  return true;
+  TargetIOVec vec={addr,data,numBytes};
+  return memcpyFromTargetVecNoDeath(&vec,1);
 }
 
 //copies numBytes to data from addr in target
@@ -279,24 +1738,34 @@ void memcpyFromTarget(byte* data,long addr,int numBytes)
   }      
 }
 
-void getTargetRegs(struct user_regs_struct* regs)
+void getThreadRegs(pid_t tid,struct user_regs_struct* regs)
 {
-  if(ptrace(PTRACE_GETREGS,pid,NULL,regs) < 0)
+  if(ptrace(PTRACE_GETREGS,tid,NULL,regs) < 0)
   {
     perror("ptrace getregs failed\n");
     death(NULL);
   }
 }
 
-void setTargetRegs(struct user_regs_struct* regs)
+void setThreadRegs(pid_t tid,struct user_regs_struct* regs)
 {
-  if(ptrace(PTRACE_SETREGS,pid,NULL,regs)<0)
+  if(ptrace(PTRACE_SETREGS,tid,NULL,regs)<0)
   {
     perror("ptrace setregs failed\n");
     death(NULL);
   }
 }
 
+void getTargetRegs(struct user_regs_struct* regs)
+{
+  getThreadRegs(pid,regs);
+}
+
+void setTargetRegs(struct user_regs_struct* regs)
+{
+  setThreadRegs(pid,regs);
+}
+
 //allocate a region of memory in the target using malloc
 //should be used for when creating objects to be used in the program,
 //as opposed to mmapTarget which should be used when mapping in new sections
@@ -304,100 +1773,36 @@ void setTargetRegs(struct user_regs_struct* regs)
 //http://www.hick.org/code/skape/papers/needle.txt
 addr_t mallocTarget(word_t len)
 {
-  struct user_regs_struct oldRegs,newRegs;
-  getTargetRegs(&oldRegs);
-  newRegs=oldRegs;
-
-  //so we have to do two things
-  //1. we have to push the amount to malloc onto the stack (5-byte instr)
-  //2. we have to call malloc (5-byte instr).
-  //  This is tricky because we have to know where
-  //  malloc lives. We're going to have to find it in the PLT. That's
-  //  outside the scope of this module though. We rely on it to be set
-  //  from outside the module using the setMallocPLTAddress method
-  //3. we have to restore the stack (3 byte instr)
   if(!mallocAddress)
   {
     death("location of malloc is unknown\n");
   }
-  if(!targetTextStart)
+  RemoteCall call;
+  setRemoteFunctionCall(&call,mallocAddress,1,len);
+  remoteCallBatch(&call,1);
+  if(!call.result)
   {
-    death("location of target's start of text\n");
+    death("malloc in target of size %i failed\n",len);
   }
+  recordTargetAllocation(call.result,len,false);
+  return call.result;
+}
 
-  //for some odd reason, sometimes having issues if we just used newRegs.eip
-  addr_t modifyTextLocation=targetTextStart;
-
-
-  //same for both x86 and x86_64 with the calling
-  //models we're using
-  
-  #ifdef KATANA_X86_ARCH
-  //68 xx xx xx xx pushes amount to malloc onto the stack
-  //e8 xx xx xx xx calls malloc
-  //83 c4 04       adds 4 to esp (popping the stack without storing anywhere)
-  //cc           int3, causes process to wait for controlling process (us)
-  
-  #define CODE_LEN 14
-  byte code[CODE_LEN]={0x68,0x00,0x00,0x00,0x00,
-                       0xe8,0x00,0x00,0x00,0x00,
-                       0x83,0xc4, 0x04,
-                       0xcc};
-  //+10 because the first instruction after the call instruction
-  //(i.e. what the relative call will be relative to) is 10 instructions
-  //after the start of the code
-  addr_t relativeMallocPTAddr=mallocAddress-(modifyTextLocation+10);
-  memcpy(code+1,&len,4);
-  memcpy(code+6,&relativeMallocPTAddr,sizeof(addr_t));
-#elif defined(KATANA_X86_64_ARCH)
-  REG_DI(newRegs)=len;//put amount to malloc into register rdi
-  REG_BX(newRegs)=mallocAddress;
-  //ff 15 01 00 00 00                         calls malloc (near indirect)
-  //cc                                        int3, pass control to controlling process
-  //xx xx xx xx xx xx xx xx                   malloc address
-  //we use a near absolute indirect call for x86_64 because relative call (opcode e8)
-  //uses 32-bit addressing mode and we have a raw address of the malloc procedure,
-  //don't know if it's within 32 bits
-  #define CODE_LEN 15
-  byte code[CODE_LEN]={
-    0xff,0x15,0x01,0x00,0x00,0x00,
-    0xcc,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-  memcpy(code+2+4+1,&mallocAddress,sizeof(addr_t));
-  #else
-#error "unknown architecture"
-  #endif
-  
-  byte oldText[CODE_LEN];
-  
-  memcpyFromTarget(oldText,modifyTextLocation,CODE_LEN);
-  memcpyToTarget(modifyTextLocation,code,CODE_LEN);
-
-  REG_IP(newRegs)=modifyTextLocation;
-  //todo: According to Taylor Campbell, x86_64 requires stack to be 128-bit aligned when making
-  //a function call. Need to look into this and check if it is. If it isn't just adjust %rsp
-  //a little bit, as long as we remember to adjust it back later
-
-  //printf("stack pointer is 0x%zx (128-bit alignment is %zu)\n",REG_SP(newRegs),REG_SP(newRegs) % 16);
-
-  setTargetRegs(&newRegs);
-  
-  
-  //and run the code
-  continuePtrace();
-  wait(NULL);
-  getTargetRegs(&newRegs);//get the return value from the syscall
-  word_t retval=REG_AX(newRegs);
-  if((void*)retval==NULL)
+void mallocTargetMany(word_t* sizes,addr_t* results,int numObjects)
+{
+  if(!mallocAddress)
   {
-    death("malloc in target of size %i failed\n",len);
+    death("location of malloc is unknown\n");
+  }
+  remoteCallOverArray(mallocAddress,sizes,(word_t*)results,numObjects);
+  for(int i=0;i<numObjects;i++)
+  {
+    if(!results[i])
+    {
+      death("malloc in target of size %zu failed\n",(size_t)sizes[i]);
+    }
+    recordTargetAllocation(results[i],sizes[i],false);
   }
-  //printf("now at eip 0x%x\n",newRegs.eip);
-  //restore the old code
-  memcpyToTarget(modifyTextLocation,oldText,CODE_LEN);
-  //restore the old registers
-  setTargetRegs(&oldRegs);
-  return retval;
 }
 
 //allocate a region of memory in the target
@@ -407,101 +1812,17 @@ addr_t mallocTarget(word_t len)
 //to mmap in at that address but does not pass MAP_FIXED
 addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress)
 {
-  printf("requesting mmap of page of size %zi\n",size);
-  //map code influenced by code from livepatch
-  //http://ukai.jp/Software/livepatch
-
-  #ifdef KATANA_X86_ARCH
-  //0xcd indicates a trap
-  //0x80 indicates that this trap is a syscall
-  //0xcc is int3 instruction, will cause the target
-  //to halt execution until the controlling process calls wait
-  byte code[]={0xcd,0x80,0xcc,0x00};
-  #elif defined(KATANA_X86_64_ARCH)
-  //x86_64 uses the new syscall instruction
-  byte code[]={0x0f,0x05,0xcc,0x00};
-  #else
-  #error Unknown architecture
-  #endif
-
-  
-  struct user_regs_struct oldRegs,newRegs;
-  getTargetRegs(&oldRegs);
-  newRegs=oldRegs;
-  //we're going to throw the parameters to this syscall
-  //as well as the code itself on the stack
-  //note that this approach requires an executable stack.
-  //if we didn't have an executable stack we could temporarily replace
-  //code in the text segment at the program counter
-  REG_SP(newRegs)-=sizeof(int);
-  byte code4Bytes[4];
-  memcpy(&code4Bytes,code,4);
-  //printf("inserting code at eip 0x%x\n",newRegs.eip);
-  byte oldText[4];
-  memcpyFromTarget(oldText,REG_IP(newRegs),4);
-  memcpyToTarget(REG_IP(newRegs),code4Bytes,4);
-  printf("inserted syscall call\n");
-  word_t returnAddr=REG_IP(newRegs)+2;//the int3 instruction
-
-  
-  //the call we want to make is
-  //mmap(NULL,size,prot,MAP_PRIVATE|MAP_ANONYMOUS,-1,0)
-  //mmap in libc is just a wrapper over a kernel call
-#ifdef KATANA_X86_ARCH
-  //we have a lot to put on the stack
-  modifyTarget(REG_SP(newRegs)-=4,0);
-  modifyTarget(REG_SP(newRegs)-=4,-1);
-  modifyTarget(REG_SP(newRegs)-=4,MAP_PRIVATE|MAP_ANONYMOUS);
-  modifyTarget(REG_SP(newRegs)-=4,prot);
-  modifyTarget(REG_SP(newRegs)-=4,size);
-  modifyTarget(REG_SP(newRegs)-=4,(word_t)desiredAddress);
-  printf("inserted syscall params on stack\n");
-  modifyTarget(REG_SP(newRegs)-=sizeof(addr_t),returnAddr);
-  REG_BX(newRegs)=REG_SP(newRegs)+sizeof(addr_t);//syscall, takes arguments in registers,
-                            //this is a pointer to the arguments on the stack
-  REG_AX(newRegs)=SYS_mmap;//syscall number to identify that this is an mmap call
-  printf("%lx\n",REG_AX(newRegs));
-#elif defined(KATANA_X86_64_ARCH)
-  printf("64-bit arch\n");
-  REG_DI(newRegs)=(word_t)desiredAddress;
-  REG_SI(newRegs)=size;
-  REG_DX(newRegs)=prot;
-  REG_CX(newRegs)=MAP_PRIVATE|MAP_ANONYMOUS;
-  REG_8(newRegs)=-1;
-  REG_9(newRegs)=0;
-  REG_10(newRegs)=REG_CX(newRegs);
-  modifyTarget(REG_SP(newRegs)-=sizeof(addr_t),returnAddr);
-  REG_AX(newRegs)=SYS_mmap;//syscall number to identify that this is an mmap call
-  printf("%llx\n",REG_AX(newRegs));
-#else
-#error Unsupported architecture
-#endif
-
-  
-
-  
-  //now actually tell the process about these registers
-  setTargetRegs(&newRegs);
-  
-  //and run the code
-  continuePtrace();
-  wait(NULL);
-  getTargetRegs(&newRegs);//get the return value from the syscall
-  word_t retval=REG_AX(newRegs);
-  if((void*)retval==MAP_FAILED)
-  {
-    fprintf(stderr,"mmap in target failed\n");
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"requesting mmap of %zu bytes\n",(size_t)size);
+  RemoteCall call;
+  setRemoteMmap(&call,size,prot,0,desiredAddress);
+  remoteCallBatch(&call,1);
+  if(isRemoteSyscallError(call.result))
+  {
+    fprintf(stderr,"mmap in target failed with errno %i\n",(int)-call.result);
     death(NULL);
   }
-  //printf("now at eip 0x%x\n",REG_IP(newRegs));
-  #ifndef OLD_MMAP_TARGET
-  //restore the old code
-  memcpyToTarget(REG_IP(oldRegs),oldText,4);
-  #endif
-  //restore the old registers
-  setTargetRegs(&oldRegs);
-  printf("mmapped in new page successfully\n");
-  return retval;
+  recordTargetAllocation(call.result,size,true);
+  return call.result;
 }
 
 
@@ -529,18 +1850,19 @@ void setBreakpoint(addr_t loc)
     breakpointRestoreInfo=size_tMapCreate(100);//todo: get rid of arbitrary size 100
   }
   BreakpointRestoreInfo* restore=zmalloc(sizeof(BreakpointRestoreInfo));
-  memcpyFromTarget(restore->origCode,loc,4);
+  peekTarget(&restore->origCode,loc,1);
   addr_t* key=zmalloc(sizeof(addr_t));
   *key=loc;
   mapInsert(breakpointRestoreInfo,key,restore);
-  byte code[]={0xcc,0x90,0x90,0x90};//int3 followed by nops to make it
-                                    //word-aligned (todo: perhaps not
-                                    //necessary, I think
-                                    //memcpyToTarget already makes
-                                    //things word-aligned)
-  memcpyToTarget(loc,code,4);//todo: 8 not 4 for 64 bit
+  //pokeTargetCode writes exactly the bytes we give it,
+  //so the int3 is all that has to change. The breakpoint has to
+  //take effect now, not when a pending transaction is committed
+  byte int3=0xcc;
+  pokeTargetCode(loc,&int3,1);
 }
 
+static void rewindThreadsAtBreakpoint(addr_t loc);
+
 void removeBreakpoint(addr_t loc)
 {
   assert(breakpointRestoreInfo);
@@ -549,15 +1871,160 @@ void removeBreakpoint(addr_t loc)
   {
     death("No breakpoint was set at address 0x%x, cannot remove it\n",loc);
   }
-  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring breakpoint, copying 0x{%x,%x,%x,%x} to 0x%x\n",restore->origCode[0],restore->origCode[1],restore->origCode[2],restore->origCode[3],(uint)loc);
-  memcpyToTarget(loc,restore->origCode,4);//todo: diff for 64-bit
-  struct user_regs_struct regs;
-  getTargetRegs(&regs);
-  if(REG_IP(regs)==loc+1)
+  logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring breakpoint, copying 0x%x to 0x%x\n",(uint)restore->origCode,(uint)loc);
+  pokeTargetCode(loc,&restore->origCode,1);
+  mapRemove(breakpointRestoreInfo,&loc,free,free);
+  rewindThreadsAtBreakpoint(loc);
+}
+
+//once the int3 at loc is gone, send any stopped thread which hit it
+//back to loc to run what is there now
+static void rewindThreadsAtBreakpoint(addr_t loc)
+{
+  //any number of threads may have hit it
+  for(int i=0;i<numThreads;i++)
+  {
+    if(threads[i].running)
+    {
+      continue;
+    }
+    struct user_regs_struct regs;
+    getThreadRegs(threads[i].tid,&regs);
+    if(REG_IP(regs)==loc+1)
+    {
+      //we just hit this breakpoint, move pack the pc so we can execute the instruction normally
+      logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring program counter of thread %i to 0x%x\n",threads[i].tid,(uint)loc);
+      REG_IP(regs)=loc;
+      setThreadRegs(threads[i].tid,&regs);
+    }
+  }
+}
+
+//where writeTargetCodeLive has put code since the last
+//finishLiveCodeWrites
+static addr_t* liveCodeWrites=NULL;
+static int numLiveCodeWrites=0;
+
+bool canWriteTargetCodeLive()
+{
+  return memFd>=0;
+}
+
+//stops every thread and lets it go again. Each of them goes through
+//the kernel and back, which serializes the core it runs on, so none
+//can still be running from an old view of code written before this.
+//Threads that hit one of the int3s at sites go back to it, the int3
+//is still there and they will just stop on it again
+static void serializeTargetThreads(TargetIOVec* sites,int numSites)
+{
+  stopAllThreads();
+  for(int i=0;i<numSites;i++)
+  {
+    rewindThreadsAtBreakpoint(sites[i].addr);
+  }
+  continueAllThreads(NULL,0);
+}
+
+void writeTargetCodeLive(TargetIOVec* vecs,int numVecs)
+{
+  assert(memFd>=0);
+  if(!numVecs)
+  {
+    return;
+  }
+  if(!breakpointRestoreInfo)
+  {
+    breakpointRestoreInfo=size_tMapCreate(100);
+  }
+  liveCodeWrites=realloc(liveCodeWrites,(numLiveCodeWrites+numVecs)*sizeof(addr_t));
+  MALLOC_CHECK(liveCodeWrites);
+  for(int i=0;i<numVecs;i++)
+  {
+    assert(vecs[i].len>1);
+    //a thread stopped on the int3 is one of ours (see threadAtBreakpoint)
+    BreakpointRestoreInfo* restore=zmalloc(sizeof(BreakpointRestoreInfo));
+    restore->origCode=vecs[i].data[0];
+    addr_t* key=zmalloc(sizeof(addr_t));
+    *key=vecs[i].addr;
+    mapInsert(breakpointRestoreInfo,key,restore);
+    liveCodeWrites[numLiveCodeWrites++]=vecs[i].addr;
+    invalidateCachedRange(vecs[i].addr,vecs[i].len);
+  }
+
+  //each of these is a single write to /proc/<pid>/mem, which is never
+  //torn within a byte. Only the first byte is ever executed on its
+  //own. Another core is not guaranteed to see the writes in order
+  //unless it serializes in between (a jmp opcode with a stale
+  //displacement, say), so every thread is made to between the steps
+  byte int3=0xcc;
+  for(int i=0;i<numVecs;i++)
+  {
+    if(!procMemTransfer(vecs[i].addr,&int3,1,true))
+    {
+      death("Could not write code at 0x%zx while the target runs\n",(size_t)vecs[i].addr);
+    }
+  }
+  serializeTargetThreads(vecs,numVecs);
+  for(int i=0;i<numVecs;i++)
+  {
+    if(!procMemTransfer(vecs[i].addr+1,vecs[i].data+1,vecs[i].len-1,true))
+    {
+      death("Could not write code at 0x%zx while the target runs\n",(size_t)vecs[i].addr);
+    }
+  }
+  serializeTargetThreads(vecs,numVecs);
+  for(int i=0;i<numVecs;i++)
+  {
+    if(!procMemTransfer(vecs[i].addr,vecs[i].data,1,true))
+    {
+      death("Could not write code at 0x%zx while the target runs\n",(size_t)vecs[i].addr);
+    }
+  }
+  logprintf(ELL_INFO_V2,ELS_HOTPATCH,"wrote code at %i places while the target ran\n",numVecs);
+}
+
+void finishLiveCodeWrites()
+{
+  for(int i=0;i<numLiveCodeWrites;i++)
+  {
+    mapRemove(breakpointRestoreInfo,&liveCodeWrites[i],free,free);
+    rewindThreadsAtBreakpoint(liveCodeWrites[i]);
+  }
+  free(liveCodeWrites);
+  liveCodeWrites=NULL;
+  numLiveCodeWrites=0;
+}
+
+void watchTargetFaults(TargetRange* ranges,int numRanges)
+{
+  free(faultWatchRanges);
+  faultWatchRanges=NULL;
+  numFaultWatchRanges=numRanges;
+  if(numRanges)
+  {
+    faultWatchRanges=zmalloc(numRanges*sizeof(TargetRange));
+    memcpy(faultWatchRanges,ranges,numRanges*sizeof(TargetRange));
+  }
+}
+
+bool getThreadFaultAddress(pid_t tid,addr_t* addr)
+{
+  int idx=findThread(tid);
+  if(idx<0 || !threads[idx].faultAddr)
+  {
+    return false;
+  }
+  *addr=threads[idx].faultAddr;
+  return true;
+}
+
+bool memcpyFromTargetConcurrent(byte* data,addr_t addr,size_t numBytes)
+{
+  struct iovec local={.iov_base=data,.iov_len=numBytes};
+  struct iovec remote={.iov_base=(void*)addr,.iov_len=numBytes};
+  if(process_vm_readv(pid,&local,1,&remote,1,0)==(ssize_t)numBytes)
   {
-    //we just hit this breakpoint, move pack the pc so we can execute the instruction normally
-    logprintf(ELL_INFO_V1,ELS_HOTPATCH,"Restoring program counter to 0x%x\n",(uint)loc);
-    REG_IP(regs)=loc;
-    setTargetRegs(&regs);
+    return true;
   }
+  return memFd>=0 && pread64(memFd,data,numBytes,(off64_t)addr)==(ssize_t)numBytes;
 }
@@ -70,16 +70,95 @@
 //#include <sys/user.h>
 
 //this must be called before any other functions in this file
+//attaches to every thread of the process and leaves them all stopped
 void startPtrace(int pid);
 
+//names the target without attaching to it, so its memory can be read
+//(memcpyFromTarget and friends) while it keeps running. Used to work
+//out as much of a patch as possible before the target is stopped.
+//Nothing read before startPtrace is cached
+void setTargetPid(int pid);
+//the pid given to setTargetPid or startPtrace
+int getTargetPid();
+
+//continues only the main thread, the others stay stopped. For
+//running code katana places in the target (see remotecall.h)
 void continuePtrace();
+//after continuePtrace, waits for the main thread to stop with a
+//SIGTRAP. If it hasn't after timeoutMillis it is stopped with a
+//SIGSTOP wherever it is and false is returned. Signals meant for the
+//program are kept for it either way
+bool waitForTargetTrap(int timeoutMillis);
 void endPtrace(bool stopProcess);
+
+//Threads. Threads the target creates while we're attached are traced
+//automatically, and signals that arrive for the program while we
+//hold a thread are delivered when it is continued.
+
+//the tids of all of the target's threads, the main thread first.
+//The caller must free the array
+pid_t* getTargetThreadIds(int* num);
+//stops every thread of the target that is running and waits until
+//they have all stopped
+void stopAllThreads();
+//continues every stopped thread except the numExcept given in except
+void continueAllThreads(pid_t* except,int numExcept);
+//blocks until a thread hits one of our breakpoints or timeoutMillis
+//have passed. Returns the thread's tid (that thread is now stopped,
+//the others keep running) or 0 on timeout. Everything else that
+//happens to the threads meanwhile is dealt with
+pid_t waitForTargetBreakpoint(int timeoutMillis);
+//addresses [low,high) in the target
+typedef struct
+{
+  addr_t low;
+  addr_t high;
+} TargetRange;
+//from now on a SIGSEGV on an address in any of the ranges is taken to
+//be meant for us rather than the program: waitForTargetBreakpoint
+//reports the thread as it would one at a breakpoint, and when
+//continued the thread is not sent the signal, so it makes the same
+//access again. Faults anywhere else still go to the program. The
+//ranges are copied, replacing any watched before. numRanges 0 stops
+//watching
+void watchTargetFaults(TargetRange* ranges,int numRanges);
+//if tid was last stopped by a watched fault, sets addr to the address
+//it faulted on and returns true
+bool getThreadFaultAddress(pid_t tid,addr_t* addr);
+
+//one range of a scatter/gather transfer to or from the target
+typedef struct
+{
+  addr_t addr;//address in the target
+  byte* data;//buffer in katana
+  size_t len;
+} TargetIOVec;
+
+//Changing code while the target runs. Each range must cover exactly
+//one instruction at least two bytes long (a multi-byte nop, say), so
+//that no thread can be part of the way through it. An int3 goes over
+//the first byte of each, then the rest of the new code is written,
+//then the first bytes, so no thread ever runs a mix of old and new
+//bytes. All the threads are briefly stopped between these steps so
+//that every core sees each one whole before the next. A thread
+//reaching a range meanwhile stops at the int3. The target must be
+//running when this is called and is left running. Once it is stopped
+//again finishLiveCodeWrites sends threads on an int3 back to run the
+//new code.
+//Only possible if canWriteTargetCodeLive (it needs /proc/<pid>/mem)
+bool canWriteTargetCodeLive();
+void writeTargetCodeLive(TargetIOVec* vecs,int numVecs);
+void finishLiveCodeWrites();
 void modifyTarget(addr_t addr,word_t value);
+
 //copies numBytes from data to addr in target
-//todo: does addr have to be aligned
+//addr does not have to be aligned
 void memcpyToTarget(addr_t addr,byte* data,int numBytes);
 //copies numBytes to data from addr in target
-//todo: does addr have to be aligned
+//addr does not have to be aligned
+//Small reads are served from a cache of whole target pages which is
+//emptied whenever the target is continued, so repeated reads of the
+//same structures while the target is stopped are cheap
 void memcpyFromTarget(byte* data,long addr,int numBytes);
 
 //like memcpyFromTarget except doesn't kill katana
@@ -87,8 +166,60 @@ void memcpyFromTarget(byte* data,long addr,int numBytes);
 //returns true if it succeseds
 bool memcpyFromTargetNoDeath(byte* data,long addr,int numBytes);
 
+//copies all of the given ranges into the target. As few syscalls as
+//possible are used (process_vm_writev), ptrace is only used for pages
+//the kernel won't let us write that way
+void memcpyToTargetVec(TargetIOVec* vecs,int numVecs);
+
+//copies all of the given ranges into read-only code pages in the
+//target with positional writes to /proc/<pid>/mem. Each run of
+//adjacent ranges costs one syscall regardless of size or alignment.
+//vecs is sorted by address as a side effect
+void memcpyToTargetCodeVec(TargetIOVec* vecs,int numVecs);
+void memcpyToTargetCode(addr_t addr,byte* data,int numBytes);
+
+//qsort comparator ordering TargetIOVecs by target address
+int cmpTargetIOVecByAddr(const void* a,const void* b);
+
+//fills all of the given ranges from the target in as few syscalls as possible
+//returns false if any of them could not be read
+bool memcpyFromTargetVecNoDeath(TargetIOVec* vecs,int numVecs);
+
+//Transactions. Between beginTargetTransaction and
+//commitTargetTransaction the memcpyToTarget family of functions do
+//not touch the target. Writes are recorded (overlapping and adjacent
+//writes merged) and flushed with as few syscalls as possible on
+//commit. Reads from the target during a transaction see the pending
+//writes. The original contents of everything written are remembered
+//so the most recently committed transaction can be undone.
+//Temporary code katana runs in the target (mallocTarget, mmapTarget)
+//and breakpoints bypass the transaction. Memory those allocate while
+//it is open is munmapped or freed again if it is aborted or undone.
+void beginTargetTransaction();
+void commitTargetTransaction();
+//throws away the pending writes without making them
+void abortTargetTransaction();
+//restores the target memory touched by the last committed transaction
+void undoTargetTransaction();
+bool inTargetTransaction();
+
+//write or read target memory right away, bypassing any open
+//transaction and the page cache. For the temporary code and
+//breakpoints katana places in the target, which must take effect
+//immediately. Both die on failure
+void pokeTargetCode(addr_t addr,byte* data,int numBytes);
+void peekTarget(byte* data,addr_t addr,int numBytes);
+
+//registers of the main thread
 void getTargetRegs(struct user_regs_struct* regs);
 void setTargetRegs(struct user_regs_struct* regs);
+void getThreadRegs(pid_t tid,struct user_regs_struct* regs);
+void setThreadRegs(pid_t tid,struct user_regs_struct* regs);
+
+//reads target memory without ptrace or the page cache, so unlike
+//everything else here it may be called from any katana thread.
+//Returns false if the memory could not be read
+bool memcpyFromTargetConcurrent(byte* data,addr_t addr,size_t numBytes);
 //allocate a region of memory in the target
 //return the address (in the target) of the region
 //or NULL if the operation failed
@@ -96,9 +227,22 @@ addr_t mmapTarget(word_t size,int prot,addr_t desiredAddress);
 
 //must be called before any calls to mallocTarget
 void setMallocAddress(addr_t addr);
-//must be called before any calls to mallocTarget
+//where free is in the target. Without it objects malloc'd during a
+//transaction that is backed out are left allocated
+void setFreeAddress(addr_t addr);
+//for memory mapped in the target by remote calls other than
+//mmapTarget: has it unmapped if the open transaction is backed out
+void recordTargetMapping(addr_t addr,word_t size);
+//the start of the target's text is where code for calls made in
+//the target (mallocTarget, mmapTarget, see remotecall.h) is placed.
+//If it isn't set the current instruction pointer is used
 void setTargetTextStart(addr_t addr);
 addr_t mallocTarget(word_t len);
+//mallocs numObjects objects in the target, the ith of size
+//sizes[i], storing the address of each in results. Each object is
+//a separate malloc, so the target may later free them individually,
+//but the whole lot costs only a few round trips
+void mallocTargetMany(word_t* sizes,addr_t* results,int numObjects);
 
 //compare a string to a string located
 //at a certain address in the target
@@ -107,5 +251,7 @@ addr_t mallocTarget(word_t len);
 bool strnmatchTarget(char* str,addr_t strInTarget);
 
 void setBreakpoint(addr_t loc);
+//removes the breakpoint, winding back any stopped thread that has
+//just hit it so that it executes the original instruction
 void removeBreakpoint(addr_t loc);
 #endif
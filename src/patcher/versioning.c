@@ -96,7 +96,7 @@ ElfInfo* getElfRepresentingProc(int pid)
   return result;
 }
 
-char* createKatanaDirs(int pid,int version)
+char* getKatanaPidDir(int pid)
 {
   //todo: error checking
   char buf1[128];
@@ -108,11 +108,19 @@ char* createKatanaDirs(int pid,int version)
   mkdir(buf2,mode);
   snprintf(buf2,256,"%s/patched/%i",buf1,pid);
   mkdir(buf2,mode);
-  snprintf(buf2,256,"%s/patched/%i/%i",buf1,pid,version);
-  mkdir(buf2,mode);
   return strdup(buf2);
 }
 
+char* createKatanaDirs(int pid,int version)
+{
+  char* pidDir=getKatanaPidDir(pid);
+  char buf[256];
+  snprintf(buf,256,"%s/%i",pidDir,version);
+  free(pidDir);
+  mkdir(buf,S_IRWXU);
+  return strdup(buf);
+}
+
 int calculateVersionAfterPatch(int pid,ElfInfo* patch)
 {
   //todo: versioning (hardcoded patching to version 1 here)
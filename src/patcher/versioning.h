@@ -60,4 +60,7 @@ ElfInfo* getElfRepresentingProc(int pid);
 int calculateVersionAfterPatch(int pid,ElfInfo* patch);
 char* getVersionStringOfPatchSections();
 char* createKatanaDirs(int pid,int version);
+//directory where katana keeps everything about the process pid,
+//created if necessary. Should be freed
+char* getKatanaPidDir(int pid);
 #endif
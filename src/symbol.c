@@ -56,10 +56,12 @@
 #include "symbol.h"
 #include <assert.h>
 #include "util/util.h"
+#include "util/hash.h"
 #include "util/logging.h"
 #include <string.h>
 #include "patcher/versioning.h"
 #include "elfutil.h"
+#include "util/cxxutil.h"
 
 void getSymbol(ElfInfo* e,int symIdx,GElf_Sym* outSym)
 {
@@ -81,193 +83,561 @@ addr_t getSymAddress(ElfInfo* e,int symIdx)
   return sym.st_value;
 }
 
-char* unmangleSymbolName(char* name)
+//open-addressed table of indices (plus one, zero marks an empty
+//slot) into some array, by the hash of some key. Keys aren't stored,
+//so the caller checks every hit against the array itself
+typedef struct
 {
-  char* symbolNameUnmangled=NULL;
-  char* atSignPtr=strchr(name,'@');
-  if(atSignPtr)
+  idx_t* slots;
+  uint64_t* hashes;
+  uint capacity;//always a power of two
+  uint numEntries;
+} SymbolSlotTable;
+
+static size_t symbolNameKeyLen(char* name,bool unversioned)
+{
+  return unversioned?strcspn(name,"@"):strlen(name);
+}
+
+static void insertSymbolSlot(SymbolSlotTable* table,idx_t slotValue,uint64_t hash)
+{
+  uint mask=table->capacity-1;
+  uint i=hash & mask;
+  while(table->slots[i])
   {
-    symbolNameUnmangled=zmalloc(strlen(name)+1);
-    int atSignIdx=atSignPtr-name;
-    strcpy(symbolNameUnmangled,name);
-    symbolNameUnmangled[atSignIdx]='\0';
+    i=(i+1) & mask;
   }
-  else
+  table->slots[i]=slotValue;
+  table->hashes[i]=hash;
+  table->numEntries++;
+}
+
+static void growSymbolSlots(SymbolSlotTable* table,uint minEntries)
+{
+  uint capacity=table->capacity?table->capacity:64;
+  while(capacity<minEntries*2)
   {
-    symbolNameUnmangled=strdup(name);
+    capacity*=2;
   }
-  return symbolNameUnmangled;
+  if(capacity==table->capacity)
+  {
+    return;
+  }
+  idx_t* oldSlots=table->slots;
+  uint64_t* oldHashes=table->hashes;
+  uint oldCapacity=table->capacity;
+  table->slots=zmalloc(capacity*sizeof(idx_t));
+  table->hashes=zmalloc(capacity*sizeof(uint64_t));
+  table->capacity=capacity;
+  table->numEntries=0;
+  for(uint i=0;i<oldCapacity;i++)
+  {
+    if(oldSlots[i])
+    {
+      insertSymbolSlot(table,oldSlots[i],oldHashes[i]);
+    }
+  }
+  free(oldSlots);
+  free(oldHashes);
 }
 
-//find the symbol matching the given symbol
-//e is the binary we're looking in
-//ref is the elf object this symbol is in right now
-idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
+static void freeSymbolSlots(SymbolSlotTable* table)
 {
-  idx_t retval=STN_UNDEF;
-  Elf_Data* symTabData=NULL;
-  char* (*getstrfunc)(ElfInfo*,int)=NULL;
-  if(flags & ESFF_NEW_DYNAMIC)
+  free(table->slots);
+  free(table->hashes);
+}
+
+//one distinct symbol name in an ElfInfo. Every name is stored once
+//no matter how many symbols or string table offsets share it, so
+//names from the same ElfInfo are equal exactly when their
+//InternedName pointers are
+typedef struct InternedName
+{
+  uint id;//position in the pool
+  char* name;//our own copy, string tables move as entries are added
+  uint len;
+  uint64_t hash;
+  struct InternedName* unversioned;//the name up to any '@', itself if there is none
+  //lowest index plus one in .symtab/.dynsym of a symbol with exactly this name
+  idx_t firstSymbol[2];
+  //the same, for symbols whose name up to any '@' is this
+  idx_t firstUnversionedSymbol[2];
+  char* demangled;//NULL until someone asks for it
+} InternedName;
+
+struct SymbolNamePool
+{
+  InternedName** names;
+  uint numNames;
+  uint namesCapacity;
+  SymbolSlotTable byContent;
+  //from offsets in .strtab/.dynstr. String table entries are never
+  //rewritten, so the offset itself is the key
+  SymbolSlotTable byOffset[2];
+  //how many .symtab/.dynsym entries have had firstSymbol filled in
+  uint numIndexed[2];
+};
+
+static struct SymbolNamePool* getSymbolNamePool(ElfInfo* e)
+{
+  if(!e->symbolNamePool)
   {
-    symTabData=getDataByERS(e,ERS_DYNSYM);
-    getstrfunc=&getDynString;
+    e->symbolNamePool=zmalloc(sizeof(struct SymbolNamePool));
   }
-  else
+  return e->symbolNamePool;
+}
+
+//finds the name without adding it, NULL if nothing in e has it
+static InternedName* findInternedName(ElfInfo* e,char* name,uint len)
+{
+  struct SymbolNamePool* pool=getSymbolNamePool(e);
+  SymbolSlotTable* table=&pool->byContent;
+  if(!table->capacity)
   {
-    symTabData=getDataByERS(e,ERS_SYMTAB);
-    getstrfunc=&getString;
+    return NULL;
   }
-  char* symbolName=getString(ref,sym->st_name);//todo not supporting ESFF_OLD_DYNAMIC yet
-  char* symbolNameUnmangled=symbolName;
-  if(flags & ESFF_MANGLED_OK)
+  uint64_t hash=hashBytes((unsigned char*)name,len);
+  uint mask=table->capacity-1;
+  for(uint i=hash & mask;table->slots[i];i=(i+1) & mask)
   {
-    symbolNameUnmangled=unmangleSymbolName(symbolName);
+    InternedName* interned=pool->names[table->slots[i]-1];
+    if(table->hashes[i]==hash && interned->len==len && !memcmp(interned->name,name,len))
+    {
+      return interned;
+    }
   }
-  char* symbolNameDot=zmalloc(strlen(symbolName)+2);//for --fdata-sections and --ffunction-sections
-  strcpy(symbolNameDot,".");
-  strcat(symbolNameDot,symbolName);
-  //traverse the symbol table to find the symbol we're looking for. Yes this is slow
-  //todo: build our own hash table since the .hash section seems incomplete
-  //start at 1 because never trying to match symbol 0
-   int bind=ELF64_ST_BIND(sym->st_info);
-   int type=ELF64_ST_TYPE(sym->st_info);
-  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
-  for (int i = 1; i < numEntries; ++i)
+  return NULL;
+}
+
+static InternedName* internName(ElfInfo* e,char* name,uint len)
+{
+  InternedName* interned=findInternedName(e,name,len);
+  if(interned)
   {
-    ElfXX_Sym sym2;
-    //get the symbol in an unsafe manner because
-    //we may be getting it from a data buffer we're in the process of filling
-    memcpy(&sym2,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
-    char* symname=(*getstrfunc)(e, sym2.st_name);
-    int bind2=ELFXX_ST_BIND(sym2.st_info);
-    int type2=ELFXX_ST_TYPE(sym2.st_info);
-    char* symnameUnmangled=unmangleSymbolName(symname);
-    //todo: bug with symbols with names substrings of other names, need to properly unmangle symname
-    if( (STT_SECTION==type && STT_SECTION==type2) ||
-       (!symname && !symbolName) ||
-       (!symname && !strlen(symbolName)) ||
-       (!strlen(symname) && !symbolName) ||
-       (symname && symbolName && !strcmp(symnameUnmangled,symbolNameUnmangled)))
+    return interned;
+  }
+  struct SymbolNamePool* pool=getSymbolNamePool(e);
+  if(pool->numNames==pool->namesCapacity)
+  {
+    pool->namesCapacity=pool->namesCapacity?pool->namesCapacity*2:256;
+    pool->names=realloc(pool->names,pool->namesCapacity*sizeof(InternedName*));
+    MALLOC_CHECK(pool->names);
+  }
+  interned=zmalloc(sizeof(InternedName));
+  interned->id=pool->numNames;
+  interned->name=zmalloc(len+1);
+  memcpy(interned->name,name,len);
+  interned->len=len;
+  interned->hash=hashBytes((unsigned char*)name,len);
+  pool->names[pool->numNames++]=interned;
+  growSymbolSlots(&pool->byContent,pool->byContent.numEntries+1);
+  insertSymbolSlot(&pool->byContent,interned->id+1,interned->hash);
+  uint unversionedLen=symbolNameKeyLen(interned->name,true);
+  interned->unversioned=unversionedLen==len?interned:internName(e,name,unversionedLen);
+  return interned;
+}
+
+//intern the name at the given offset of .strtab (or .dynstr if dynamic)
+static InternedName* internSymbolName(ElfInfo* e,bool dynamic,uint nameOffset)
+{
+  struct SymbolNamePool* pool=getSymbolNamePool(e);
+  SymbolSlotTable* table=&pool->byOffset[dynamic];
+  if(table->capacity)
+  {
+    uint mask=table->capacity-1;
+    for(uint i=nameOffset & mask;table->slots[i];i=(i+1) & mask)
     {
-      free(symnameUnmangled);
-      if(symname && strlen(symname))
+      if(table->hashes[i]==nameOffset)
       {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] matches %s, has name %s\n",i,symbolName,symname);
-      }
-      else
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] both have no name. They might be the same section\n",i);
-      }
-      //ok, the right name, but are other things right too?
-     
-      
-      if(bind != bind2)
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on bind\n");
-        continue;
-      }
-      if(type!= STT_NOTYPE && type2!=STT_NOTYPE && type != type2)
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on type\n");
-        continue;
+        return pool->names[table->slots[i]-1];
       }
+    }
+  }
+  char* name=dynamic?getDynString(e,nameOffset):getString(e,nameOffset);
+  if(!name)
+  {
+    //a string table that is still empty (see createSections) has no
+    //buffer yet. The linear scans took such a name to match an empty one
+    name="";
+  }
+  InternedName* interned=internName(e,name,strlen(name));
+  growSymbolSlots(table,table->numEntries+1);
+  insertSymbolSlot(table,interned->id+1,nameOffset);
+  return interned;
+}
 
-      //don't match on size because the size of a variable may
-      //have changed
-      
-      if(sym->st_other!=sym2.st_other)
-      {
-        logprintf(ELL_INFO_V2,ELS_SYMBOL,"fails on other\n");
-        continue;
-      }
-      //now the hard one to deal with: section index. This is especially
-      //important to deal with for section symbols though as there may be no other
-      //means of differentiating them
-      int shndxRef=sym->st_shndx;
-      int shndxNew=sym2.st_shndx;
-      //allowing undefined to be a wildcard because may be bringing
-      //in a symbol from a relocatable object
-      //also allowing imprecise matching on common,
-      //because symbols may be common in a .o file and then
-      //get put in a section in the fully linked binary
-      if(shndxRef!=SHN_UNDEF && shndxNew!=SHN_UNDEF &&
-         shndxRef!=SHN_COMMON && shndxNew!=SHN_COMMON)
+static void freeSymbolNamePool(struct SymbolNamePool* pool)
+{
+  if(pool)
+  {
+    for(uint i=0;i<pool->numNames;i++)
+    {
+      free(pool->names[i]->name);
+      free(pool->names[i]->demangled);
+      free(pool->names[i]);
+    }
+    free(pool->names);
+    freeSymbolSlots(&pool->byContent);
+    freeSymbolSlots(&pool->byOffset[0]);
+    freeSymbolSlots(&pool->byOffset[1]);
+    free(pool);
+  }
+}
+
+//gets the name of the symbol in .symtab, demangled if it is a C++
+//name. Each name is only demangled once, and the result belongs to e
+char* getDemangledSymbolName(ElfInfo* e,idx_t symIdx)
+{
+  GElf_Sym sym;
+  getSymbol(e,symIdx,&sym);
+  InternedName* interned=internSymbolName(e,false,sym.st_name);
+  if(!interned->demangled)
+  {
+    if(interned->name[0]=='_' && interned->name[1]=='Z')
+    {
+      //the name is a C++ mangled name, or at least it very likely is
+      //(there is of course nothing stopping someone from naming a
+      //function starting with _Z in C).
+      interned->demangled=demangleName(interned->name);
+    }
+    else
+    {
+      interned->demangled=strdup(interned->name);
+    }
+  }
+  return interned->demangled;
+}
+
+//what findSymbol needs to know about one candidate symbol, worked
+//out once when the symbol is first indexed. Symbols in the tables
+//we search are only ever appended, never rewritten, so this doesn't
+//go stale
+typedef struct
+{
+  idx_t idx;
+  InternedName* name;//up to any '@'
+  byte bind;
+  byte type;
+  byte other;
+  bool hasScnName;//false for reserved section indices
+  int shndx;
+  uint scnNameOffset;
+  uint scnNameLen;//with the symbol name and version stripped
+  uint nextSameName;//entry index plus one, zero ends the chain
+} MatcherSymbol;
+
+//per (ElfInfo, symbol table, section versioning) state for
+//findSymbol. Candidates are chained by unversioned name, with the
+//heads of the chains in nameTable. Section symbols can match each
+//other whatever their names, so they're also kept in their own list
+struct SymbolMatcher
+{
+  char* versionSuffix;//".new" if section versions are stripped, else NULL
+  uint numIndexed;//how many entries of the symbol table have been seen
+  MatcherSymbol* symbols;
+  uint numSymbols;
+  uint symbolsCapacity;
+  SymbolSlotTable nameTable;
+  uint* sectionSymbols;
+  uint numSectionSymbols;
+  uint sectionSymbolsCapacity;
+};
+
+//length of the section name once the ".symname" that
+//-ffunction-sections and -fdata-sections add is stripped, as well
+//as the patch version if versionSuffix is not NULL
+static uint canonicalSectionNameLen(char* scnName,char* symName,uint symNameLen,
+                                    char* versionSuffix)
+{
+  uint len=strlen(scnName);
+  if(len>symNameLen && scnName[len-symNameLen-1]=='.' &&
+     !strncmp(scnName+len-symNameLen,symName,symNameLen))
+  {
+    len-=symNameLen+1;
+  }
+  if(versionSuffix)
+  {
+    uint suffixLen=strlen(versionSuffix);
+    if(len>=suffixLen && !strncmp(scnName+len-suffixLen,versionSuffix,suffixLen))
+    {
+      len-=suffixLen;
+    }
+  }
+  return len;
+}
+
+//returns NULL for section indices that don't name real sections
+static char* getSymbolSectionName(ElfInfo* e,int shndx)
+{
+  if(SHN_UNDEF==shndx || shndx>=SHN_LORESERVE)
+  {
+    return NULL;
+  }
+  Elf_Scn* scn=elf_getscn(e->e,shndx);
+  assert(scn);
+  GElf_Shdr shdr;
+  gelf_getshdr(scn,&shdr);
+  return getScnHdrString(e,shdr.sh_name);
+}
+
+static bool hasPrefix(char* str,uint len,char* prefix)
+{
+  uint prefixLen=strlen(prefix);
+  return len>=prefixLen && !strncmp(str,prefix,prefixLen);
+}
+
+static void addMatcherSymbol(struct SymbolMatcher* matcher,ElfInfo* e,bool dynamic,
+                             ElfXX_Sym* sym,idx_t idx)
+{
+  if(matcher->numSymbols==matcher->symbolsCapacity)
+  {
+    matcher->symbolsCapacity=matcher->symbolsCapacity?matcher->symbolsCapacity*2:256;
+    matcher->symbols=realloc(matcher->symbols,matcher->symbolsCapacity*sizeof(MatcherSymbol));
+    MALLOC_CHECK(matcher->symbols);
+  }
+  uint entryIdx=matcher->numSymbols++;
+  MatcherSymbol* ms=&matcher->symbols[entryIdx];
+  memset(ms,0,sizeof(MatcherSymbol));
+  ms->idx=idx;
+  ms->name=internSymbolName(e,dynamic,sym->st_name)->unversioned;
+  ms->bind=ELFXX_ST_BIND(sym->st_info);
+  ms->type=ELFXX_ST_TYPE(sym->st_info);
+  ms->other=sym->st_other;
+  ms->shndx=sym->st_shndx;
+  if(SHN_COMMON!=ms->shndx)
+  {
+    Elf_Scn* scn=SHN_UNDEF==ms->shndx || ms->shndx>=SHN_LORESERVE?NULL:elf_getscn(e->e,ms->shndx);
+    GElf_Shdr shdr;
+    if(scn && gelf_getshdr(scn,&shdr))
+    {
+      ms->hasScnName=true;
+      ms->scnNameOffset=shdr.sh_name;
+      ms->scnNameLen=canonicalSectionNameLen(getScnHdrString(e,shdr.sh_name),ms->name->name,
+                                             ms->name->len,matcher->versionSuffix);
+    }
+  }
+
+  if(STT_SECTION==ms->type)
+  {
+    if(matcher->numSectionSymbols==matcher->sectionSymbolsCapacity)
+    {
+      matcher->sectionSymbolsCapacity=matcher->sectionSymbolsCapacity?matcher->sectionSymbolsCapacity*2:32;
+      matcher->sectionSymbols=realloc(matcher->sectionSymbols,matcher->sectionSymbolsCapacity*sizeof(uint));
+      MALLOC_CHECK(matcher->sectionSymbols);
+    }
+    matcher->sectionSymbols[matcher->numSectionSymbols++]=entryIdx;
+  }
+
+  //chain it onto any other symbols with the same name
+  uint64_t hash=ms->name->hash;
+  SymbolSlotTable* table=&matcher->nameTable;
+  uint mask=table->capacity-1;
+  for(uint i=hash & mask;table->slots[i];i=(i+1) & mask)
+  {
+    if(matcher->symbols[table->slots[i]-1].name==ms->name)
+    {
+      ms->nextSameName=table->slots[i];
+      table->slots[i]=entryIdx+1;
+      return;
+    }
+  }
+  insertSymbolSlot(table,entryIdx+1,hash);
+
+}
+
+static void freeSymbolMatcher(struct SymbolMatcher* matcher)
+{
+  if(matcher)
+  {
+    free(matcher->versionSuffix);
+    free(matcher->symbols);
+    freeSymbolSlots(&matcher->nameTable);
+    free(matcher->sectionSymbols);
+    free(matcher);
+  }
+}
+
+//gets the matcher for e with the given flags, indexing any symbols
+//appended since it was last used
+static struct SymbolMatcher* getSymbolMatcher(ElfInfo* e,int flags)
+{
+  bool dynamic=flags & ESFF_NEW_DYNAMIC;
+  bool versioned=flags & ESFF_VERSIONED_SECTIONS_OK;
+  int whichMatcher=(dynamic?2:0)+(versioned?1:0);
+  Elf_Data* symTabData=getDataByERS(e,dynamic?ERS_DYNSYM:ERS_SYMTAB);
+  uint numSymbols=symTabData->d_size/sizeof(ElfXX_Sym);
+
+  struct SymbolMatcher* matcher=e->symbolMatchers[whichMatcher];
+  if(matcher && numSymbols<matcher->numIndexed)
+  {
+    //the table shrank under us, start over
+    freeSymbolMatcher(matcher);
+    matcher=NULL;
+  }
+  if(!matcher)
+  {
+    matcher=zmalloc(sizeof(struct SymbolMatcher));
+    if(versioned)
+    {
+      char* vers=getVersionStringOfPatchSections();
+      matcher->versionSuffix=zmalloc(strlen(vers)+2);
+      sprintf(matcher->versionSuffix,".%s",vers);
+    }
+    e->symbolMatchers[whichMatcher]=matcher;
+  }
+
+  //never trying to match symbol 0
+  uint firstNew=matcher->numIndexed?matcher->numIndexed:1;
+  if(firstNew>=numSymbols)
+  {
+    return matcher;
+  }
+  growSymbolSlots(&matcher->nameTable,matcher->nameTable.numEntries+numSymbols-firstNew);
+  for(uint i=firstNew;i<numSymbols;i++)
+  {
+    ElfXX_Sym sym;
+    //get the symbol in an unsafe manner because
+    //we may be getting it from a data buffer we're in the process of filling
+    memcpy(&sym,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
+    addMatcherSymbol(matcher,e,dynamic,&sym,i);
+  }
+  matcher->numIndexed=numSymbols;
+  return matcher;
+}
+
+//the symbol being looked for, with everything findSymbol compares
+//worked out up front
+typedef struct
+{
+  char* name;
+  byte bind;
+  byte type;
+  byte other;
+  int shndx;
+  char* scnName;//NULL for reserved section indices
+  uint scnNameLen;
+} SymbolQuery;
+
+static bool matcherSymbolMatches(ElfInfo* e,MatcherSymbol* ms,SymbolQuery* query,int flags)
+{
+  if(query->bind!=ms->bind)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] fails on bind\n",(int)ms->idx);
+    return false;
+  }
+  if(query->type!=STT_NOTYPE && ms->type!=STT_NOTYPE && query->type!=ms->type)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] fails on type\n",(int)ms->idx);
+    return false;
+  }
+  //don't match on size because the size of a variable may
+  //have changed
+  if(query->other!=ms->other)
+  {
+    logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] fails on other\n",(int)ms->idx);
+    return false;
+  }
+
+  //now the hard one to deal with: section index. This is especially
+  //important to deal with for section symbols though as there may be no other
+  //means of differentiating them. Undefined is a wildcard because we
+  //may be bringing in a symbol from a relocatable object, and so is
+  //common because symbols may be common in a .o file and then get
+  //put in a section in the fully linked binary
+  if(SHN_UNDEF==query->shndx || SHN_UNDEF==ms->shndx ||
+     SHN_COMMON==query->shndx || SHN_COMMON==ms->shndx)
+  {
+    return true;
+  }
+  if(!query->scnName || !ms->hasScnName)
+  {
+    //at least one of them is in a reserved section like SHN_ABS
+    return query->shndx==ms->shndx;
+  }
+  char* scnName=getScnHdrString(e,ms->scnNameOffset);
+  if(query->scnNameLen==ms->scnNameLen &&
+     !strncmp(query->scnName,scnName,ms->scnNameLen))
+  {
+    return true;
+  }
+  //we might still be saved by considering data and bss to be the same section
+  if(STT_SECTION!=query->type && (flags & ESFF_BSS_MATCH_DATA_OK) &&
+     ((hasPrefix(query->scnName,query->scnNameLen,".data") &&
+       hasPrefix(scnName,ms->scnNameLen,".bss")) ||
+      (hasPrefix(query->scnName,query->scnNameLen,".bss") &&
+       hasPrefix(scnName,ms->scnNameLen,".data"))))
+  {
+    return true;
+  }
+  logprintf(ELL_INFO_V2,ELS_SYMBOL,"[%i] symbol match fails on section name (%.*s vs %.*s)\n",
+            (int)ms->idx,query->scnNameLen,query->scnName,ms->scnNameLen,scnName);
+  return false;
+}
+
+//find the symbol matching the given symbol
+//e is the binary we're looking in
+//ref is the elf object this symbol is in right now
+//if several symbols match, the one with the highest index wins
+idx_t findSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
+{
+  struct SymbolMatcher* matcher=getSymbolMatcher(e,flags);
+
+  SymbolQuery query;
+  query.name=getString(ref,sym->st_name);//todo not supporting ESFF_OLD_DYNAMIC yet
+  query.bind=ELF64_ST_BIND(sym->st_info);
+  query.type=ELF64_ST_TYPE(sym->st_info);
+  query.other=sym->st_other;
+  query.shndx=sym->st_shndx;
+  query.scnName=NULL;
+  query.scnNameLen=0;
+  if(SHN_COMMON!=query.shndx)
+  {
+    query.scnName=getSymbolSectionName(ref,query.shndx);
+  }
+  if(query.scnName)
+  {
+    query.scnNameLen=canonicalSectionNameLen(query.scnName,query.name,strlen(query.name),
+                                             matcher->versionSuffix);
+  }
+
+  //candidates' names are always compared without their versions,
+  //the name we're looking for only if ESFF_MANGLED_OK. If e has never
+  //seen the name, only section symbols can match
+  idx_t retval=STN_UNDEF;
+  InternedName* name=findInternedName(e,query.name,symbolNameKeyLen(query.name,flags & ESFF_MANGLED_OK));
+  SymbolSlotTable* table=&matcher->nameTable;
+  uint mask=table->capacity-1;
+  for(uint i=name?name->hash & mask:0;name && table->capacity && table->slots[i];i=(i+1) & mask)
+  {
+    if(matcher->symbols[table->slots[i]-1].name!=name)
+    {
+      continue;
+    }
+    for(uint entry=table->slots[i];entry;entry=matcher->symbols[entry-1].nextSameName)
+    {
+      MatcherSymbol* ms=&matcher->symbols[entry-1];
+      if(ms->idx>retval && matcherSymbolMatches(e,ms,&query,flags))
       {
-        Elf_Scn* scnRef=elf_getscn(ref->e,shndxRef);
-        assert(scnRef);
-        Elf_Scn* scnNew=elf_getscn(e->e,shndxNew);
-        assert(scnNew);
-        GElf_Shdr shdrRef;
-        GElf_Shdr shdrNew;
-        gelf_getshdr(scnRef,&shdrRef);
-        gelf_getshdr(scnNew,&shdrNew);
-        char* scnNameRef=strdup(getScnHdrString(ref,shdrRef.sh_name));
-        char* scnNameNew=strdup(getScnHdrString(e,shdrNew.sh_name));
-        //if -fdata-sections or -ffunction-sections is used then
-        //we might have issues with section names having the name of the
-        //var/function appended, so we strip these
-        if(strEndsWith(scnNameRef,symbolNameDot))
-        {
-          scnNameRef[strlen(scnNameRef)-strlen(symbolNameDot)]='\0';
-        }
-        if(strEndsWith(scnNameNew,symbolNameDot))
-        {
-          scnNameNew[strlen(scnNameNew)-strlen(symbolNameDot)]='\0';
-        }
-
-        //also strip versioning from the section names if allowed
-        if(flags & ESFF_VERSIONED_SECTIONS_OK)
-        {
-          char* vers=getVersionStringOfPatchSections();
-          char* buf=zmalloc(strlen(vers)+2);
-          sprintf(buf,".%s",vers);
-          if(strEndsWith(scnNameRef,buf))
-          {
-            scnNameRef[strlen(scnNameRef)-strlen(buf)]='\0';
-          }
-          if(strEndsWith(scnNameNew,buf))
-          {
-            scnNameNew[strlen(scnNameNew)-strlen(buf)]='\0';
-          }
-          free(buf);
-
-        }
-        
-        //printf("old refers to section name %s and new refers to section name %s\n",scnNameRef,scnNameNew);
-        if((scnNameRef && !scnNameNew) || (!scnNameNew && scnNameNew) ||
-           (scnNameRef && scnNameNew && strcmp(scnNameRef,scnNameNew)))
-        {
-          //we might still be saved by considering data and bss to be the same section
-          if(type == STT_SECTION ||
-             (!(flags & ESFF_BSS_MATCH_DATA_OK) ||
-              !((!strncmp(scnNameRef,".data",strlen(".data")) &&
-                 !strncmp(scnNameNew,".bss",strlen(".bss"))) ||
-                (!strncmp(scnNameRef,".bss",strlen(".bss")) &&
-                 !strncmp(scnNameNew,".data",strlen(".data"))))))
-          {
-            logprintf(ELL_INFO_V2,ELS_SYMBOL,"symbol match fails on section name (%s vs %s)\n",scnNameRef,scnNameNew);
-            free(scnNameNew);
-            free(scnNameRef);
-            continue;
-          }
-        }
-        free(scnNameNew);
-        free(scnNameRef);
+        retval=ms->idx;
       }
-      logprintf(ELL_INFO_V1,ELS_SYMBOL,"found symbol %s at index %i\n",symbolName,i);
-      retval=i;
     }
-    else
+    break;
+  }
+  if(STT_SECTION==query.type)
+  {
+    for(uint i=0;i<matcher->numSectionSymbols;i++)
     {
-      free(symnameUnmangled);
+      MatcherSymbol* ms=&matcher->symbols[matcher->sectionSymbols[i]];
+      if(ms->idx>retval && matcherSymbolMatches(e,ms,&query,flags))
+      {
+        retval=ms->idx;
+      }
     }
   }
-  
-  if(symbolNameUnmangled!=symbolName)
+  if(STN_UNDEF!=retval)
   {
-    free(symbolNameUnmangled);
+    logprintf(ELL_INFO_V1,ELS_SYMBOL,"found symbol %s at index %i\n",query.name,(int)retval);
   }
-  free(symbolNameDot);
   return retval;
 }
 
@@ -328,117 +698,200 @@ int reindexSymbol(ElfInfo* old,ElfInfo* new,int oldIdx,int flags)
   return idx;
 }
 
-//flags is OR'd E_SYMBOL_FIND_FLAGS
-//only ESFF_MANGLED_OK and ESFF_DYNAMIC are relevant
-int getSymtabIdx(ElfInfo* e,char* symbolName,int flags)
+//reindex n symbols from old into new at once, replacing each index
+//in indices with its index in new (STN_UNDEF if it cannot be found).
+//Returns how many could not be reindexed
+int reindexSymbols(ElfInfo* old,ElfInfo* new,idx_t* indices,int n,int flags)
 {
-  //todo: need to consider endianness?
-  //assert(e->hashTableData);
-  assert(e->strTblIdx>0);
-  
-  //Hash table only contains dynamic symbols, don't use it here
-  /*
-  int nbucket, nchain;
-  memcpy(&nbucket,hashTableData->d_buf,sizeof(ElfXX_Word));
-  memcpy(&nchain,hashTableData->d_buf+sizeof(ElfXX_Word),sizeof(ElfXX_Word));
-  logprintf(ELL_INFO_V4,ELS_MISC,"there are %i buckets, %i chain entries, and total size of %i\n",nbucket,nchain,hashTableData->d_size);
-
-
-  unsigned long int hash=elf_hash(symbolName)%nbucket;
-  logprintf(ELL_INFO_V4,ELS_MISC,"hash is %lu\n",hash);
-  //get the index from the bucket
-  int idx;
-  memcpy(&idx,hashTableData->d_buf+sizeof(ElfXX_Word)*(2+hash),sizeof(ElfXX_Word));
-  int nextIdx=idx;
-  char* symname="";
-  while(strcmp(symname,symbolName))
-  {
-    idx=nextIdx;
-    logprintf(ELL_INFO_V4,ELS_MISC,"idx is %i\n",idx);
-    if(STN_UNDEF==idx)
+  int numFailed=0;
+  for(int i=0;i<n;i++)
+  {
+    indices[i]=reindexSymbol(old,new,indices[i],flags);
+    if(STN_UNDEF==indices[i])
     {
-      fprintf(stderr,"Symbol '%s' not defined\n",symbolName);
-      return STN_UNDEF;
+      numFailed++;
     }
-    GElf_Sym sym;
-    
-    if(!gelf_getsym(symTabData,idx,&sym))
+  }
+  return numFailed;
+}
+
+//brings firstSymbol and firstUnversionedSymbol up to date with the
+//symbol table. Symbols are only ever appended (see
+//addSymtabEntryToExisting and addSymtabEntry), so only the new ones
+//need looking at unless the table has shrunk
+static void indexSymbolNames(ElfInfo* e,bool dynamic)
+{
+  struct SymbolNamePool* pool=getSymbolNamePool(e);
+  Elf_Data* symTabData=getDataByERS(e,dynamic?ERS_DYNSYM:ERS_SYMTAB);
+  uint numSymbols=symTabData->d_size/sizeof(ElfXX_Sym);
+  if(numSymbols<pool->numIndexed[dynamic])
+  {
+    for(uint i=0;i<pool->numNames;i++)
     {
-      fprintf(stderr,"Error getting symbol with idx %i from symbol table. Error is: %s\n",idx,elf_errmsg(-1));
-      
+      pool->names[i]->firstSymbol[dynamic]=0;
+      pool->names[i]->firstUnversionedSymbol[dynamic]=0;
     }
-    symname=elf_strptr(e,strTblIdx,sym.st_name);
-    //update index for the next go-around if need be from the chain table
-    memcpy(&nextIdx,hashTableData->d_buf+sizeof(ElfXX_Word)*(2+nbucket+idx),sizeof(ElfXX_Word));
+    pool->numIndexed[dynamic]=0;
   }
-  return idx;
-  */
+  for(uint i=pool->numIndexed[dynamic];i<numSymbols;i++)
+  {
+    ElfXX_Sym sym;
+    memcpy(&sym,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
+    InternedName* interned=internSymbolName(e,dynamic,sym.st_name);
+    //keep the first symbol with a given name, as a linear search would
+    if(!interned->firstSymbol[dynamic])
+    {
+      interned->firstSymbol[dynamic]=i+1;
+    }
+    if(!interned->unversioned->firstUnversionedSymbol[dynamic])
+    {
+      interned->unversioned->firstUnversionedSymbol[dynamic]=i+1;
+    }
+  }
+  pool->numIndexed[dynamic]=numSymbols;
+}
+
+//flags is OR'd E_SYMBOL_FIND_FLAGS
+//only ESFF_MANGLED_OK and ESFF_DYNAMIC are relevant
+int getSymtabIdx(ElfInfo* e,char* symbolName,int flags)
+{
+  assert(e->strTblIdx>0);
 
-  Elf_Data* symTabData=NULL;
-  char* (*getstrfunc)(ElfInfo*,int)=NULL;
-  if(flags & ESFF_NEW_DYNAMIC)
+  //the .hash section only covers dynamic symbols and .gnu.hash skips
+  //undefined ones, so we keep our own index of each table
+  bool dynamic=flags & ESFF_NEW_DYNAMIC;
+  bool unversioned=flags & ESFF_MANGLED_OK;
+  indexSymbolNames(e,dynamic);
+  InternedName* interned=findInternedName(e,symbolName,symbolNameKeyLen(symbolName,unversioned));
+  idx_t first=0;
+  if(interned)
   {
-    symTabData=getDataByERS(e,ERS_DYNSYM);
-    getstrfunc=&getDynString;
+    first=unversioned?interned->firstUnversionedSymbol[dynamic]:interned->firstSymbol[dynamic];
   }
-  else
+  if(first)
   {
-    symTabData=getDataByERS(e,ERS_SYMTAB);
-    getstrfunc=&getString;
+    return first-1;
   }
+  logprintf(ELL_INFO_V1,ELS_SYMBOL,"Symbol '%s' not defined yet. This may or may not be a problem\n",symbolName);
+  return STN_UNDEF;
+}
 
-  char* symbolNameUnmangled=symbolName;
-  if(flags & ESFF_MANGLED_OK)
+//symbols of one type sorted by address for findSymbolContainingAddress
+typedef struct
+{
+  addr_t start;
+  addr_t end;//exclusive, symbols of size 0 still contain their own address
+  addr_t maxEnd;//greatest end of this and all earlier ranges
+  idx_t idx;
+  idx_t shndx;
+} SymbolAddressRange;
+
+struct SymbolAddressIndex
+{
+  SymbolAddressRange* ranges;
+  int numRanges;
+  uint numIndexed;//how many symbols of the table have been seen
+};
+
+static int cmpSymbolAddressRanges(const void* a,const void* b)
+{
+  const SymbolAddressRange* rangeA=a;
+  const SymbolAddressRange* rangeB=b;
+  if(rangeA->start!=rangeB->start)
   {
-    symbolNameUnmangled=unmangleSymbolName(symbolName);
+    return rangeA->start<rangeB->start?-1:1;
   }
+  return rangeA->idx<rangeB->idx?-1:(rangeA->idx>rangeB->idx?1:0);
+}
 
+static void freeSymbolAddressIndex(struct SymbolAddressIndex* index)
+{
+  if(index)
+  {
+    free(index->ranges);
+    free(index);
+  }
+}
 
-
-  bool found=false;
-  //traverse the symbol table to find the symbol we're looking for. Yes this is slow
-  //todo: build our own hash table since the .hash section seems incomplete
-  int i;
-  for (i = 0; i < e->symTabCount; ++i)
+//brings the index up to date with the symbol table. Symbols appended
+//since the last lookup (such as those added to patchedBin when
+//applying a patch) are sorted on their own and merged in. Symbols
+//changed in place aren't noticed, whoever changes them must call
+//invalidateSymbolAddressIndexes
+static void updateSymbolAddressIndex(ElfInfo* e,struct SymbolAddressIndex* index,byte type)
+{
+  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
+  uint numSymbols=symTabData->d_size/sizeof(ElfXX_Sym);
+  if(numSymbols<index->numIndexed)
+  {
+    index->numRanges=0;
+    index->numIndexed=0;
+  }
+  if(numSymbols==index->numIndexed)
+  {
+    return;
+  }
+  //start at 1 because symbol 0 is never a real symbol
+  uint firstNew=index->numIndexed?index->numIndexed:1;
+  SymbolAddressRange* newRanges=zmalloc((numSymbols-firstNew+1)*sizeof(SymbolAddressRange));
+  int numNew=0;
+  for(uint i=firstNew;i<numSymbols;i++)
   {
     GElf_Sym sym;
-    gelf_getsym(symTabData,i,&sym);
-    char* symname=(*getstrfunc)(e,sym.st_name);
-    char* symnameUnmangled=symname;
-    if(flags & ESFF_MANGLED_OK)
-    {
-      symnameUnmangled=unmangleSymbolName(symname);
-    }
-    if(!strcmp(symnameUnmangled,symbolNameUnmangled))
+    if(!gelf_getsym(symTabData,i,&sym))
+    {death("gelf_getsym failed\n");}
+    if(ELFXX_ST_TYPE(sym.st_info)!=type)
     {
-      found=true;
+      continue;
     }
-    if(symnameUnmangled!=symname)
+    SymbolAddressRange* range=&newRanges[numNew++];
+    range->start=sym.st_value;
+    range->end=sym.st_value+(sym.st_size?sym.st_size:1);
+    range->idx=i;
+    range->shndx=sym.st_shndx;
+  }
+  index->numIndexed=numSymbols;
+  if(!numNew)
+  {
+    free(newRanges);
+    return;
+  }
+  qsort(newRanges,numNew,sizeof(SymbolAddressRange),cmpSymbolAddressRanges);
+
+  //merge the new ranges in with the old ones
+  SymbolAddressRange* merged=zmalloc((index->numRanges+numNew)*sizeof(SymbolAddressRange));
+  int numMerged=0;
+  for(int i=0,j=0;i<index->numRanges || j<numNew;)
+  {
+    if(j==numNew || (i<index->numRanges &&
+                     cmpSymbolAddressRanges(&index->ranges[i],&newRanges[j])<0))
     {
-      free(symnameUnmangled);
+      merged[numMerged++]=index->ranges[i++];
     }
-    if(found)
+    else
     {
-      break;
+      merged[numMerged++]=newRanges[j++];
     }
   }
-  if(symbolNameUnmangled!=symbolName)
-  {
-    free(symbolNameUnmangled);
-  }
-  if(found)
+  for(int i=0;i<numMerged;i++)
   {
-    return i;
+    merged[i].maxEnd=merged[i].end;
+    if(i && merged[i-1].maxEnd>merged[i].maxEnd)
+    {
+      merged[i].maxEnd=merged[i-1].maxEnd;
+    }
   }
-  logprintf(ELL_INFO_V1,ELS_SYMBOL,"Symbol '%s' not defined yet. This may or may not be a problem\n",symbolName);
-  return STN_UNDEF;
+  free(index->ranges);
+  free(newRanges);
+  index->ranges=merged;
+  index->numRanges=numMerged;
 }
 
 //find the index of a symbol whose st_value is addr or where
 //addr>st_value && addr<st_value+st_size
 //only match symbols whose type is type and are for section scnIdx
 //pass SHN_UNDEF for scnIdx to accept symbols referencing any section
-//todo: this is slow. Could do smth much faster with interval tress or something
+//if several symbols contain addr, the one with the lowest index wins
 idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
 {
   if(!hasERS(e, ERS_SYMTAB))
@@ -446,22 +899,62 @@ idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
     //we don't have a .symtab, can't guess a function
     return STN_UNDEF;
   }
-  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
-  for (int i = 1; i < e->symTabCount; ++i)
+  assert(type<NUM_SYMBOL_ADDRESS_INDEXES);
+  struct SymbolAddressIndex* index=e->symbolAddressIndexes[type];
+  if(!index)
   {
-    GElf_Sym sym;
-    if(!gelf_getsym(symTabData,i,&sym))
-    {death("gelf_getsym failed\n");}
-    if(ELFXX_ST_TYPE(sym.st_info)==type &&
-       (sym.st_shndx==scnIdx || SHN_UNDEF==scnIdx) &&
-       (sym.st_value==addr || 
-        (sym.st_value<=addr &&
-         sym.st_value+sym.st_size > addr)))
-       
+    index=zmalloc(sizeof(struct SymbolAddressIndex));
+    e->symbolAddressIndexes[type]=index;
+  }
+  updateSymbolAddressIndex(e,index,type);
+
+  //find the last range starting at or before addr
+  int low=0;
+  int high=index->numRanges;
+  while(low<high)
+  {
+    int mid=low+(high-low)/2;
+    if(index->ranges[mid].start<=addr)
+    {
+      low=mid+1;
+    }
+    else
     {
-      return i;
+      high=mid;
     }
   }
-  return STN_UNDEF;
+  //and walk back through every range that could still reach addr.
+  //Symbols rarely overlap so this is usually only a step or two
+  idx_t retval=STN_UNDEF;
+  for(int i=low-1;i>=0 && index->ranges[i].maxEnd>addr;i--)
+  {
+    SymbolAddressRange* range=&index->ranges[i];
+    if(range->end>addr && (range->shndx==scnIdx || SHN_UNDEF==scnIdx) &&
+       (STN_UNDEF==retval || range->idx<retval))
+    {
+      retval=range->idx;
+    }
+  }
+  return retval;
+}
+
+void invalidateSymbolAddressIndexes(ElfInfo* e)
+{
+  for(int i=0;i<NUM_SYMBOL_ADDRESS_INDEXES;i++)
+  {
+    freeSymbolAddressIndex(e->symbolAddressIndexes[i]);
+    e->symbolAddressIndexes[i]=NULL;
+  }
 }
 
+void freeSymbolIndexes(ElfInfo* e)
+{
+  freeSymbolNamePool(e->symbolNamePool);
+  e->symbolNamePool=NULL;
+  for(int i=0;i<NUM_SYMBOL_MATCHERS;i++)
+  {
+    freeSymbolMatcher(e->symbolMatchers[i]);
+    e->symbolMatchers[i]=NULL;
+  }
+  invalidateSymbolAddressIndexes(e);
+}
@@ -85,10 +85,24 @@ ElfXX_Sym gelfSymToNativeSym(GElf_Sym);
 //from an index of a symbol in the old ELF structure,
 //find it's index in the new ELF structure. Return -1 if it cannot be found
 int reindexSymbol(ElfInfo* old,ElfInfo* new,int oldIdx,int flags);
+//reindex every index in indices in place, leaving STN_UNDEF for any
+//that cannot be found. Returns how many could not be found
+int reindexSymbols(ElfInfo* old,ElfInfo* new,idx_t* indices,int n,int flags);
 
 //flags is OR'd E_SYMBOL_FIND_FLAGS
 //only ESFF_MANGLED_OK and ESFF_DYNAMIC are relevant
 int getSymtabIdx(ElfInfo* e,char* symbolName,int flags);
+//gets the name of the symbol in .symtab, demangled if it is a C++
+//name. The string belongs to e and must not be freed
+char* getDemangledSymbolName(ElfInfo* e,idx_t symIdx);
+
+//releases the lookup tables getSymtabIdx, findSymbol and
+//findSymbolContainingAddress build, called from endELF
+void freeSymbolIndexes(ElfInfo* e);
+//must be called after changing the st_value, st_size, type or
+//section of a symbol already in e's .symtab (with gelf_update_sym,
+//say), findSymbolContainingAddress only notices appended symbols
+void invalidateSymbolAddressIndexes(ElfInfo* e);
 
 //pass SHN_UNDEF for scnIdx to accept symbols referencing any section
 idx_t findSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx);
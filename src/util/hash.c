@@ -104,3 +104,15 @@ uint64_t hash64Bit(uint64_t key)
   key = key + (key << 31);
   return key;
 }
+
+//64-bit FNV-1a over an arbitrary buffer
+uint64_t hashBytes(const unsigned char* data,size_t len)
+{
+  uint64_t hash=0xcbf29ce484222325ULL;
+  for(size_t i=0;i<len;i++)
+  {
+    hash^=data[i];
+    hash*=0x100000001b3ULL;
+  }
+  return hash;
+}
@@ -59,6 +59,7 @@
 #define _HASH_H__
 
 #include <stdint.h> //for uint32_t and uint64_t
+#include <stddef.h> //for size_t
 
 
 #if __WORDSIZE==64
@@ -74,4 +75,7 @@ unsigned long hash1(char*);
 unsigned long hashInt(int);
 uint32_t hash32Bit(uint32_t key);
 uint64_t hash64Bit(uint64_t key);
+//64-bit FNV-1a hash of len bytes of data. Used to look up names in
+//the interned symbol name tables (see symbol.c)
+uint64_t hashBytes(const unsigned char* data,size_t len);
 #endif
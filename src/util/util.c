@@ -128,3 +128,10 @@ char* getHexDataString(byte* data,int len)
   }
   return buf;
 }
+
+long millisSince(struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (now.tv_sec-start->tv_sec)*1000L+(now.tv_nsec-start->tv_nsec)/1000000L;
+}
@@ -62,6 +62,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <elf.h>
+#include <time.h>
 
 typedef unsigned char byte;
 typedef signed char sbyte;
@@ -108,4 +109,7 @@ int getFileLength(FILE* f);
 //get a hexadecimal string version of binary string
 char* getHexDataString(byte* data,int len);
 
+//milliseconds elapsed on CLOCK_MONOTONIC since start
+long millisSince(struct timespec* start);
+
 #endif
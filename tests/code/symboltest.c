@@ -0,0 +1,446 @@
+/*
+  File: symboltest.c
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version. Regardless of
+  which version is chose, the following stipulation also applies:
+    
+  Any redistribution must include copyright notice attribution to
+  Dartmouth College as well as the Warranty Disclaimer below, as well as
+  this list of conditions in any related documentation and, if feasible,
+  on the redistributed software; Any redistribution must include the
+  acknowledgment, “This product includes software developed by Dartmouth
+  College,” in any related documentation and, if feasible, in the
+  redistributed software; and The names “Dartmouth” and “Dartmouth
+  College” may not be used to endorse or promote products derived from
+  this software.  
+
+  WARRANTY DISCLAIMER
+
+  PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+  SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+  OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+  HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+  DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+  EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+  SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+  PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+  OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+  IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+  WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+  PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+  ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+  INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+  INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+  DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+  THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+  PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGES.
+
+  The complete text of the license may be found in the file COPYING
+  which should have been distributed with this software. The GNU
+  General Public License may be obtained at
+  http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: regression test for the symbol lookup indexes. Checks
+               getSymtabIdx, findSymbol, findSymbolContainingAddress and
+               getDemangledSymbolName against the linear scans they
+               replaced, on a real binary (this program unless another
+               is given) and on a copy of it with symbols appended and
+               rewritten the way applying a patch does
+*/
+
+#include "../../src/symbol.h"
+#include "../../src/elfparse.h"
+#include "../../src/elfutil.h"
+#include "../../src/elfwriter.h"
+#include "../../src/util/util.h"
+#include "../../src/util/logging.h"
+#include "../../src/util/cxxutil.h"
+#include "../../src/katana_config.h"
+#include <string.h>
+#include <unistd.h>
+
+//look up at most about this many of the binary's symbols, the old
+//scans are quadratic
+#define MAX_SYMBOLS_CHECKED 2000
+
+static int numChecks=0;
+
+static void fail(char* what,char* name,int expected,int got)
+{
+  fprintf(stderr,"%s of '%s' gave %i, the linear scan gives %i\n",what,name?name:"(null)",got,expected);
+  abort();
+}
+
+//the linear scans, as they were before the indexes
+
+static char* unmangleSymbolName(char* name)
+{
+  char* symbolNameUnmangled=NULL;
+  char* atSignPtr=strchr(name,'@');
+  if(atSignPtr)
+  {
+    symbolNameUnmangled=zmalloc(strlen(name)+1);
+    int atSignIdx=atSignPtr-name;
+    strcpy(symbolNameUnmangled,name);
+    symbolNameUnmangled[atSignIdx]='\0';
+  }
+  else
+  {
+    symbolNameUnmangled=strdup(name);
+  }
+  return symbolNameUnmangled;
+}
+
+static int oldGetSymtabIdx(ElfInfo* e,char* symbolName,int flags)
+{
+  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
+  char* symbolNameUnmangled=symbolName;
+  if(flags & ESFF_MANGLED_OK)
+  {
+    symbolNameUnmangled=unmangleSymbolName(symbolName);
+  }
+  //this used e->symTabCount, which copies made with duplicateElf
+  //don't keep up to date as symbols are appended
+  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
+  int retval=STN_UNDEF;
+  for(int i=0;i<numEntries;i++)
+  {
+    GElf_Sym sym;
+    gelf_getsym(symTabData,i,&sym);
+    char* symname=getString(e,sym.st_name);
+    char* symnameUnmangled=symname;
+    if(flags & ESFF_MANGLED_OK)
+    {
+      symnameUnmangled=unmangleSymbolName(symname);
+    }
+    bool found=!strcmp(symnameUnmangled,symbolNameUnmangled);
+    if(symnameUnmangled!=symname)
+    {
+      free(symnameUnmangled);
+    }
+    if(found)
+    {
+      retval=i;
+      break;
+    }
+  }
+  if(symbolNameUnmangled!=symbolName)
+  {
+    free(symbolNameUnmangled);
+  }
+  return retval;
+}
+
+//section names with the ".symname" of -ffunction-sections and
+//-fdata-sections stripped
+static char* oldSectionName(ElfInfo* e,int shndx,char* symbolNameDot)
+{
+  Elf_Scn* scn=elf_getscn(e->e,shndx);
+  GElf_Shdr shdr;
+  gelf_getshdr(scn,&shdr);
+  char* scnName=strdup(getScnHdrString(e,shdr.sh_name));
+  if(strEndsWith(scnName,symbolNameDot))
+  {
+    scnName[strlen(scnName)-strlen(symbolNameDot)]='\0';
+  }
+  return scnName;
+}
+
+//ESFF_VERSIONED_SECTIONS_OK is left out, it needs a patch version
+static idx_t oldFindSymbol(ElfInfo* e,GElf_Sym* sym,ElfInfo* ref,int flags)
+{
+  idx_t retval=STN_UNDEF;
+  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
+  char* symbolName=getString(ref,sym->st_name);
+  char* symbolNameUnmangled=symbolName;
+  if(flags & ESFF_MANGLED_OK)
+  {
+    symbolNameUnmangled=unmangleSymbolName(symbolName);
+  }
+  char* symbolNameDot=zmalloc(strlen(symbolName)+2);
+  strcpy(symbolNameDot,".");
+  strcat(symbolNameDot,symbolName);
+  int bind=ELF64_ST_BIND(sym->st_info);
+  int type=ELF64_ST_TYPE(sym->st_info);
+  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
+  for(int i=1;i<numEntries;i++)
+  {
+    ElfXX_Sym sym2;
+    memcpy(&sym2,symTabData->d_buf+i*sizeof(ElfXX_Sym),sizeof(ElfXX_Sym));
+    char* symname=getString(e,sym2.st_name);
+    char* symnameUnmangled=unmangleSymbolName(symname);
+    bool nameMatches=(STT_SECTION==type && STT_SECTION==ELFXX_ST_TYPE(sym2.st_info)) ||
+      !strcmp(symnameUnmangled,symbolNameUnmangled);
+    free(symnameUnmangled);
+    if(!nameMatches || bind!=ELFXX_ST_BIND(sym2.st_info) || sym->st_other!=sym2.st_other)
+    {
+      continue;
+    }
+    int type2=ELFXX_ST_TYPE(sym2.st_info);
+    if(type!=STT_NOTYPE && type2!=STT_NOTYPE && type!=type2)
+    {
+      continue;
+    }
+    int shndxRef=sym->st_shndx;
+    int shndxNew=sym2.st_shndx;
+    if(shndxRef!=SHN_UNDEF && shndxNew!=SHN_UNDEF &&
+       shndxRef!=SHN_COMMON && shndxNew!=SHN_COMMON)
+    {
+      char* scnNameRef=oldSectionName(ref,shndxRef,symbolNameDot);
+      char* scnNameNew=oldSectionName(e,shndxNew,symbolNameDot);
+      bool sameSection=!strcmp(scnNameRef,scnNameNew) ||
+        (type!=STT_SECTION && (flags & ESFF_BSS_MATCH_DATA_OK) &&
+         ((!strncmp(scnNameRef,".data",strlen(".data")) && !strncmp(scnNameNew,".bss",strlen(".bss"))) ||
+          (!strncmp(scnNameRef,".bss",strlen(".bss")) && !strncmp(scnNameNew,".data",strlen(".data")))));
+      free(scnNameRef);
+      free(scnNameNew);
+      if(!sameSection)
+      {
+        continue;
+      }
+    }
+    retval=i;
+  }
+  if(symbolNameUnmangled!=symbolName)
+  {
+    free(symbolNameUnmangled);
+  }
+  free(symbolNameDot);
+  return retval;
+}
+
+static idx_t oldFindSymbolContainingAddress(ElfInfo* e,addr_t addr,byte type,idx_t scnIdx)
+{
+  Elf_Data* symTabData=getDataByERS(e,ERS_SYMTAB);
+  int numEntries=symTabData->d_size/sizeof(ElfXX_Sym);
+  for(int i=1;i<numEntries;i++)
+  {
+    GElf_Sym sym;
+    gelf_getsym(symTabData,i,&sym);
+    if(ELFXX_ST_TYPE(sym.st_info)==type &&
+       (sym.st_shndx==scnIdx || SHN_UNDEF==scnIdx) &&
+       (sym.st_value==addr ||
+        (sym.st_value<=addr && sym.st_value+sym.st_size>addr)))
+    {
+      return i;
+    }
+  }
+  return STN_UNDEF;
+}
+
+static char* oldDemangledSymbolName(ElfInfo* e,idx_t symIdx)
+{
+  GElf_Sym sym;
+  getSymbol(e,symIdx,&sym);
+  char* name=getString(e,sym.st_name);
+  if(name[0]=='_' && name[1]=='Z')
+  {
+    return demangleName(name);
+  }
+  return strdup(name);
+}
+
+static void checkName(ElfInfo* e,char* name)
+{
+  int flags[]={0,ESFF_MANGLED_OK};
+  for(int i=0;i<sizeof(flags)/sizeof(int);i++)
+  {
+    int expected=oldGetSymtabIdx(e,name,flags[i]);
+    int got=getSymtabIdx(e,name,flags[i]);
+    if(expected!=got)
+    {
+      fail(flags[i]?"getSymtabIdx with ESFF_MANGLED_OK":"getSymtabIdx",name,expected,got);
+    }
+    numChecks++;
+  }
+}
+
+static void checkSymbol(ElfInfo* e,idx_t idx)
+{
+  GElf_Sym sym;
+  getSymbol(e,idx,&sym);
+  char* name=strdup(getString(e,sym.st_name));
+  checkName(e,name);
+
+  int flags[]={0,ESFF_MANGLED_OK,ESFF_BSS_MATCH_DATA_OK};
+  for(int i=0;i<sizeof(flags)/sizeof(int);i++)
+  {
+    idx_t expected=oldFindSymbol(e,&sym,e,flags[i]);
+    idx_t got=findSymbol(e,&sym,e,flags[i]);
+    if(expected!=got)
+    {
+      fail("findSymbol",name,expected,got);
+    }
+    numChecks++;
+  }
+
+  byte type=ELFXX_ST_TYPE(sym.st_info);
+  if(sym.st_value && type<=STT_HIPROC)
+  {
+    addr_t addrs[]={sym.st_value,sym.st_value+sym.st_size/2,sym.st_value+sym.st_size};
+    for(int i=0;i<sizeof(addrs)/sizeof(addr_t);i++)
+    {
+      idx_t expected=oldFindSymbolContainingAddress(e,addrs[i],type,SHN_UNDEF);
+      idx_t got=findSymbolContainingAddress(e,addrs[i],type,SHN_UNDEF);
+      if(expected!=got)
+      {
+        fail("findSymbolContainingAddress",name,expected,got);
+      }
+      expected=oldFindSymbolContainingAddress(e,addrs[i],type,sym.st_shndx);
+      got=findSymbolContainingAddress(e,addrs[i],type,sym.st_shndx);
+      if(expected!=got)
+      {
+        fail("findSymbolContainingAddress in its own section",name,expected,got);
+      }
+      numChecks+=2;
+    }
+  }
+
+  char* expectedName=oldDemangledSymbolName(e,idx);
+  char* gotName=getDemangledSymbolName(e,idx);
+  if(strcmp(expectedName,gotName))
+  {
+    fprintf(stderr,"getDemangledSymbolName of [%i] gave '%s', expected '%s'\n",(int)idx,gotName,expectedName);
+    abort();
+  }
+  numChecks++;
+  free(expectedName);
+  free(name);
+}
+
+//checks a spread of the symbols of e, and every one from firstAll on
+static void checkSymbols(ElfInfo* e,int firstAll)
+{
+  int numSymbols=getDataByERS(e,ERS_SYMTAB)->d_size/sizeof(ElfXX_Sym);
+  int step=numSymbols/MAX_SYMBOLS_CHECKED+1;
+  for(int i=1;i<numSymbols;i++)
+  {
+    if(i%step==0 || i>=firstAll)
+    {
+      checkSymbol(e,i);
+    }
+  }
+}
+
+//first symbol of the given type with a non-empty name, STN_UNDEF if none
+static idx_t findSymbolOfType(ElfInfo* e,byte type,bool named)
+{
+  int numSymbols=getDataByERS(e,ERS_SYMTAB)->d_size/sizeof(ElfXX_Sym);
+  for(int i=1;i<numSymbols;i++)
+  {
+    GElf_Sym sym;
+    getSymbol(e,i,&sym);
+    if(ELFXX_ST_TYPE(sym.st_info)==type && (!named || strlen(getString(e,sym.st_name))))
+    {
+      return i;
+    }
+  }
+  return STN_UNDEF;
+}
+
+static idx_t appendSymbol(ElfInfo* e,GElf_Sym* sym,char* name)
+{
+  ElfXX_Sym native=gelfSymToNativeSym(*sym);
+  if(name)
+  {
+    native.st_name=addStrtabEntry(e,name);
+  }
+  return addSymtabEntry(e,getDataByERS(e,ERS_SYMTAB),&native);
+}
+
+int main(int argc,char** argv)
+{
+  loggingDefaults();
+  setDefaultConfig();
+  if(elf_version(EV_CURRENT)==EV_NONE)
+  {
+    death("Failed to init ELF library\n");
+  }
+  char* fname=argc>1?argv[1]:"/proc/self/exe";
+  ElfInfo* e=openELFFile(fname);
+  if(!e)
+  {
+    death("could not open %s\n",fname);
+  }
+  findELFSections(e);
+  if(!hasERS(e,ERS_SYMTAB))
+  {
+    death("%s has no .symtab to test with\n",fname);
+  }
+  int numOriginal=getDataByERS(e,ERS_SYMTAB)->d_size/sizeof(ElfXX_Sym);
+  checkSymbols(e,numOriginal);
+  checkName(e,"no_such_symbol_in_any_binary");
+
+  //now a copy with symbols added to it, as patchedBin gets when a
+  //patch is applied. The indexes were built above, so this also
+  //checks that they notice the new entries
+  char outfname[]="/tmp/katana-symboltest-XXXXXX";
+  int fd=mkstemp(outfname);
+  if(fd<0)
+  {
+    death("could not create a temporary file\n");
+  }
+  close(fd);
+  ElfInfo* copy=duplicateElf(e,outfname,false,true);
+  checkSymbols(copy,numOriginal);
+
+  idx_t funcIdx=findSymbolOfType(copy,STT_FUNC,true);
+  idx_t scnIdx=findSymbolOfType(copy,STT_SECTION,false);
+  if(STN_UNDEF==funcIdx)
+  {
+    death("%s has no named functions to test with\n",fname);
+  }
+  GElf_Sym funcSym;
+  getSymbol(copy,funcIdx,&funcSym);
+  char* funcName=strdup(getString(copy,funcSym.st_name));
+  char* versionedName=zmalloc(strlen(funcName)+strlen("@KATANA_TEST")+1);
+  sprintf(versionedName,"%s@KATANA_TEST",funcName);
+
+  //the same name again: getSymtabIdx keeps the first, findSymbol and
+  //findSymbolContainingAddress the highest and the lowest index
+  idx_t dupIdx=appendSymbol(copy,&funcSym,NULL);
+  //a versioned name only ESFF_MANGLED_OK lookups see as the same
+  idx_t versionedIdx=appendSymbol(copy,&funcSym,versionedName);
+  if(STN_UNDEF!=scnIdx)
+  {
+    //section symbols match each other whatever their names
+    GElf_Sym scnSym;
+    getSymbol(copy,scnIdx,&scnSym);
+    appendSymbol(copy,&scnSym,NULL);
+  }
+  if(getSymtabIdx(copy,funcName,0)!=funcIdx ||
+     getSymtabIdx(copy,versionedName,0)!=versionedIdx ||
+     getSymtabIdx(copy,versionedName,ESFF_MANGLED_OK)!=funcIdx ||
+     findSymbol(copy,&funcSym,copy,0)<dupIdx)
+  {
+    fprintf(stderr,"appended copies of '%s' at %i and %i were not seen as expected\n",funcName,(int)dupIdx,(int)versionedIdx);
+    abort();
+  }
+  checkSymbols(copy,numOriginal);
+  checkName(copy,versionedName);
+
+  //and a symbol moved in place, as relocateVar and
+  //applyFunctionPatch do
+  funcSym.st_value+=0x1000000;
+  gelf_update_sym(getDataByERS(copy,ERS_SYMTAB),funcIdx,&funcSym);
+  invalidateSymbolAddressIndexes(copy);
+  checkSymbol(copy,funcIdx);
+
+  free(versionedName);
+  free(funcName);
+  endELF(copy);
+  unlink(outfname);
+  endELF(e);
+  printf("%i symbol lookups agree with the linear scans\n",numChecks);
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+  File: v0/main.c
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Program with a table big enough to be transformed lazily
+               (katana -L). Nothing reads the table for the first few
+               iterations after the patch could have gone in, so the
+               transformation has to wait for the fault on its first
+               use. v1/main.c adds a field to the entries
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#define MILLISECOND 1000
+//enough entries that the table covers several pages
+#define NUM_FOOS 2048
+
+typedef struct _Foo
+{
+  int field1;
+  int field2;
+} Foo;
+
+Foo foos[NUM_FOOS]={{0,0}};
+int iteration=0;
+
+void printThings()
+{
+  iteration++;
+  if(iteration%10)
+  {
+    printf("iteration %i\n",iteration);
+  }
+  else
+  {
+    printf("foos: %i,%i %i,%i\n",foos[0].field1,foos[0].field2,
+           foos[NUM_FOOS-1].field1,foos[NUM_FOOS-1].field2);
+  }
+  fflush(stdout);
+}
+
+int main(int argc,char** argv)
+{
+  for(int i=0;i<NUM_FOOS;i++)
+  {
+    foos[i].field1=i;
+    foos[i].field2=2*i;
+  }
+  printf("has pid %i\n",getpid());
+  while(1)
+  {
+    printThings();
+    usleep(100*MILLISECOND);
+  }
+  return 0;
+}
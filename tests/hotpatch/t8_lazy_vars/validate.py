@@ -0,0 +1,49 @@
+#File: validate.py
+#Author: agent
+#Copyright (C): 2026 Dartmouth College
+#License: GNU General Public License
+#Date, October, 2026
+#Description: validate the output of a single unit test for katana
+
+
+import sys,re
+
+#transform variables of at least this many bytes on first use. The
+#table in this test is 16KB before patching, nothing else comes close
+katanaOptions=["-L","4096"]
+
+def validate(logname):
+  f=open(logname)
+  if not f:
+    sys.stderr.write("Cannot open log file for test8\n")
+    return False
+  regexIteration="iteration ([0-9]+)"
+  regexOld="foos: (0),(0) (2047),(4094)$"
+  regexNew="foos: (0),(0),(0) (2047),(4094),(0)$"
+  linecount=0
+  patched=False
+  for line in f:
+    linecount+=1
+    if line.startswith("has pid"):
+      continue
+    if re.match(regexIteration,line):
+      continue
+    if not patched and re.match(regexOld,line):
+      continue
+    if re.match(regexNew,line):
+      patched=True
+      continue
+    sys.stderr.write("Line "+str(linecount)+" did not match any expected pattern\n")
+    if patched:
+      sys.stderr.write("Note, patching has been done\n")
+    sys.stderr.write("Offending line is:\n")
+    sys.stderr.write(line)
+    return False
+  if not patched:
+    sys.stderr.write("It appears that hotpatching never happened\n")
+    return False
+  return True
+
+
+if __name__ == "__main__":
+  validate(sys.argv[1])
@@ -0,0 +1,114 @@
+/*
+  File: v0/main.c
+  Author: agent
+  Copyright (C): 2026 Dartmouth College
+  License: Katana is free software: you may redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 2 of the
+    License, or (at your option) any later version. Regardless of
+    which version is chose, the following stipulation also applies:
+    
+    Any redistribution must include copyright notice attribution to
+    Dartmouth College as well as the Warranty Disclaimer below, as well as
+    this list of conditions in any related documentation and, if feasible,
+    on the redistributed software; Any redistribution must include the
+    acknowledgment, “This product includes software developed by Dartmouth
+    College,” in any related documentation and, if feasible, in the
+    redistributed software; and The names “Dartmouth” and “Dartmouth
+    College” may not be used to endorse or promote products derived from
+    this software.  
+
+                             WARRANTY DISCLAIMER
+
+    PLEASE BE ADVISED THAT THERE IS NO WARRANTY PROVIDED WITH THIS
+    SOFTWARE, TO THE EXTENT PERMITTED BY APPLICABLE LAW. EXCEPT WHEN
+    OTHERWISE STATED IN WRITING, DARTMOUTH COLLEGE, ANY OTHER COPYRIGHT
+    HOLDERS, AND/OR OTHER PARTIES PROVIDING OR DISTRIBUTING THE SOFTWARE,
+    DO SO ON AN "AS IS" BASIS, WITHOUT WARRANTY OF ANY KIND, EITHER
+    EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE. THE ENTIRE RISK AS TO THE QUALITY AND PERFORMANCE OF THE
+    SOFTWARE FALLS UPON THE USER OF THE SOFTWARE. SHOULD THE SOFTWARE
+    PROVE DEFECTIVE, YOU (AS THE USER OR REDISTRIBUTOR) ASSUME ALL COSTS
+    OF ALL NECESSARY SERVICING, REPAIR OR CORRECTIONS.
+
+    IN NO EVENT UNLESS REQUIRED BY APPLICABLE LAW OR AGREED TO IN WRITING
+    WILL DARTMOUTH COLLEGE OR ANY OTHER COPYRIGHT HOLDER, OR ANY OTHER
+    PARTY WHO MAY MODIFY AND/OR REDISTRIBUTE THE SOFTWARE AS PERMITTED
+    ABOVE, BE LIABLE TO YOU FOR DAMAGES, INCLUDING ANY GENERAL, SPECIAL,
+    INCIDENTAL OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OR
+    INABILITY TO USE THE SOFTWARE (INCLUDING BUT NOT LIMITED TO LOSS OF
+    DATA OR DATA BEING RENDERED INACCURATE OR LOSSES SUSTAINED BY YOU OR
+    THIRD PARTIES OR A FAILURE OF THE PROGRAM TO OPERATE WITH ANY OTHER
+    PROGRAMS), EVEN IF SUCH HOLDER OR OTHER PARTY HAS BEEN ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGES.
+
+    The complete text of the license may be found in the file COPYING
+    which should have been distributed with this software. The GNU
+    General Public License may be obtained at
+    http://www.gnu.org/licenses/gpl.html
+
+  Project: Katana
+  Date: October 2026
+  Description: Program whose patch changes only code, built so that every
+               function starts with five 1 byte nops
+               (-fpatchable-function-entry=5, with -fcf-protection=none
+               so that no endbr comes before them) for the trampoline to
+               replace while the target runs. Worker threads call the
+               patched function nonstop. v1/main.c changes what it
+               computes
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MILLISECOND 1000
+#define NUM_WORKERS 2
+
+//noipa keeps the callers from being compiled with what this returns in
+//mind, every call has to go through the patched function
+__attribute__((noipa)) int compute(int x)
+{
+  return x*2;
+}
+
+//calls compute as often as it can, so that when the patch goes in
+//there is a good chance some thread is just entering it
+void* worker(void* arg)
+{
+  while(1)
+  {
+    for(int i=0;i<1000;i++)
+    {
+      int result=compute(i);
+      if(result!=2*i && result!=3*i)
+      {
+        printf("worker saw compute(%i)=%i\n",i,result);
+        fflush(stdout);
+      }
+    }
+  }
+  return NULL;
+}
+
+void printThings()
+{
+  printf("compute(7)=%i\n",compute(7));
+  fflush(stdout);
+}
+
+int main(int argc,char** argv)
+{
+  printf("has pid %i\n",getpid());
+  pthread_t workers[NUM_WORKERS];
+  for(int i=0;i<NUM_WORKERS;i++)
+  {
+    pthread_create(&workers[i],NULL,worker,NULL);
+  }
+  while(1)
+  {
+    printThings();
+    usleep(100*MILLISECOND);
+  }
+  return 0;
+}
@@ -0,0 +1,46 @@
+#File: validate.py
+#Author: agent
+#Copyright (C): 2026 Dartmouth College
+#License: GNU General Public License
+#Date, October, 2026
+#Description: validate the output of a single unit test for katana
+
+
+import sys,re
+def validate(logname):
+  f=open(logname)
+  if not f:
+    sys.stderr.write("Cannot open log file for test9\n")
+    return False
+  regexCompute="compute\\(7\\)=([0-9]+)$"
+  linecount=0
+  patched=False
+  for line in f:
+    linecount+=1
+    if line.startswith("has pid"):
+      continue
+    if line.startswith("worker saw"):
+      #a worker ran a half written trampoline or a mix of old and
+      #new code
+      sys.stderr.write("Line "+str(linecount)+" shows a bad result from compute\n")
+      sys.stderr.write(line)
+      return False
+    match=re.match(regexCompute,line)
+    if not match:
+      sys.stderr.write("Line "+str(linecount)+" did not match expected pattern\n")
+      sys.stderr.write("Offending line is:\n")
+      sys.stderr.write(line)
+      return False
+    if match.group(1)=="21":
+      patched=True
+    elif patched or match.group(1)!="14":
+      sys.stderr.write("compute(7) should be "+("21" if patched else "14 or 21")+", is "+match.group(1)+"\n")
+      return False
+  if not patched:
+    sys.stderr.write("It appears that hotpatching never happened\n")
+    return False
+  return True
+
+
+if __name__ == "__main__":
+  validate(sys.argv[1])
@@ -92,7 +92,8 @@ proc=subprocess.Popen(procCmd,stdout=logf)
 #sleep for a moment to let the process run
 time.sleep(0.5)
 #now start the hotpatcher
-args=["./katana","-p",patchOut,str(proc.pid)]
+#a test can ask for options to apply its patch with
+args=["./katana","-p"]+getattr(validateModule,"katanaOptions",[])+[patchOut,str(proc.pid)]
 vlogf.write("running\n " + " ".join(args) + "\n")
 vlogf.flush();
 kproc=subprocess.Popen(args,stdout=hotlogf,stderr=hotlogerrf)